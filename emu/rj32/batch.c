@@ -0,0 +1,415 @@
+// needed for open_memstream and sysconf when compiling with -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include "batch.h"
+#include "emurj.h"
+#include "image.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Job is one ROM from the manifest, along with the result of running it.
+typedef struct Job {
+  char *filename;
+  uint64_t maxCycles;
+  int expected;
+
+  // the exit code, or -1 if the job couldn't be run, which is what it starts
+  // as so a job no worker got to fails
+  int ret;
+  uint64_t cycles;
+  char *output;
+  size_t outputSize;
+} Job;
+
+// Queue is a worker's deque of jobs. The worker takes jobs from the back,
+// and other workers that run out of jobs steal from the front.
+typedef struct Queue {
+  pthread_mutex_t lock;
+  int *jobs;
+  int front;
+  int back;
+} Queue;
+
+typedef struct Batch {
+  Job *jobs;
+  int numJobs;
+  Queue *queues;
+  int numQueues;
+} Batch;
+
+typedef struct Worker {
+  Batch *batch;
+  int id;
+} Worker;
+
+static void runJob(Emu *emu, Job *job) {
+  FILE *out = open_memstream(&job->output, &job->outputSize);
+  Image image;
+  if (out == NULL || !imageOpen(&image, job->filename)) {
+    if (out != NULL) {
+      fprintf(out, "Unable to read %s\n", job->filename);
+      fclose(out);
+    }
+    job->ret = -1;
+    return;
+  }
+
+  emuSetOutput(emu, out);
+  if (emuLoadImage(emu, &image)) {
+    job->ret = emuRun(emu, job->maxCycles, false);
+    job->cycles = emuCycles(emu);
+  } else {
+    fprintf(out, "Out of memory\n");
+    job->ret = -1;
+  }
+  emuSetOutput(emu, NULL);
+
+  // the emulator reads data pages from the image until it's reset
+  emuReset(emu);
+  fclose(out);
+  imageClose(&image);
+}
+
+// nextJob takes the next job from the worker's own queue, or steals one from
+// another worker. Returns -1 when there are no jobs left.
+static int nextJob(Batch *batch, int id) {
+  Queue *own = &batch->queues[id];
+  int job = -1;
+  pthread_mutex_lock(&own->lock);
+  if (own->back > own->front) {
+    job = own->jobs[--own->back];
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  for (int i = 1; job < 0 && i < batch->numQueues; i++) {
+    Queue *victim = &batch->queues[(id + i) % batch->numQueues];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->back > victim->front) {
+      job = victim->jobs[victim->front++];
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return job;
+}
+
+static void *worker(void *arg) {
+  Worker *w = arg;
+  Emu *emu = emuCreate();
+  if (emu == NULL) {
+    // the other workers take its jobs, and any left over fail
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  emuSetEngine(emu, ENGINE_JIT);
+
+  int job;
+  while ((job = nextJob(w->batch, w->id)) >= 0) {
+    runJob(emu, &w->batch->jobs[job]);
+  }
+
+  emuDestroy(emu);
+  return NULL;
+}
+
+// freeJobs frees the jobs and their results.
+static void freeJobs(Batch *batch) {
+  for (int i = 0; i < batch->numJobs; i++) {
+    free(batch->jobs[i].filename);
+    free(batch->jobs[i].output);
+  }
+  free(batch->jobs);
+  batch->jobs = NULL;
+  batch->numJobs = 0;
+}
+
+// freeQueues frees the workers' queues.
+static void freeQueues(Batch *batch) {
+  for (int i = 0; i < batch->numQueues; i++) {
+    pthread_mutex_destroy(&batch->queues[i].lock);
+    free(batch->queues[i].jobs);
+  }
+  free(batch->queues);
+  batch->queues = NULL;
+  batch->numQueues = 0;
+}
+
+// readManifest reads the jobs from the manifest file. Returns false, with no
+// jobs, if the file couldn't be read or has a malformed line, or if out of
+// memory.
+static bool readManifest(const char *manifest, Batch *batch) {
+  FILE *f = fopen(manifest, "r");
+  if (f == NULL) {
+    perror(manifest);
+    return false;
+  }
+
+  char line[4096];
+  int lineno = 0;
+  int cap = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    char filename[4096];
+    unsigned long long maxCycles;
+    int expected;
+    char *start = line + strspn(line, " \t\r\n");
+    if (*start == '\0' || *start == '#') {
+      continue;
+    }
+    if (sscanf(start, "%4095s %llu %d", filename, &maxCycles, &expected) !=
+        3) {
+      fprintf(stderr, "%s:%d: expected <rom> <max cycles> <exit code>\n",
+              manifest, lineno);
+      fclose(f);
+      freeJobs(batch);
+      return false;
+    }
+
+    Job job = {
+        .filename = strdup(filename),
+        .maxCycles = maxCycles,
+        .expected = expected,
+        .ret = -1,
+    };
+    if (batch->numJobs == cap) {
+      int grown = cap ? cap * 2 : 64;
+      Job *jobs = realloc(batch->jobs, grown * sizeof(Job));
+      if (jobs != NULL) {
+        batch->jobs = jobs;
+        cap = grown;
+      }
+    }
+    if (job.filename == NULL || batch->numJobs == cap) {
+      fprintf(stderr, "Out of memory\n");
+      free(job.filename);
+      fclose(f);
+      freeJobs(batch);
+      return false;
+    }
+    batch->jobs[batch->numJobs++] = job;
+  }
+  fclose(f);
+  return true;
+}
+
+// report prints the result of each job in the order they're listed, with the
+// output of the ones that failed, and frees them. Returns how many failed,
+// and adds up the cycles they ran in cycles.
+static int report(Batch *batch, uint64_t *cycles) {
+  int failed = 0;
+  for (int i = 0; i < batch->numJobs; i++) {
+    Job *job = &batch->jobs[i];
+    *cycles += job->cycles;
+    if (job->ret == job->expected) {
+      printf("PASS %s (%llu cycles)\n", job->filename,
+             (unsigned long long)job->cycles);
+    } else {
+      failed++;
+      printf("FAIL %s: exit code %d, expected %d (%llu cycles)\n",
+             job->filename, job->ret, job->expected,
+             (unsigned long long)job->cycles);
+      if (job->outputSize > 0) {
+        fwrite(job->output, 1, job->outputSize, stdout);
+        printf("\n");
+      }
+    }
+  }
+  freeJobs(batch);
+  return failed;
+}
+
+int runBatch(const char *manifest, int threads) {
+  Batch batch = {0};
+  if (!readManifest(manifest, &batch)) {
+    return 1;
+  }
+
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > batch.numJobs) {
+    threads = batch.numJobs;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  batch.queues = calloc(threads, sizeof(Queue));
+  pthread_t *tids = malloc(threads * sizeof(pthread_t));
+  Worker *workers = malloc(threads * sizeof(Worker));
+  bool ok = batch.queues != NULL && tids != NULL && workers != NULL;
+  for (int i = 0; ok && i < threads; i++) {
+    pthread_mutex_init(&batch.queues[i].lock, NULL);
+    batch.numQueues++;
+    batch.queues[i].jobs = malloc((batch.numJobs / threads + 1) * sizeof(int));
+    ok = batch.queues[i].jobs != NULL;
+  }
+  if (!ok) {
+    fprintf(stderr, "Out of memory\n");
+    freeQueues(&batch);
+    freeJobs(&batch);
+    free(tids);
+    free(workers);
+    return 1;
+  }
+
+  // deal the jobs out round robin, so each worker starts with its own share
+  for (int i = 0; i < batch.numJobs; i++) {
+    Queue *q = &batch.queues[i % threads];
+    q->jobs[q->back++] = i;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // if a thread can't be started, the ones that were take its jobs, and the
+  // batch fails
+  int started = 0;
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (Worker){.batch = &batch, .id = i};
+    if (pthread_create(&tids[i], NULL, worker, &workers[i]) != 0) {
+      fprintf(stderr, "Unable to start a worker thread\n");
+      ok = false;
+      break;
+    }
+    started++;
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double secs =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  uint64_t cycles = 0;
+  int numJobs = batch.numJobs;
+  int failed = report(&batch, &cycles);
+  printf("\n%d passed, %d failed, %llu cycles in %.3fs on %d threads (%.1f "
+         "MIPS)\n",
+         numJobs - failed, failed, (unsigned long long)cycles, secs,
+         started, secs > 0 ? cycles / secs / 1e6 : 0.0);
+
+  freeQueues(&batch);
+  free(tids);
+  free(workers);
+
+  return failed || !ok ? 1 : 0;
+}
+
+// Guest is a job run by runGuests, with its own emulator while it's running.
+typedef struct Guest {
+  Job *job;
+  Emu *emu;
+  FILE *out;
+
+  // the ROM, which the emulator reads data pages from until they're written
+  Image image;
+} Guest;
+
+// startGuest loads the job's ROM into a new emulator. Returns false if it
+// couldn't, in which case the job has already failed.
+static bool startGuest(Guest *guest, Job *job) {
+  guest->job = job;
+  guest->out = open_memstream(&job->output, &job->outputSize);
+  guest->emu = emuCreate();
+  bool opened = guest->out != NULL && imageOpen(&guest->image, job->filename);
+  bool loaded =
+      opened && guest->emu != NULL && emuLoadImage(guest->emu, &guest->image);
+  if (!loaded) {
+    if (opened) {
+      imageClose(&guest->image);
+    }
+    if (guest->out != NULL) {
+      fprintf(guest->out, opened ? "Out of memory\n" : "Unable to read %s\n",
+              job->filename);
+      fclose(guest->out);
+    }
+    emuDestroy(guest->emu);
+    job->ret = -1;
+    return false;
+  }
+  emuSetOutput(guest->emu, guest->out);
+  return true;
+}
+
+// finishGuest records the result of the job, and frees its emulator.
+static void finishGuest(Guest *guest) {
+  guest->job->ret = emuExitCode(guest->emu);
+  guest->job->cycles = emuCycles(guest->emu);
+  emuSetOutput(guest->emu, NULL);
+  emuDestroy(guest->emu);
+  imageClose(&guest->image);
+  fclose(guest->out);
+}
+
+int runGuests(const char *manifest, uint64_t slice) {
+  Batch batch = {0};
+  if (!readManifest(manifest, &batch)) {
+    return 1;
+  }
+
+  // the guests that are still running, in the order they take turns
+  Guest *guests = calloc(batch.numJobs, sizeof(Guest));
+  int *running = malloc(batch.numJobs * sizeof(int));
+  if (batch.numJobs > 0 && (guests == NULL || running == NULL)) {
+    fprintf(stderr, "Out of memory\n");
+    freeJobs(&batch);
+    free(guests);
+    free(running);
+    return 1;
+  }
+  int numRunning = 0;
+  for (int i = 0; i < batch.numJobs; i++) {
+    if (startGuest(&guests[i], &batch.jobs[i])) {
+      running[numRunning++] = i;
+    }
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  uint64_t slices = 0;
+  uint64_t waiting = 0;
+  while (numRunning > 0) {
+    // each turn, the guests that finish drop out of the rotation
+    int kept = 0;
+    for (int i = 0; i < numRunning; i++) {
+      Guest *guest = &guests[running[i]];
+      uint64_t left = guest->job->maxCycles - emuCycles(guest->emu);
+      EmuStatus status = emuStep(guest->emu, left < slice ? left : slice);
+      slices++;
+      waiting += status == EMU_WAITING;
+      if ((status == EMU_RUNNING || status == EMU_WAITING) &&
+          emuCycles(guest->emu) < guest->job->maxCycles) {
+        running[kept++] = running[i];
+      } else {
+        finishGuest(guest);
+      }
+    }
+    numRunning = kept;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double secs =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  uint64_t cycles = 0;
+  int numJobs = batch.numJobs;
+  int failed = report(&batch, &cycles);
+  printf("\n%d passed, %d failed, %llu cycles in %.3fs as %d guests on one "
+         "thread, in %llu slices, %llu of them waiting (%.1f MIPS)\n",
+         numJobs - failed, failed, (unsigned long long)cycles, secs, numJobs,
+         (unsigned long long)slices, (unsigned long long)waiting,
+         secs > 0 ? cycles / secs / 1e6 : 0.0);
+
+  free(guests);
+  free(running);
+  return failed ? 1 : 0;
+}
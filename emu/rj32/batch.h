@@ -0,0 +1,24 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+
+// runBatch runs every ROM listed in the manifest file on a pool of worker
+// threads, and prints the results in the order they're listed. Each line of
+// the manifest is a ROM file name, the maximum number of cycles to run it
+// for, and the expected exit code, separated by whitespace. Blank lines and
+// lines starting with # are ignored. Each worker keeps one emulator for all
+// the ROMs it runs, and the output of each ROM is captured and only printed
+// if it fails. If threads is 0, one thread per CPU core is used. Returns 0 if
+// all the ROMs exited with the expected code.
+int runBatch(const char *manifest, int threads);
+
+// runGuests runs every ROM in the manifest at once, as guests taking turns
+// on a single thread, each running for a slice of at most slice cycles
+// before the next one's turn, so slice has to be at least 1. The guests all
+// run on the interpreter, which notices when one is waiting for a device
+// event and skips ahead. The results are printed the same way as runBatch.
+// Returns 0 if all the ROMs exited with the expected code.
+int runGuests(const char *manifest, uint64_t slice);
+
+#endif
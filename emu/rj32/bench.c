@@ -0,0 +1,317 @@
+#include "emurj.h"
+#include "inst.h"
+#include "lockstep.h"
+#include "profile.h"
+#include "trace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// This is a small benchmark of the emulator, running a handful of
+// representative programs and reporting the emulated MIPS for each. The
+// programs are assembled here with a tiny assembler, so the benchmark doesn't
+// need customasm to build.
+
+enum { RA, A0, A1, A2, S0, S1, S2, S3, T0, T1, T2, T3, T4, T5, GP, SP };
+
+#define MAX_LABELS 32
+#define MAX_FIXUPS 64
+
+// Asm is the state of the tiny assembler.
+typedef struct Asm {
+  uint16_t words[1024];
+  int len;
+  int labels[MAX_LABELS];
+  struct {
+    int at;
+    int label;
+  } fixups[MAX_FIXUPS];
+  int numFixups;
+} Asm;
+
+static void emit(Asm *a, uint16_t word) { a->words[a->len++] = word; }
+
+// prefix emits an imm prefix if value doesn't fit in the given signed range.
+static void prefix(Asm *a, int value, int lo, int hi) {
+  if (value < lo || value > hi) {
+    emit(a, 0b1101 | (((value >> 4) & 0xfff) << 4));
+  }
+}
+
+static void rr(Asm *a, Opcode op, int rd, int rs) {
+  emit(a, (rd << 12) | (rs << 8) | (op << 2));
+}
+
+static void ri(Asm *a, Opcode op, int rd, int value) {
+  prefix(a, value, -32, 31);
+  emit(a, (rd << 12) | ((value & 0x3f) << 6) | ((op & 0xf) << 2) | 0b11);
+}
+
+static void movei(Asm *a, int rd, int value) {
+  prefix(a, value, -128, 127);
+  emit(a, (rd << 12) | ((value & 0xff) << 4) | 0b001);
+}
+
+static void ls(Asm *a, Opcode op, int rd, int rs, int offset) {
+  prefix(a, offset, 0, 15);
+  emit(a, (rd << 12) | (rs << 8) | ((offset & 0xf) << 4) | ((op & 3) << 2) |
+              0b10);
+}
+
+static void label(Asm *a, int l) { a->labels[l] = a->len; }
+
+// branch emits a jump or call to a label, which is resolved by assemble.
+static void branch(Asm *a, Opcode op, int l) {
+  a->fixups[a->numFixups].at = a->len;
+  a->fixups[a->numFixups].label = l;
+  a->numFixups++;
+  emit(a, ((op & 2) << 3) | 0b0101);
+}
+
+static void assemble(Asm *a) {
+  for (int i = 0; i < a->numFixups; i++) {
+    int at = a->fixups[i].at;
+    int offset = a->labels[a->fixups[i].label] - at - 1;
+    a->words[at] |= (offset & 0x7ff) << 5;
+  }
+}
+
+#define HALT_INST(a) rr(a, HALT, 0, 0)
+#define RETURN(a) rr(a, JUMP, RA, RA)
+
+// counter is a pair of nested counting loops, mostly ALU ops and branches.
+static void counter(Asm *a) {
+  enum { OUTER, INNER };
+  movei(a, S0, 0);
+  movei(a, S1, 0);
+  label(a, OUTER);
+  movei(a, T0, 0);
+  label(a, INNER);
+  ri(a, ADD, T0, 1);
+  rr(a, ADD, S1, T0);
+  ri(a, IFULT, T0, 1000);
+  branch(a, JUMP, INNER);
+  ri(a, ADD, S0, 1);
+  ri(a, IFULT, S0, 5000);
+  branch(a, JUMP, OUTER);
+  HALT_INST(a);
+}
+
+// sieve counts the primes below 8192 with the sieve of Eratosthenes a few
+// times, which is load/store heavy.
+static void sieve(Asm *a) {
+  enum { REP, CLEAR, OUTER, MARK, NEXT, FAIL };
+  movei(a, S2, 0);
+  label(a, REP);
+  movei(a, T0, 0);
+  movei(a, T1, 0);
+  label(a, CLEAR);
+  ls(a, STORE, T1, T0, 0);
+  ri(a, ADD, T0, 1);
+  ri(a, IFULT, T0, 8192);
+  branch(a, JUMP, CLEAR);
+  movei(a, T0, 2);
+  movei(a, S1, 0);
+  label(a, OUTER);
+  ls(a, LOAD, T2, T0, 0);
+  ri(a, IFNE, T2, 0);
+  branch(a, JUMP, NEXT);
+  ri(a, ADD, S1, 1);
+  rr(a, MOVE, T3, T0);
+  rr(a, ADD, T3, T0);
+  label(a, MARK);
+  ri(a, IFUGE, T3, 8192);
+  branch(a, JUMP, NEXT);
+  ls(a, STORE, T0, T3, 0);
+  rr(a, ADD, T3, T0);
+  branch(a, JUMP, MARK);
+  label(a, NEXT);
+  ri(a, ADD, T0, 1);
+  ri(a, IFULT, T0, 8192);
+  branch(a, JUMP, OUTER);
+  ri(a, ADD, S2, 1);
+  ri(a, IFULT, S2, 100);
+  branch(a, JUMP, REP);
+  ri(a, IFNE, S1, 1028);
+  branch(a, JUMP, FAIL);
+  HALT_INST(a);
+  label(a, FAIL);
+  movei(a, A0, 1);
+  rr(a, ERROR, 0, 0);
+}
+
+// multiply calls a shift and add software multiply routine in a loop.
+static void multiply(Asm *a) {
+  enum { LOOP, MUL, MLOOP, MDONE };
+  movei(a, S0, 0);
+  movei(a, S1, 0);
+  label(a, LOOP);
+  rr(a, MOVE, A0, S0);
+  movei(a, A1, 0x2b5);
+  branch(a, CALL, MUL);
+  rr(a, ADD, S1, A0);
+  ri(a, ADD, S0, 1);
+  ri(a, IFULT, S0, 60000);
+  branch(a, JUMP, LOOP);
+  HALT_INST(a);
+
+  label(a, MUL);
+  movei(a, A2, 0);
+  label(a, MLOOP);
+  ri(a, IFEQ, A1, 0);
+  branch(a, JUMP, MDONE);
+  rr(a, MOVE, T0, A1);
+  ri(a, AND, T0, 1);
+  ri(a, IFNE, T0, 0);
+  rr(a, ADD, A2, A0);
+  ri(a, SHL, A0, 1);
+  ri(a, SHR, A1, 1);
+  branch(a, JUMP, MLOOP);
+  label(a, MDONE);
+  rr(a, MOVE, A0, A2);
+  RETURN(a);
+}
+
+// sort fills an array with pseudo-random numbers and bubble sorts it.
+static void sort(Asm *a) {
+  enum { REP, FILL, PASS, INNER, NOSWAP, CHECK, FAIL };
+  movei(a, S2, 0);
+  movei(a, T1, 1);
+  label(a, REP);
+  movei(a, T0, 0);
+  label(a, FILL);
+  rr(a, MOVE, T2, T1);
+  ri(a, SHL, T2, 2);
+  rr(a, ADD, T1, T2);
+  ri(a, ADD, T1, 13849);
+  ls(a, STORE, T1, T0, 0);
+  ri(a, ADD, T0, 1);
+  ri(a, IFULT, T0, 512);
+  branch(a, JUMP, FILL);
+  movei(a, S0, 511);
+  label(a, PASS);
+  movei(a, T0, 0);
+  label(a, INNER);
+  ls(a, LOAD, T2, T0, 0);
+  ls(a, LOAD, T3, T0, 1);
+  rr(a, IFUGE, T3, T2);
+  branch(a, JUMP, NOSWAP);
+  ls(a, STORE, T3, T0, 0);
+  ls(a, STORE, T2, T0, 1);
+  label(a, NOSWAP);
+  ri(a, ADD, T0, 1);
+  rr(a, IFULT, T0, S0);
+  branch(a, JUMP, INNER);
+  ri(a, SUB, S0, 1);
+  ri(a, IFNE, S0, 0);
+  branch(a, JUMP, PASS);
+  ri(a, ADD, S2, 1);
+  ri(a, IFULT, S2, 16);
+  branch(a, JUMP, REP);
+
+  // check the array is sorted
+  movei(a, T0, 0);
+  label(a, CHECK);
+  ls(a, LOAD, T2, T0, 0);
+  ls(a, LOAD, T3, T0, 1);
+  rr(a, IFULT, T3, T2);
+  branch(a, JUMP, FAIL);
+  ri(a, ADD, T0, 1);
+  ri(a, IFULT, T0, 511);
+  branch(a, JUMP, CHECK);
+  HALT_INST(a);
+  label(a, FAIL);
+  movei(a, A0, 1);
+  rr(a, ERROR, 0, 0);
+}
+
+typedef struct benchmark {
+  const char *name;
+  void (*build)(Asm *a);
+} benchmark;
+
+int main() {
+  const benchmark benchmarks[] = {
+      {"counter", counter},
+      {"sieve", sieve},
+      {"multiply", multiply},
+      {"sort", sort},
+  };
+  const int runs = 5;
+
+  // the interpreter is run again with profiling, and again recording a
+  // binary trace, to keep their overhead in check
+  const struct {
+    const char *name;
+    Engine engine;
+    bool profile;
+    bool record;
+  } engines[] = {
+      {"interp", ENGINE_INTERPRETER, false, false},
+      {"jit", ENGINE_JIT, false, false},
+      {"profile", ENGINE_INTERPRETER, true, false},
+      {"record", ENGINE_INTERPRETER, false, true},
+  };
+
+  Emu *emu = emuCreate();
+  Profile *profile = profileCreate();
+  Trace *trace = traceCreate(16);
+  int failed = 0;
+  for (int i = 0; i < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); i++) {
+    Asm a = {0};
+    benchmarks[i].build(&a);
+    assemble(&a);
+
+    for (int e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+      emuSetEngine(emu, engines[e].engine);
+      emuSetProfile(emu, engines[e].profile ? profile : NULL);
+      emuSetRecord(emu, engines[e].record ? trace : NULL);
+      double best = 0;
+      uint64_t cycles = 0;
+      for (int r = 0; r < runs; r++) {
+        emuLoad(emu, a.words, a.len, NULL, 0);
+        clock_t start = clock();
+        int ret = emuRun(emu, 1000000000, false);
+        double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        cycles = emuCycles(emu);
+        if (ret) {
+          fprintf(stderr, "%s: FAIL: %d\n", benchmarks[i].name, ret);
+          failed++;
+          break;
+        }
+        double mips = (double)cycles / secs / 1e6;
+        if (mips > best) {
+          best = mips;
+        }
+      }
+      printf("%-10s %-7s %12llu cycles %10.1f MIPS\n", benchmarks[i].name,
+             engines[e].name, (unsigned long long)cycles, best);
+    }
+
+    // the same program on a full group of instances stepped in lockstep,
+    // reporting the MIPS of all of them together
+    int results[LOCKSTEP_LANES];
+    uint64_t laneCycles[LOCKSTEP_LANES];
+    uint64_t cycles = 0;
+    clock_t start = clock();
+    if (runRj32Lockstep(1000000000, a.words, a.len, NULL, NULL, LOCKSTEP_LANES,
+                        results, laneCycles)) {
+      fprintf(stderr, "%s: FAIL: %d\n", benchmarks[i].name, results[0]);
+      failed++;
+    }
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+      cycles += laneCycles[l];
+    }
+    printf("%-10s %-7s %12llu cycles %10.1f MIPS\n", benchmarks[i].name,
+           "lockstep", (unsigned long long)cycles, cycles / secs / 1e6);
+  }
+  emuDestroy(emu);
+  profileDestroy(profile);
+  traceClose(trace);
+
+  return failed ? 1 : 0;
+}
@@ -2,11 +2,158 @@
 
 #include <memory.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 void ioBusInit(IOBus *ioBus, Device *devices, int numDevices) {
   memset(ioBus, 0, sizeof(IOBus));
   ioBus->busDevices = devices;
   ioBus->numDevices = numDevices;
+
+  for (int page = 0; page < IOBUS_NUM_PAGES; page++) {
+    int start = page * IOBUS_PAGE_SIZE;
+    int end = start + IOBUS_PAGE_SIZE;
+    for (int i = 0; i < numDevices; i++) {
+      int deviceStart = devices[i].address;
+      int deviceEnd = deviceStart + devices[i].size;
+      if (deviceEnd <= start || deviceStart >= end) {
+        continue;
+      }
+      // the first device overlapping the page decides whether it's mapped
+      if (devices[i].memory != NULL && deviceStart <= start &&
+          deviceEnd >= end) {
+        uint16_t *memory = devices[i].memory + (start - deviceStart);
+        ioBus->readPages[page] = memory;
+        ioBus->writePages[page] = memory;
+        ioBus->memoryPages[page] = memory;
+      }
+      break;
+    }
+  }
+}
+
+// ioBusMapReads maps the page for reads, to its shared words if it has any,
+// unless reads from it are watched.
+static void ioBusMapReads(IOBus *ioBus, int page) {
+  if (ioBus->watchReads[page / 64] >> (page % 64) & 1) {
+    ioBus->readPages[page] = NULL;
+    return;
+  }
+  // reads never write through the pointer, so the shared words stay as
+  // they are
+  ioBus->readPages[page] = (uint16_t *)ioBusPage(ioBus, page);
+}
+
+void ioBusShare(IOBus *ioBus, int page, const uint16_t *words) {
+  ioBus->sharedPages[page] = words;
+  ioBus->writePages[page] = NULL;
+  ioBusMapReads(ioBus, page);
+}
+
+void ioBusUnshare(IOBus *ioBus, int page) {
+  ioBus->sharedPages[page] = NULL;
+  ioBusMapReads(ioBus, page);
+}
+
+void ioBusProtect(IOBus *ioBus) {
+  memset(ioBus->writePages, 0, sizeof(ioBus->writePages));
+  memset(ioBus->dirty, 0, sizeof(ioBus->dirty));
+}
+
+// ioBusWatchPage maps or unmaps the page for reads and writes depending on
+// whether it has any watchpoints. A page that's no longer watched for writes
+// is left unmapped for them until it's next written, which maps it again.
+static void ioBusWatchPage(IOBus *ioBus, int page) {
+  bool reads = false;
+  bool writes = false;
+  for (int i = 0; ioBus->watch != NULL && i < IOBUS_PAGE_SIZE / 64; i++) {
+    reads |= ioBus->watch->reads[page * IOBUS_PAGE_SIZE / 64 + i] != 0;
+    writes |= ioBus->watch->writes[page * IOBUS_PAGE_SIZE / 64 + i] != 0;
+  }
+  uint64_t bit = 1ull << (page % 64);
+  ioBus->watchReads[page / 64] &= ~bit;
+  ioBus->watchWrites[page / 64] &= ~bit;
+  if (reads) {
+    ioBus->watchReads[page / 64] |= bit;
+  }
+  ioBusMapReads(ioBus, page);
+  if (writes) {
+    ioBus->watchWrites[page / 64] |= bit;
+    ioBus->writePages[page] = NULL;
+  }
+}
+
+void ioBusSetWatch(IOBus *ioBus, IOWatch *watch) {
+  ioBus->watch = watch;
+  ioBus->watchHit = false;
+  for (int page = 0; page < IOBUS_NUM_PAGES; page++) {
+    ioBusWatchPage(ioBus, page);
+  }
+}
+
+void ioBusSetWatchpoint(IOBus *ioBus, uint16_t address, bool read,
+                        bool write) {
+  uint64_t bit = 1ull << (address % 64);
+  ioBus->watch->reads[address / 64] &= ~bit;
+  ioBus->watch->writes[address / 64] &= ~bit;
+  if (read) {
+    ioBus->watch->reads[address / 64] |= bit;
+  }
+  if (write) {
+    ioBus->watch->writes[address / 64] |= bit;
+  }
+  ioBusWatchPage(ioBus, address >> IOBUS_PAGE_BITS);
+}
+
+// ioBusCheckWatch records a hit if the address is watched in the bitmap.
+static void ioBusCheckWatch(IOBus *ioBus, const uint64_t *watched,
+                            uint16_t address, bool write) {
+  if (watched[address / 64] >> (address % 64) & 1) {
+    ioBus->watchHit = true;
+    ioBus->watchWrite = write;
+    ioBus->watchAddress = address;
+  }
+}
+
+uint16_t ioBusReadSlow(IOBus *ioBus, uint16_t address) {
+  int page = address >> IOBUS_PAGE_BITS;
+  if (ioBus->watchReads[page / 64] >> (page % 64) & 1) {
+    ioBusCheckWatch(ioBus, ioBus->watch->reads, address, false);
+  }
+  const uint16_t *memory = ioBusPage(ioBus, page);
+  if (memory != NULL) {
+    return memory[address & (IOBUS_PAGE_SIZE - 1)];
+  }
+  if (ioBus->readHook != NULL) {
+    return ioBus->readHook(ioBus->hookContext, ioBus, address);
+  }
+  ioBusTransaction(ioBus, address, 0, false);
+  return ioBus->bus.data;
+}
+
+void ioBusWriteSlow(IOBus *ioBus, uint16_t address, uint16_t data) {
+  int page = address >> IOBUS_PAGE_BITS;
+  bool watched = ioBus->watchWrites[page / 64] >> (page % 64) & 1;
+  if (watched) {
+    ioBusCheckWatch(ioBus, ioBus->watch->writes, address, true);
+  }
+  if (ioBus->writeHook != NULL) {
+    ioBus->writeHook(ioBus->hookContext, address, data);
+  }
+  uint16_t *memory = ioBus->memoryPages[page];
+  if (memory == NULL) {
+    ioBusTransaction(ioBus, address, data, true);
+    return;
+  }
+  if (ioBus->sharedPages[page] != NULL) {
+    memcpy(memory, ioBus->sharedPages[page], IOBUS_PAGE_SIZE * sizeof(*memory));
+    ioBusUnshare(ioBus, page);
+  }
+  ioBus->dirty[page / 64] |= 1ull << (page % 64);
+  ioBus->written[page / 64] |= 1ull << (page % 64);
+  if (!watched) {
+    ioBus->writePages[page] = memory;
+  }
+  memory[address & (IOBUS_PAGE_SIZE - 1)] = data;
 }
 
 bool ioBusTransaction(IOBus *ioBus, uint16_t address, uint16_t data, bool WE) {
@@ -26,19 +173,98 @@ bool ioBusTransaction(IOBus *ioBus, uint16_t address, uint16_t data, bool WE) {
   return false;
 }
 
-bool stdoutWriter(void *context, Bus *bus, uint16_t address) {
-#pragma unused(context)
+void consoleInit(Console *console, ConsoleSink sink, void *context) {
+  memset(console, 0, sizeof(Console));
+  console->threshold = CONSOLE_FLUSH_SIZE;
+  console->sink = sink;
+  console->context = context;
+}
+
+void consoleSetSink(Console *console, ConsoleSink sink, void *context) {
+  consoleFlush(console);
+  console->sink = sink;
+  console->context = context;
+}
+
+void consoleFlush(Console *console) {
+  if (console->length > 0) {
+    console->sink(console->context, console->buf, console->length);
+    console->length = 0;
+  }
+}
+
+void consoleDestroy(Console *console) {
+  consoleFlush(console);
+  free(console->buf);
+  console->buf = NULL;
+  console->cap = 0;
+}
+
+// consoleWrite appends to the console's buffer, growing it if needed. If it
+// can't grow, the buffer is flushed and the data is sent straight to the
+// sink instead.
+static void consoleWrite(Console *console, const char *data, size_t length) {
+  if (console->length + length > console->cap) {
+    size_t cap = console->cap ? console->cap * 2 : 64;
+    while (cap < console->length + length) {
+      cap *= 2;
+    }
+    char *buf = realloc(console->buf, cap);
+    if (buf == NULL) {
+      consoleFlush(console);
+      console->sink(console->context, data, length);
+      return;
+    }
+    console->buf = buf;
+    console->cap = cap;
+  }
+  memcpy(console->buf + console->length, data, length);
+  console->length += length;
+}
+
+bool consoleHandler(void *context, Bus *bus, uint16_t address) {
 #pragma unused(address)
-  if (bus->WE) {
-    char c = bus->data;
-    if (c == '\r') {
-      printf("\033D");
-    } else {
-      printf("%c", c);
+  if (!bus->WE) {
+    return false;
+  }
+  Console *console = context;
+  char c = bus->data;
+  if (c == '\r') {
+    consoleWrite(console, "\033D", 2);
+  } else {
+    consoleWrite(console, &c, 1);
+  }
+  if (c == '\n' || console->length >= console->threshold) {
+    consoleFlush(console);
+  }
+  return true;
+}
+
+void consoleFileSink(void *context, const char *data, size_t length) {
+  fwrite(data, 1, length, context != NULL ? context : stdout);
+}
+
+void consoleMemorySink(void *context, const char *data, size_t length) {
+  ConsoleMemory *memory = context;
+  if (memory->length + length + 1 > memory->cap) {
+    size_t cap = memory->cap ? memory->cap * 2 : 64;
+    while (cap < memory->length + length + 1) {
+      cap *= 2;
     }
-    return true;
+    char *buf = realloc(memory->data, cap);
+    if (buf == NULL) {
+      return;
+    }
+    memory->data = buf;
+    memory->cap = cap;
   }
-  return false;
+  memcpy(memory->data + memory->length, data, length);
+  memory->length += length;
+  memory->data[memory->length] = 0;
+}
+
+void consoleDiscardSink(void *context, const char *data, size_t length) {
+#pragma unused(context, data, length)
 }
 
 bool memoryHandler(void *context, Bus *bus, uint16_t address) {
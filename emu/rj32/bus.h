@@ -2,6 +2,7 @@
 #define BUS_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // Bus is a 16 bit data bus.
@@ -22,32 +23,218 @@ typedef bool (*BusHandler)(void *context, Bus *bus, uint16_t subAddress);
 // Devices can have overlapping address ranges, and if the handler returns
 // false then next device in the list will be called, otherwise the
 // transaction ends and no further devices will be called.
+// If the device is plain RAM, memory points to it, which lets the bus read
+// and write any whole pages of it directly instead of calling the handler.
 typedef struct Device {
   uint16_t address;
   uint16_t size;
   BusHandler handler;
   void *context;
+  uint16_t *memory;
 } Device;
 
-// IOBus is a bus with devices attached to it.
+// The address space is split into pages, which can be mapped straight to
+// memory.
+#define IOBUS_PAGE_BITS 8
+#define IOBUS_PAGE_SIZE (1 << IOBUS_PAGE_BITS)
+#define IOBUS_NUM_PAGES (0x10000 >> IOBUS_PAGE_BITS)
+
+// IOWatch is a set of watchpoints: the addresses where a read, or a write,
+// stops the CPU after the instruction that made it.
+typedef struct IOWatch {
+  uint64_t reads[0x10000 / 64];
+  uint64_t writes[0x10000 / 64];
+} IOWatch;
+
+// IOBus is a bus with devices attached to it. Each page of the address space
+// can be mapped separately for reads and writes to the memory behind it, and
+// only pages which aren't mapped go through the device handlers. A memory
+// page that's mapped for reads but not writes is write protected: the first
+// write to it marks it dirty and maps it for writes. Pages with watchpoints
+// aren't mapped for the kind of access being watched, so only accesses to
+// them take the slow path that checks for the exact address.
 typedef struct IOBus {
   Bus bus;
   Device *busDevices;
   int numDevices;
+  uint16_t *readPages[IOBUS_NUM_PAGES];
+  uint16_t *writePages[IOBUS_NUM_PAGES];
+
+  // the memory behind each page, whether or not it's mapped at the moment
+  uint16_t *memoryPages[IOBUS_NUM_PAGES];
+
+  // the read-only words backing each memory page until it's first written,
+  // or NULL. Reads see them in place of the memory behind the page, and the
+  // first write copies them into it, so a page loaded from a mapped image
+  // isn't copied unless it's written.
+  const uint16_t *sharedPages[IOBUS_NUM_PAGES];
+
+  // bitmap of the write protected pages written since ioBusProtect
+  uint64_t dirty[IOBUS_NUM_PAGES / 64];
+
+  // bitmap of the pages written since it was last cleared by whoever owns
+  // the memory. Unlike dirty, ioBusProtect leaves it alone, so it still
+  // covers everything written after the memory has been protected again, by
+  // a snapshot for example.
+  uint64_t written[IOBUS_NUM_PAGES / 64];
+
+  // if not NULL, the watchpoints, along with bitmaps of the pages with
+  // watchpoints on reads and on writes
+  IOWatch *watch;
+  uint64_t watchReads[IOBUS_NUM_PAGES / 64];
+  uint64_t watchWrites[IOBUS_NUM_PAGES / 64];
+
+  // set when an access hits a watchpoint, with its address and whether it
+  // was a write. It's up to whoever runs the bus to clear it.
+  bool watchHit;
+  bool watchWrite;
+  uint16_t watchAddress;
+
+  // if not NULL, a read that would go through the device handlers calls
+  // readHook instead, and writeHook is called for each write that doesn't go
+  // straight to memory, before it goes through them. The IO log uses them to
+  // record and replay what comes from devices, see iolog.h.
+  uint16_t (*readHook)(void *context, struct IOBus *ioBus, uint16_t address);
+  void (*writeHook)(void *context, uint16_t address, uint16_t data);
+  void *hookContext;
 } IOBus;
 
 // ioBusInit initializes an IOBus with a list of devices, listed in
-// priority order.
+// priority order. Every page which is entirely covered by a memory device,
+// without any higher priority device overlapping it, is mapped for both
+// reads and writes. There are no watchpoints to begin with.
 void ioBusInit(IOBus *ioBus, Device *devices, int numDevices);
 
+// ioBusProtect write protects every memory page and clears the dirty bitmap,
+// so the pages written from now on can be found with ioBusIsDirty.
+void ioBusProtect(IOBus *ioBus);
+
+// ioBusShare backs the memory page with the read-only words, which have to
+// stay around until the page is written or unshared.
+void ioBusShare(IOBus *ioBus, int page, const uint16_t *words);
+
+// ioBusUnshare stops backing the memory page with shared words, without
+// copying them, so it reads as the memory behind it again.
+void ioBusUnshare(IOBus *ioBus, int page);
+
+// ioBusPage returns the words a memory page reads as, which are its shared
+// words if it has any, or NULL if the page isn't memory.
+static inline const uint16_t *ioBusPage(const IOBus *ioBus, int page) {
+  if (ioBus->sharedPages[page] != NULL) {
+    return ioBus->sharedPages[page];
+  }
+  return ioBus->memoryPages[page];
+}
+
+// ioBusSetWatch sets the watchpoints to check accesses against, or turns
+// them off if watch is NULL. The watch has to stay around while it's set.
+void ioBusSetWatch(IOBus *ioBus, IOWatch *watch);
+
+// ioBusSetWatchpoint watches the address for reads, writes, both or neither,
+// in the watch set by ioBusSetWatch, and maps or unmaps its page to match.
+void ioBusSetWatchpoint(IOBus *ioBus, uint16_t address, bool read,
+                        bool write);
+
+// ioBusIsDirty returns whether the page has been written since ioBusProtect.
+static inline bool ioBusIsDirty(const IOBus *ioBus, int page) {
+  return (ioBus->dirty[page / 64] >> (page % 64)) & 1;
+}
+
 // ioBusTransaction handles a bus transaction. If the transaction is
 // handled it returns true, otherwise it returns false. Devices are
 // tried in order, the first to return true is the last device tried.
+// This always goes through the device handlers, even for mapped pages.
 bool ioBusTransaction(IOBus *ioBus, uint16_t address, uint16_t data, bool WE);
 
-// stdoutWriter is a busHandler that writes to stdout, handling \r
-// specially to emulate the same behaviour as telnet / serial terminals.
-bool stdoutWriter(void *context, Bus *bus, uint16_t address);
+// ioBusReadSlow reads a word from a page that isn't mapped for reads,
+// checking it against the watchpoints, either from the memory behind the page,
+// or with a bus transaction or the read hook.
+uint16_t ioBusReadSlow(IOBus *ioBus, uint16_t address);
+
+// ioBusRead reads a word from the bus, directly from memory if the page is
+// mapped, otherwise with ioBusReadSlow.
+static inline uint16_t ioBusRead(IOBus *ioBus, uint16_t address) {
+  uint16_t *page = ioBus->readPages[address >> IOBUS_PAGE_BITS];
+  if (page != NULL) {
+    return page[address & (IOBUS_PAGE_SIZE - 1)];
+  }
+  return ioBusReadSlow(ioBus, address);
+}
+
+// ioBusWriteSlow writes a word to a page that isn't mapped for writes,
+// checking it against the watchpoints, either marking a write protected page
+// dirty and mapping it, unless it's watched, or with a bus transaction. A
+// shared page is copied into its memory first.
+void ioBusWriteSlow(IOBus *ioBus, uint16_t address, uint16_t data);
+
+// ioBusWrite writes a word to the bus, directly to memory if the page is
+// mapped, otherwise with ioBusWriteSlow.
+static inline void ioBusWrite(IOBus *ioBus, uint16_t address, uint16_t data) {
+  uint16_t *page = ioBus->writePages[address >> IOBUS_PAGE_BITS];
+  if (page != NULL) {
+    page[address & (IOBUS_PAGE_SIZE - 1)] = data;
+    return;
+  }
+  ioBusWriteSlow(ioBus, address, data);
+}
+
+// ConsoleSink receives the console's output each time it's flushed.
+typedef void (*ConsoleSink)(void *context, const char *data, size_t length);
+
+// CONSOLE_FLUSH_SIZE is the default size the console's buffer is flushed at
+// if it hasn't seen a newline.
+#define CONSOLE_FLUSH_SIZE 4096
+
+// Console is an output device that buffers what the program writes, handling
+// \r specially to emulate the same behaviour as telnet / serial terminals.
+// The buffer grows as needed and is handed to the sink on each newline, when
+// it reaches the threshold, and when the program halts or errors, so programs
+// that print a lot don't make a stdio call per character.
+typedef struct Console {
+  char *buf;
+  size_t length;
+  size_t cap;
+
+  // the buffer is flushed when it reaches this many bytes
+  size_t threshold;
+
+  ConsoleSink sink;
+  void *context;
+} Console;
+
+// ConsoleMemory is the context of consoleMemorySink, a growable string of
+// everything written to it. data is NUL terminated unless it's NULL.
+typedef struct ConsoleMemory {
+  char *data;
+  size_t length;
+  size_t cap;
+} ConsoleMemory;
+
+// consoleInit initializes an empty console with the given sink.
+void consoleInit(Console *console, ConsoleSink sink, void *context);
+
+// consoleSetSink flushes the console and then switches it to a new sink.
+void consoleSetSink(Console *console, ConsoleSink sink, void *context);
+
+// consoleFlush hands everything buffered to the sink.
+void consoleFlush(Console *console);
+
+// consoleDestroy flushes the console and frees its buffer.
+void consoleDestroy(Console *console);
+
+// consoleHandler is a busHandler that writes to the Console in context.
+bool consoleHandler(void *context, Bus *bus, uint16_t address);
+
+// consoleFileSink is a ConsoleSink that writes to the FILE * in context, or
+// stdout if context is NULL.
+void consoleFileSink(void *context, const char *data, size_t length);
+
+// consoleMemorySink is a ConsoleSink that appends to the ConsoleMemory in
+// context. Output that doesn't fit in memory is dropped.
+void consoleMemorySink(void *context, const char *data, size_t length);
+
+// consoleDiscardSink is a ConsoleSink that throws the output away.
+void consoleDiscardSink(void *context, const char *data, size_t length);
 
 // memoryHandler is a busHandler for RAM memory. The context is a pointer
 // to the memory array. The memory size is not checked, so it's best to
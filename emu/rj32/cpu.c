@@ -1,60 +1,445 @@
 #include "cpu.h"
+#include "iolog.h"
 
-#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// decodeInto decodes the program into prog, where everything from oldLength
+// onwards is already decoded as nops.
+static void decodeInto(Program *prog, const uint16_t *progMem, int progLength,
+                       int oldLength) {
+  if (progLength > 65536) {
+    progLength = 65536;
+  }
+  decodeProgram(prog->inst, progMem, progLength);
+  if (progLength > 0) {
+    memcpy(prog->words, progMem, progLength * sizeof(uint16_t));
+  }
+
+  // everything past the end of the program is zero, which decodes to nop
+  Inst nop = decodeTable()[0];
+  for (int i = progLength; i < oldLength && i < 65536; i++) {
+    prog->inst[i] = nop;
+    prog->words[i] = 0;
+  }
+  prog->length = progLength;
+}
+
+Program *programCreate(const uint16_t *progMem, int progLength) {
+  Program *prog = malloc(sizeof(Program));
+  if (prog == NULL) {
+    return NULL;
+  }
+  atomic_init(&prog->refs, 1);
+  decodeInto(prog, progMem, progLength, 65536);
+  return prog;
+}
+
+Program *programRetain(Program *prog) {
+  atomic_fetch_add_explicit(&prog->refs, 1, memory_order_relaxed);
+  return prog;
+}
+
+void programRelease(Program *prog) {
+  if (prog == NULL) {
+    return;
+  }
+  if (atomic_fetch_sub_explicit(&prog->refs, 1, memory_order_acq_rel) == 1) {
+    free(prog);
+  }
+}
+
 void cpuInit(CPU *cpu, bool trace) {
   memset(cpu, 0, sizeof(CPU));
   cpu->trace = trace;
 }
 
+void cpuDestroy(CPU *cpu) {
+  programRelease(cpu->prog);
+  cpu->prog = NULL;
+  snapshotRelease(cpu->base);
+  cpu->base = NULL;
+}
+
+static void cpuTimerTick(void *context, uint64_t cycle);
+
+// cpuStartTimer schedules the timer's next tick at the given cycle count, or
+// stops it if that's 0.
+static void cpuStartTimer(CPU *cpu, uint64_t next) {
+  cpu->timerNext = 0;
+  if (cpu->events == NULL) {
+    return;
+  }
+  eventCancel(cpu->events, cpuTimerTick, cpu);
+  if (next != 0 && eventSchedule(cpu->events, next, cpuTimerTick, cpu)) {
+    cpu->timerNext = next;
+  }
+}
+
+// cpuTimerTick raises the timer's interrupt and schedules its next tick.
+static void cpuTimerTick(void *context, uint64_t cycle) {
+  CPU *cpu = context;
+  uint64_t next = cycle + cpu->csr[CSR_TIMER];
+  cpu->irq = true;
+  cpu->timerNext = 0;
+  if (eventSchedule(cpu->events, next, cpuTimerTick, cpu)) {
+    cpu->timerNext = next;
+  }
+}
+
+void cpuWriteCsr(CPU *cpu, int csr, uint16_t value) {
+  if (csr >= CSR_COUNT) {
+    return;
+  }
+  cpu->csr[csr] = value;
+  if (csr == CSR_TIMER) {
+    cpuStartTimer(cpu, value != 0 ? cpu->cycles + value : 0);
+  }
+}
+
+void cpuReset(CPU *cpu) {
+  cpu->cycles = 0;
+  memset(cpu->reg, 0, sizeof(cpu->reg));
+  cpu->pc = 0;
+  cpu->skip = false;
+  cpu->carry = false;
+  cpu->imm = 0;
+  cpu->immValid = false;
+  cpu->halt = false;
+  cpu->error = false;
+  cpu->idle = false;
+  cpu->deviceRead = false;
+  cpuWriteCsr(cpu, CSR_TIMER, 0);
+  memset(cpu->csr, 0, sizeof(cpu->csr));
+  cpu->irq = false;
+}
+
 void cpuInitBusDevices(CPU *cpu, Device *devices, int numDevices) {
   ioBusInit(&cpu->bus, devices, numDevices);
+
+  // the new memory has nothing to do with the last snapshot
+  snapshotRelease(cpu->base);
+  cpu->base = NULL;
 }
 
-void cpuWriteProgMem(CPU *cpu, const uint16_t *progMem, int progLength) {
-  for (int i = 0; i < 65536; i++) {
-    if (i < progLength) {
-      cpu->prog[i] = decode((RawInst){.raw = progMem[i]});
-    } else {
-      cpu->prog[i] = decode((RawInst){.raw = 0});
-    }
+void cpuSetProgram(CPU *cpu, Program *prog) {
+  if (prog != NULL) {
+    programRetain(prog);
+  }
+  programRelease(cpu->prog);
+  cpu->prog = prog;
+}
+
+bool cpuWriteProgMem(CPU *cpu, const uint16_t *progMem, int progLength) {
+  Program *prog = cpu->prog;
+  if (prog != NULL &&
+      atomic_load_explicit(&prog->refs, memory_order_acquire) == 1) {
+    decodeInto(prog, progMem, progLength, prog->length);
+    return true;
   }
+
+  prog = programCreate(progMem, progLength);
+  if (prog == NULL) {
+    return false;
+  }
+  programRelease(cpu->prog);
+  cpu->prog = prog;
+  return true;
 }
 
 void cpuWriteDataMem(CPU *cpu, const uint16_t *dataMem, int dataLength) {
-  for (int i = 0; i < dataLength; i++) {
-    ioBusTransaction(&cpu->bus, i, dataMem[i], true);
+  cpuWriteMem(cpu, 0, dataMem, dataLength);
+}
+
+void cpuWriteMem(CPU *cpu, uint16_t address, const uint16_t *words,
+                 int length) {
+  int endAddress = address + length;
+  if (endAddress > 0x10000) {
+    endAddress = 0x10000;
   }
+  int i = address;
+  while (i < endAddress) {
+    // write a word at a time until the page is mapped, which the device
+    // handler might do on the first write, then copy the rest of the page
+    uint16_t *page = cpu->bus.writePages[i >> IOBUS_PAGE_BITS];
+    if (page == NULL) {
+      ioBusWrite(&cpu->bus, i, words[i - address]);
+      i++;
+      continue;
+    }
+    int end = (i | (IOBUS_PAGE_SIZE - 1)) + 1;
+    if (end > endAddress) {
+      end = endAddress;
+    }
+    memcpy(page + (i & (IOBUS_PAGE_SIZE - 1)), words + (i - address),
+           (end - i) * sizeof(uint16_t));
+    i = end;
+  }
+}
+
+// Page is a copy of one page of memory, shared between snapshots.
+typedef struct Page {
+  atomic_int refs;
+  uint16_t words[IOBUS_PAGE_SIZE];
+} Page;
+
+struct Snapshot {
+  atomic_int refs;
+
+  uint64_t cycles;
+  uint16_t reg[16];
+  uint16_t pc;
+  uint16_t imm;
+  bool skip;
+  bool carry;
+  bool immValid;
+  bool halt;
+  bool error;
+  uint16_t csr[CSR_COUNT];
+  bool irq;
+  uint64_t timerNext;
+
+  // copies of each page mapped to memory, NULL for the rest
+  Page *pages[IOBUS_NUM_PAGES];
+};
+
+static Page *pageRetain(Page *page) {
+  atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+  return page;
 }
 
-static uint16_t cpuImm(const CPU *cpu, uint16_t imm) {
-  if (cpu->immValid) {
-    return cpu->imm | (imm & 0b1111);
+static void pageRelease(Page *page) {
+  if (page != NULL &&
+      atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+    free(page);
   }
-  return signExtend(imm, 13);
 }
 
-static uint16_t cpuRsval(CPU *cpu, Inst ir) {
-  if (ir.fmt == FMT_RR) {
-    return cpu->reg[ir.rs];
+static Snapshot *snapshotRetain(Snapshot *snap) {
+  atomic_fetch_add_explicit(&snap->refs, 1, memory_order_relaxed);
+  return snap;
+}
+
+void snapshotRelease(Snapshot *snap) {
+  if (snap == NULL ||
+      atomic_fetch_sub_explicit(&snap->refs, 1, memory_order_acq_rel) != 1) {
+    return;
   }
-  return cpuImm(cpu, ir.imm);
+  for (int i = 0; i < IOBUS_NUM_PAGES; i++) {
+    pageRelease(snap->pages[i]);
+  }
+  free(snap);
+}
+
+// cpuSetBase makes the snapshot the one the CPU's memory matches, and write
+// protects the memory to track the pages written from now on.
+static void cpuSetBase(CPU *cpu, Snapshot *snap) {
+  snapshotRetain(snap);
+  snapshotRelease(cpu->base);
+  cpu->base = snap;
+  ioBusProtect(&cpu->bus);
 }
 
-static uint16_t cpuOffset(const CPU *cpu, uint16_t imm) {
-  if (cpu->immValid) {
-    return cpu->imm | (imm & 0b1111);
+Snapshot *cpuSnapshot(CPU *cpu) {
+  Snapshot *snap = calloc(1, sizeof(Snapshot));
+  if (snap == NULL) {
+    return NULL;
   }
-  return (imm & 0b1111);
+  atomic_init(&snap->refs, 1);
+  snap->cycles = cpu->cycles;
+  memcpy(snap->reg, cpu->reg, sizeof(snap->reg));
+  snap->pc = cpu->pc;
+  snap->imm = cpu->imm;
+  snap->skip = cpu->skip;
+  snap->carry = cpu->carry;
+  snap->immValid = cpu->immValid;
+  snap->halt = cpu->halt;
+  snap->error = cpu->error;
+  memcpy(snap->csr, cpu->csr, sizeof(snap->csr));
+  snap->irq = cpu->irq;
+  snap->timerNext = cpu->timerNext;
+
+  const Snapshot *base = cpu->base;
+  for (int i = 0; i < IOBUS_NUM_PAGES; i++) {
+    uint16_t *memory = cpu->bus.memoryPages[i];
+    if (memory == NULL) {
+      continue;
+    }
+    // pages that weren't written are shared with the previous snapshot
+    if (base != NULL && base->pages[i] != NULL && !ioBusIsDirty(&cpu->bus, i)) {
+      snap->pages[i] = pageRetain(base->pages[i]);
+      continue;
+    }
+    Page *page = malloc(sizeof(Page));
+    if (page == NULL) {
+      snapshotRelease(snap);
+      return NULL;
+    }
+    atomic_init(&page->refs, 1);
+    memcpy(page->words, ioBusPage(&cpu->bus, i), sizeof(page->words));
+    snap->pages[i] = page;
+  }
+
+  cpuSetBase(cpu, snap);
+  return snap;
+}
+
+void cpuRestore(CPU *cpu, Snapshot *snap) {
+  cpuReset(cpu);
+  cpu->cycles = snap->cycles;
+  memcpy(cpu->reg, snap->reg, sizeof(cpu->reg));
+  cpu->pc = snap->pc;
+  cpu->imm = snap->imm;
+  cpu->skip = snap->skip;
+  cpu->carry = snap->carry;
+  cpu->immValid = snap->immValid;
+  cpu->halt = snap->halt;
+  cpu->error = snap->error;
+  memcpy(cpu->csr, snap->csr, sizeof(cpu->csr));
+  cpu->irq = snap->irq;
+  cpuStartTimer(cpu, snap->timerNext);
+
+  const Snapshot *base = cpu->base;
+  for (int i = 0; i < IOBUS_NUM_PAGES; i++) {
+    uint16_t *memory = cpu->bus.memoryPages[i];
+    Page *page = snap->pages[i];
+    if (memory == NULL || page == NULL) {
+      continue;
+    }
+    // pages already holding the same copy don't need to be copied again
+    if (base != NULL && base->pages[i] == page && !ioBusIsDirty(&cpu->bus, i)) {
+      continue;
+    }
+    ioBusUnshare(&cpu->bus, i);
+    memcpy(memory, page->words, sizeof(page->words));
+    cpu->bus.written[i / 64] |= 1ull << (i % 64);
+  }
+
+  cpuSetBase(cpu, snap);
 }
 
-static char *preTrace(char *buf, int sz, CPU *cpu, Inst ir) {
-  snprintf(buf, sz, "%-15s", instString(buf, sz, ir));
+void cpuDropSnapshot(CPU *cpu) {
+  snapshotRelease(cpu->base);
+  cpu->base = NULL;
+}
+
+bool cpuFork(CPU *child, CPU *parent) {
+  Snapshot *snap = cpuSnapshot(parent);
+  if (snap == NULL) {
+    return false;
+  }
+  cpuRestore(child, snap);
+  snapshotRelease(snap);
+  return true;
+}
+
+// the snapshot file starts with this magic number, followed by the CPU state
+// and a bitmap of the pages in the file, then the pages themselves
+static const char SNAPSHOT_MAGIC[8] = "rj32snp2";
+
+bool snapshotSave(const Snapshot *snap, const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    return false;
+  }
+
+  uint8_t flags = snap->skip | snap->immValid << 1 | snap->halt << 2 |
+                  snap->error << 3 | snap->irq << 4 | snap->carry << 5;
+  uint64_t present[IOBUS_NUM_PAGES / 64] = {0};
+  for (int i = 0; i < IOBUS_NUM_PAGES; i++) {
+    if (snap->pages[i] != NULL) {
+      present[i / 64] |= 1ull << (i % 64);
+    }
+  }
+
+  bool ok = fwrite(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC), 1, f) == 1 &&
+            fwrite(&snap->cycles, sizeof(snap->cycles), 1, f) == 1 &&
+            fwrite(snap->reg, sizeof(snap->reg), 1, f) == 1 &&
+            fwrite(&snap->pc, sizeof(snap->pc), 1, f) == 1 &&
+            fwrite(&snap->imm, sizeof(snap->imm), 1, f) == 1 &&
+            fwrite(&flags, sizeof(flags), 1, f) == 1 &&
+            fwrite(snap->csr, sizeof(snap->csr), 1, f) == 1 &&
+            fwrite(&snap->timerNext, sizeof(snap->timerNext), 1, f) == 1 &&
+            fwrite(present, sizeof(present), 1, f) == 1;
+  for (int i = 0; ok && i < IOBUS_NUM_PAGES; i++) {
+    if (snap->pages[i] != NULL) {
+      ok = fwrite(snap->pages[i]->words, sizeof(snap->pages[i]->words), 1,
+                  f) == 1;
+    }
+  }
+
+  if (fclose(f) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+Snapshot *snapshotLoad(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  Snapshot *snap = calloc(1, sizeof(Snapshot));
+  if (snap == NULL) {
+    fclose(f);
+    return NULL;
+  }
+  atomic_init(&snap->refs, 1);
+
+  char magic[sizeof(SNAPSHOT_MAGIC)];
+  uint8_t flags;
+  uint64_t present[IOBUS_NUM_PAGES / 64];
+  bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+            memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0 &&
+            fread(&snap->cycles, sizeof(snap->cycles), 1, f) == 1 &&
+            fread(snap->reg, sizeof(snap->reg), 1, f) == 1 &&
+            fread(&snap->pc, sizeof(snap->pc), 1, f) == 1 &&
+            fread(&snap->imm, sizeof(snap->imm), 1, f) == 1 &&
+            fread(&flags, sizeof(flags), 1, f) == 1 &&
+            fread(snap->csr, sizeof(snap->csr), 1, f) == 1 &&
+            fread(&snap->timerNext, sizeof(snap->timerNext), 1, f) == 1 &&
+            fread(present, sizeof(present), 1, f) == 1;
+  for (int i = 0; ok && i < IOBUS_NUM_PAGES; i++) {
+    if (!((present[i / 64] >> (i % 64)) & 1)) {
+      continue;
+    }
+    Page *page = malloc(sizeof(Page));
+    if (page == NULL) {
+      ok = false;
+      break;
+    }
+    atomic_init(&page->refs, 1);
+    snap->pages[i] = page;
+    ok = fread(page->words, sizeof(page->words), 1, f) == 1;
+  }
+  fclose(f);
+
+  if (!ok) {
+    snapshotRelease(snap);
+    return NULL;
+  }
+  snap->skip = flags & 1;
+  snap->immValid = (flags >> 1) & 1;
+  snap->halt = (flags >> 2) & 1;
+  snap->error = (flags >> 3) & 1;
+  snap->irq = (flags >> 4) & 1;
+  snap->carry = (flags >> 5) & 1;
+  return snap;
+}
+
+static uint16_t cpuRsval(const CPU *cpu, const Inst *ir) {
+  if (ir->fmt == FMT_RR) {
+    return cpu->reg[ir->rs];
+  }
+  return ir->imm;
+}
+
+char *preTrace(char *buf, int sz, const CPU *cpu, Inst ir) {
+  char inst[64];
+  snprintf(buf, sz, "%-15s", instString(inst, sizeof(inst), ir));
   char *ptr = buf + strlen(buf);
   sz -= strlen(buf);
 
@@ -66,39 +451,42 @@ static char *preTrace(char *buf, int sz, CPU *cpu, Inst ir) {
     break;
   case FMT_I11:
     snprintf(ptr, sz, "(pc:%04x rsval:%d)", cpu->pc,
-             (int16_t)cpuRsval(cpu, ir));
+             (int16_t)cpuRsval(cpu, &ir));
     break;
   case FMT_I12:
-    snprintf(ptr, sz, "(rsval:%d)", (int16_t)cpuRsval(cpu, ir));
+    snprintf(ptr, sz, "(rsval:%d)", (int16_t)cpuRsval(cpu, &ir));
     break;
   case FMT_RI6:
   case FMT_RI8:
     snprintf(ptr, sz, "(%s:%d rsval:%d)", regString(ir.rd),
-             (int16_t)cpu->reg[ir.rd], (int16_t)cpuRsval(cpu, ir));
+             (int16_t)cpu->reg[ir.rd], (int16_t)cpuRsval(cpu, &ir));
     break;
   case FMT_LS:
     snprintf(ptr, sz, "(%s:%d off:%d)", regString(ir.rs),
-             (int16_t)cpu->reg[ir.rs], (int16_t)cpuOffset(cpu, ir.imm));
+             (int16_t)cpu->reg[ir.rs], (int16_t)ir.imm);
     break;
   }
 
   return buf;
 }
 
-static char *postTrace(char *buf, int sz, CPU *cpu, Inst ir) {
+char *postTrace(char *buf, int sz, const CPU *cpu, Inst ir) {
   switch (ir.fmt) {
   case FMT_RR:
   case FMT_RI6:
   case FMT_RI8:
     if (ir.op >= IFEQ) {
       snprintf(buf, sz, "skip <- %s", cpu->skip ? "true" : "false");
+    } else if (ir.op >= ADD && ir.op <= SUBC) {
+      snprintf(buf, sz, "%s <- %d, carry <- %d", regString(ir.rd),
+               (int16_t)cpu->reg[ir.rd], cpu->carry);
     } else {
       snprintf(buf, sz, "%s <- %d", regString(ir.rd), (int16_t)cpu->reg[ir.rd]);
     }
     break;
 
   case FMT_I11:
-    snprintf(buf, sz, "pc <- %04x", cpu->pc + 1);
+    snprintf(buf, sz, "pc <- %04x", cpu->pc);
     break;
 
   case FMT_I12:
@@ -106,12 +494,17 @@ static char *postTrace(char *buf, int sz, CPU *cpu, Inst ir) {
     break;
 
   case FMT_LS: {
-    int address = (cpu->reg[ir.rs] + cpuOffset(cpu, ir.imm)) & 0xffff;
+    int address = (cpu->reg[ir.rs] + ir.imm) & 0xffff;
     if (ir.op == LOAD) {
       snprintf(buf, sz, "%s <- %d <- mem[%04x]\n", regString(ir.rd),
                (int16_t)cpu->reg[ir.rd], address);
     } else if (ir.op == STORE) {
       snprintf(buf, sz, "mem[%04x] <- %d\n", address, (int16_t)cpu->reg[ir.rd]);
+    } else if (ir.op == LOADB) {
+      snprintf(buf, sz, "%s <- %d <- byte[%04x]\n", regString(ir.rd),
+               cpu->reg[ir.rd], address);
+    } else {
+      snprintf(buf, sz, "byte[%04x] <- %d\n", address, cpu->reg[ir.rd] & 0xff);
     }
   } break;
   }
@@ -119,173 +512,239 @@ static char *postTrace(char *buf, int sz, CPU *cpu, Inst ir) {
   return buf;
 }
 
-void cpuRun(CPU *cpu, int cycles) {
-  char buf[256];
-  uint64_t endCycle = cpu->cycles + cycles;
-
-  for (; cpu->cycles < endCycle; cpu->cycles++) {
-    Inst ir = cpu->prog[cpu->pc];
-    if (cpu->trace) {
-      fprintf(stderr, "%04x: %s\n", cpu->pc, preTrace(buf, 256, cpu, ir));
-    }
-
-    switch (ir.op) {
-    case NOP:
-      // do nothing
-      break;
-
-    case HALT:
-      cpu->halt = true;
-      return;
-
-    case ERROR:
-      cpu->error = true;
-      return;
-
-    case RCSR:
-      // temporary jump instruction
-      cpu->pc = cpu->reg[ir.rd];
-      if (cpu->trace) {
-        fprintf(stderr, "  temp jump, PC <- %04x\n", cpu->pc + 1);
-      }
-      break;
-
-    case MOVE:
-      cpu->reg[ir.rd] = cpuRsval(cpu, ir);
-      break;
-
-    case IMM: // fall through
-    case IMM2:
-      cpu->imm = cpuRsval(cpu, ir) << 4;
-      cpu->immValid = true;
-      cpu->immExpire = true;
-      break;
+// recordKey writes a keyframe of the CPU's state before the instruction at
+// pc, which started at the given cycle count, into its binary trace.
+static void recordKey(CPU *cpu, uint16_t pc, uint64_t cycles, bool immValid) {
+  TraceKey key = {.cycles = cycles, .pc = pc, .imm = cpu->imm};
+  memcpy(key.reg, cpu->reg, sizeof(key.reg));
+  traceKey(cpu->record, &key, immValid);
+}
 
-    case CALL:
-      cpu->reg[0] = cpu->pc;
-      if (ir.fmt == FMT_RR) {
-        cpu->pc = cpu->reg[ir.rs];
-      } else {
-        cpu->pc += cpuImm(cpu, ir.imm);
-      }
-      break;
+// cpuRun is written so it can be compiled either as a threaded interpreter,
+// where each instruction handler jumps directly to the handler of the next
+// instruction using the labels-as-values extension in GCC and Clang, or as a
+// portable switch in a loop. Define RJ32_SWITCH_DISPATCH to force the switch.
+#if defined(__GNUC__) && !defined(RJ32_SWITCH_DISPATCH)
+#define RJ32_THREADED_DISPATCH
+#endif
+
+#ifdef RJ32_THREADED_DISPATCH
+#define SWITCH(op) goto *dispatch[op];
+#define CASE(op) op_##op:
+#define DISPATCH() goto *dispatch[ir->op]
+#else
+#define SWITCH(op) switch (op)
+#define CASE(op) case op:
+#define DISPATCH() continue
+#endif
+
+// cpuRead reads a word for a load instruction. A read that isn't straight
+// from memory brings cpu->cycles up to date first, as of the end of the load,
+// so the IO log can tell when it happened, and sets cpu->deviceRead.
+static inline uint16_t cpuRead(CPU *cpu, uint16_t address, uint64_t cycles) {
+  uint16_t *page = cpu->bus.readPages[address >> IOBUS_PAGE_BITS];
+  if (page != NULL) {
+    return page[address & (IOBUS_PAGE_SIZE - 1)];
+  }
+  cpu->cycles = cycles;
+  cpu->deviceRead = true;
+  return ioBusReadSlow(&cpu->bus, address);
+}
 
-    case JUMP:
-      if (ir.fmt == FMT_RR) {
-        cpu->pc = cpu->reg[ir.rs];
+// BEGIN_IR counts the cycles of the instruction in ir up front, unless that
+// would go past the cycle limit.
+#define BEGIN_IR()                                                             \
+  if (cycles + ir->len > endCycle) {                                           \
+    goto limit;                                                                \
+  }                                                                            \
+  cycles += ir->len;                                                           \
+  PRE_TRACE();                                                                 \
+  PROFILE_IR();                                                                \
+  RECORD_BEGIN()
+
+// DISPATCH_IR begins and dispatches the instruction in ir. With the switch,
+// that's done at the top of the loop.
+#ifdef RJ32_THREADED_DISPATCH
+#define DISPATCH_IR()                                                          \
+  BEGIN_IR();                                                                  \
+  DISPATCH()
+#else
+#define DISPATCH_IR() DISPATCH()
+#endif
+
+// FETCH fetches the instruction at pc and dispatches it.
+#define FETCH()                                                                \
+  ir = &prog[pc];                                                              \
+  WATCH_IR();                                                                  \
+  BREAK_IR();                                                                  \
+  DISPATCH_IR()
+
+// EXIT writes back the state kept in locals and returns from the run loop.
+#define EXIT()                                                                 \
+  PROFILE_EXIT();                                                              \
+  cpu->pc = pc;                                                                \
+  cpu->cycles = cycles;                                                        \
+  return
+
+// NEXT finishes an instruction by moving on to the next one.
+#define NEXT()                                                                 \
+  POST_TRACE();                                                                \
+  RECORD_END(false);                                                           \
+  pc += ir->len;                                                               \
+  FETCH()
+
+// JUMP_TO finishes an instruction by continuing at the target address.
+#define JUMP_TO(target)                                                        \
+  pc = (target);                                                               \
+  POST_TRACE();                                                                \
+  RECORD_END(false);                                                           \
+  FETCH()
+
+// NEXT_SKIP_IF finishes an if.* instruction, skipping the next instruction
+// (along with its imm prefix) if the condition failed.
+#define NEXT_SKIP_IF(cond)                                                     \
+  skip = (cond);                                                               \
+  POST_TRACE();                                                                \
+  RECORD_END(skip);                                                            \
+  pc += ir->len;                                                               \
+  if (skip) {                                                                  \
+    PROFILE_SKIP();                                                            \
+    pc += ir->skip;                                                            \
+  }                                                                            \
+  FETCH()
+
+// noBreakpoints is the breakpoint bitmap used when a run only stops at
+// watchpoints.
+static const uint64_t noBreakpoints[65536 / 64];
+
+// The run loop is instantiated from the template in cpurun.h once with text
+// tracing, once recording a binary trace, once with profiling, once watching
+// for a trace trigger, once stopping at breakpoints and watchpoints, and once
+// with none of them, so the regular loop contains no tracing, profiling or
+// breakpoint code and the choice between them is made once per call to
+// cpuRun. The tracing loops also stop where a trigger turns tracing off.
+#define RUN_NAME cpuRunTrace
+#define RUN_TRACE 1
+#define RUN_RECORD 0
+#define RUN_PROFILE 0
+#define RUN_WATCH 1
+#define RUN_BREAK 0
+#include "cpurun.h"
+
+#define RUN_NAME cpuRunRecord
+#define RUN_TRACE 0
+#define RUN_RECORD 1
+#define RUN_PROFILE 0
+#define RUN_WATCH 1
+#define RUN_BREAK 0
+#include "cpurun.h"
+
+#define RUN_NAME cpuRunProfile
+#define RUN_TRACE 0
+#define RUN_RECORD 0
+#define RUN_PROFILE 1
+#define RUN_WATCH 0
+#define RUN_BREAK 0
+#include "cpurun.h"
+
+#define RUN_NAME cpuRunWatch
+#define RUN_TRACE 0
+#define RUN_RECORD 0
+#define RUN_PROFILE 0
+#define RUN_WATCH 1
+#define RUN_BREAK 0
+#include "cpurun.h"
+
+#define RUN_NAME cpuRunBreak
+#define RUN_TRACE 0
+#define RUN_RECORD 0
+#define RUN_PROFILE 0
+#define RUN_WATCH 0
+#define RUN_BREAK 1
+#include "cpurun.h"
+
+#define RUN_NAME cpuRunFast
+#define RUN_TRACE 0
+#define RUN_RECORD 0
+#define RUN_PROFILE 0
+#define RUN_WATCH 0
+#define RUN_BREAK 0
+#include "cpurun.h"
+
+// cpuRunTriggered runs with tracing limited by cpu->trigger, switching
+// between loops each time the trigger's conditions change: the regular loop
+// up to the start cycle, the watching loop while waiting for the store or
+// for the pc to enter the ranges, and the tracing loop while in them.
+static void cpuRunTriggered(CPU *cpu, uint64_t endCycle) {
+  TraceTrigger *trigger = cpu->trigger;
+  while (cpu->cycles < endCycle && !cpu->halt && !cpu->error) {
+    uint64_t end = endCycle;
+    if (cpu->cycles < trigger->startCycle && trigger->startCycle < end) {
+      end = trigger->startCycle;
+    }
+    if (!traceTriggerArmed(trigger, cpu->cycles)) {
+      if (trigger->storeTrigger && !trigger->storeSeen) {
+        cpuRunWatch(cpu, end);
       } else {
-        cpu->pc += cpuImm(cpu, ir.imm);
-      }
-      break;
-
-    case LOAD:
-      ioBusTransaction(&cpu->bus, cpu->reg[ir.rs] + cpuOffset(cpu, ir.imm), 0,
-                       false);
-      cpu->reg[ir.rd] = cpu->bus.bus.data;
-      break;
-
-    case STORE:
-      ioBusTransaction(&cpu->bus, cpu->reg[ir.rs] + cpuOffset(cpu, ir.imm),
-                       cpu->reg[ir.rd], true);
-      break;
-
-    case ADD:
-      cpu->reg[ir.rd] = cpu->reg[ir.rd] + cpuRsval(cpu, ir);
-      break;
-
-    case SUB:
-      cpu->reg[ir.rd] = cpu->reg[ir.rd] - cpuRsval(cpu, ir);
-      break;
-
-    case XOR:
-      cpu->reg[ir.rd] = cpu->reg[ir.rd] ^ cpuRsval(cpu, ir);
-      break;
-
-    case AND:
-      cpu->reg[ir.rd] = cpu->reg[ir.rd] & cpuRsval(cpu, ir);
-      break;
-
-    case OR:
-      cpu->reg[ir.rd] = cpu->reg[ir.rd] | cpuRsval(cpu, ir);
-      break;
-
-    case SHL:
-      cpu->reg[ir.rd] = cpu->reg[ir.rd] << (cpuRsval(cpu, ir) & 0xf);
-      break;
-
-    case SHR:
-      cpu->reg[ir.rd] = cpu->reg[ir.rd] >> (cpuRsval(cpu, ir) & 0xf);
-      break;
-
-    case ASR: {
-      int16_t a = (int16_t)cpu->reg[ir.rd];
-      int16_t b = (int16_t)(cpuRsval(cpu, ir) & 0xf);
-      cpu->reg[ir.rd] = (uint16_t)(a >> b);
-    }; break;
-
-    case IFEQ:
-      if (cpu->reg[ir.rd] != cpuRsval(cpu, ir)) {
-        cpu->skip = true;
-      }
-      break;
-
-    case IFNE:
-      if (cpu->reg[ir.rd] == cpuRsval(cpu, ir)) {
-        cpu->skip = true;
-      }
-      break;
-
-    case IFLT: {
-      int16_t a = (int16_t)cpu->reg[ir.rd];
-      int16_t b = (int16_t)cpuRsval(cpu, ir);
-      if (a >= b) {
-        cpu->skip = true;
-      }
-    } break;
-
-    case IFGE: {
-      int16_t a = (int16_t)cpu->reg[ir.rd];
-      int16_t b = (int16_t)cpuRsval(cpu, ir);
-      if (a < b) {
-        cpu->skip = true;
-      }
-    } break;
-
-    case IFULT:
-      if (cpu->reg[ir.rd] >= cpuRsval(cpu, ir)) {
-        cpu->skip = true;
+        cpuRunFast(cpu, end);
       }
-      break;
-
-    case IFUGE:
-      if (cpu->reg[ir.rd] < cpuRsval(cpu, ir)) {
-        cpu->skip = true;
-      }
-      break;
-
-    default:
-      fprintf(stderr, "Unknown opcode: %d %s\n", ir.op, OpcodeString(ir.op));
-      assert(false);
-      break;
-    }
-
-    if (cpu->trace) {
-      fprintf(stderr, "  %s\n", postTrace(buf, sizeof(buf), cpu, ir));
+    } else if (!traceTriggerHas(trigger, cpu->pc)) {
+      cpuRunWatch(cpu, end);
+    } else if (cpu->trace) {
+      cpuRunTrace(cpu, end);
+    } else {
+      cpuRunRecord(cpu, end);
     }
+  }
+}
 
-    if (!cpu->immExpire) {
-      cpu->imm = 0;
-      cpu->immValid = false;
-    }
-    cpu->immExpire = false;
-    cpu->pc++;
+// cpuRunTo runs the variant of the run loop the CPU is set up for up to
+// endCycle.
+static void cpuRunTo(CPU *cpu, uint64_t endCycle) {
+  if (cpu->trigger != NULL && (cpu->trace || cpu->record != NULL)) {
+    cpuRunTriggered(cpu, endCycle);
+  } else if (cpu->trace) {
+    cpuRunTrace(cpu, endCycle);
+  } else if (cpu->record != NULL) {
+    cpuRunRecord(cpu, endCycle);
+  } else if (cpu->profile != NULL) {
+    cpuRunProfile(cpu, endCycle);
+  } else if (cpu->breakpoints != NULL || cpu->bus.watch != NULL) {
+    cpuRunBreak(cpu, endCycle);
+  } else {
+    cpuRunFast(cpu, endCycle);
+  }
+}
 
-    if (cpu->skip) {
-      if (cpu->prog[cpu->pc].op == IMM) {
-        cpu->pc++;
-      }
-      cpu->pc++;
-      cpu->skip = false;
+uint64_t cpuService(CPU *cpu) {
+  uint64_t next = UINT64_MAX;
+  if (cpu->ioLog != NULL) {
+    next = ioLogService(cpu->ioLog);
+  } else if (cpu->events != NULL) {
+    next = eventRunDue(cpu->events, cpu->cycles);
+  }
+  if (cpu->irq && (cpu->csr[CSR_STATUS] & CSR_STATUS_IE)) {
+    if (cpu->immValid) {
+      // the run stopped between an imm prefix and its instruction, so
+      // finish the instruction before taking the interrupt
+      next = cpu->cycles + 1;
+    } else {
+      cpu->pc = cpuInterruptPoint(cpu, cpu->pc);
     }
   }
-}
\ No newline at end of file
+  return next;
+}
+
+void cpuRun(CPU *cpu, uint64_t cycles) {
+  uint64_t endCycle =
+      cycles < UINT64_MAX - cpu->cycles ? cpu->cycles + cycles : UINT64_MAX;
+  cpu->breakHit = false;
+  cpu->bus.watchHit = false;
+  // run up to each event in turn, so the loop never has to check for them
+  do {
+    uint64_t next = cpuService(cpu);
+    cpu->idle = false;
+    cpuRunTo(cpu, next < endCycle ? next : endCycle);
+  } while (cpu->cycles < endCycle && !cpu->halt && !cpu->error &&
+           !cpu->breakHit);
+}
@@ -3,10 +3,78 @@
 
 #include "bus.h"
 #include "inst.h"
+#include "event.h"
+#include "profile.h"
+#include "trace.h"
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+// Program is a pre-decoded program memory image. The regular 16 bit
+// instructions are unpacked into 48 bits, with imm prefixes folded into the
+// instruction that follows them. This is fine because the program memory is
+// only 128kb, and unpacking will make it only 384kb. If you're porting this
+// emulator to a 32-bit architecture you probably don't want to do this, and
+// instead decode the program during execution.
+//
+// A program is immutable once it's shared, so any number of CPUs can point to
+// the same one, even from different threads. It's reference counted, and
+// freed when the last reference is released.
+typedef struct Program {
+  atomic_int refs;
+
+  // number of words in the program, everything after is decoded as nops
+  int length;
+
+  Inst inst[65536];
+
+  // the raw program memory, for loadc, which is zero past the end
+  uint16_t words[65536];
+} Program;
+
+// programCreate decodes the program memory into a new program with a single
+// reference. Decoding is just a lookup into the shared decodeTable, so this
+// is cheap. Returns NULL if out of memory.
+Program *programCreate(const uint16_t *progMem, int progLength);
+
+// programRetain adds a reference to the program, and returns it.
+Program *programRetain(Program *prog);
+
+// programRelease drops a reference to the program, freeing it if that was
+// the last one. prog can be NULL.
+void programRelease(Program *prog);
+
+// Snapshot is a saved copy of a CPU's state and the memory mapped on its IO
+// bus. The program isn't part of it, since the program never changes. Pages
+// of memory are shared copy-on-write between snapshots, so a snapshot only
+// copies the pages written since the CPU's last snapshot or restore.
+typedef struct Snapshot Snapshot;
+
+// The control and status registers, written with wcsr csr, rs. The CPU
+// takes an interrupt when one is pending and CSR_STATUS_IE is set: it saves
+// the address of the next instruction in CSR_EPC, clears CSR_STATUS_IE, and
+// jumps to CSR_VECTOR. rets jumps back to CSR_EPC and sets CSR_STATUS_IE.
+// Writing a period in cycles to CSR_TIMER starts a timer that raises an
+// interrupt every period cycles, and writing 0 stops it. The timer needs the
+// CPU to have an event queue.
+enum {
+  CSR_STATUS,
+  CSR_VECTOR,
+  CSR_EPC,
+  CSR_TIMER,
+  CSR_COUNT,
+};
+
+// CSR_STATUS flags
+enum {
+  // interrupts are enabled
+  CSR_STATUS_IE = 1 << 0,
+};
+
+// IOLog records or replays what comes into the CPU from devices, see iolog.h.
+typedef struct IOLog IOLog;
+
 // CPU represents the working state of an rj32 CPU.
 typedef struct CPU {
   // count of cycles since the start of the program
@@ -24,45 +92,186 @@ typedef struct CPU {
   // skip flag for tracking if next instruction should be skipped
   bool skip;
 
-  // immediate register and state
+  // carry flag, set by add and addc to the carry out of bit 15, and by sub
+  // and subc to the borrow, which addc and subc then add in or take away
+  bool carry;
+
+  // pending imm prefix. Prefixes are normally folded into the following
+  // instruction when the program is decoded, so this is only used for chains
+  // of imm instructions, or when the cycle limit falls between an imm prefix
+  // and its instruction.
   uint16_t imm;
   bool immValid;
-  bool immExpire;
 
   // halt and error output signals
   bool halt;
   bool error;
 
+  // control and status registers, whether an interrupt is pending, and the
+  // cycle count of the timer's next tick if it's running
+  uint16_t csr[CSR_COUNT];
+  bool irq;
+  uint64_t timerNext;
+
   // emit detailed instruction traces
   bool trace;
 
-  // pre-decoded program memory
-  Inst prog[65536];
+  // if not NULL, the binary trace to record every instruction in
+  Trace *record;
+
+  // if not NULL, limits text and binary tracing to the part of the run the
+  // trigger selects
+  TraceTrigger *trigger;
+
+  // if not NULL, the profile to count the CPU's execution in. Text tracing
+  // takes priority over binary tracing, which takes priority over profiling.
+  Profile *profile;
+
+  // if not NULL, the device events cpuRun stops to run when they're due
+  EventQueue *events;
+
+  // if not NULL, a bitmap of the pcs cpuRun stops at before running the
+  // instruction there, setting breakHit. The first instruction of a run
+  // always runs, so a run can carry on from a breakpoint. cpuRun also stops
+  // after an access that hits a watchpoint on the IO bus, setting breakHit
+  // along with the bus's watchHit. Breakpoints and watchpoints are ignored
+  // while tracing or profiling, and the JIT hands off to cpuRun while there
+  // are any.
+  const uint64_t *breakpoints;
+  bool breakHit;
+
+  // if not NULL, the log recording or replaying the CPU's device reads and
+  // events, which cpuService runs the events through
+  IOLog *ioLog;
+
+  // set if the last run ended in an idle loop, which can only be left once a
+  // device event changes memory. Only the regular run loop notices them, not
+  // the JIT or the loops for tracing, profiling or debugging.
+  bool idle;
+
+  // set by a load that went to a device rather than straight to memory. The
+  // device might change what it reads as each time, so the run loop doesn't
+  // skip an idle loop that read from one on its last time around.
+  bool deviceRead;
+
+  // pre-decoded program memory, which may be shared with other CPUs
+  Program *prog;
+
+  // the snapshot the memory matched as of the last snapshot or restore, with
+  // the pages written since then marked dirty on the IO bus
+  Snapshot *base;
 } CPU;
 
-// cpuInit initializes the CPU.
+// cpuInit initializes the CPU, with no program loaded. A program has to be
+// loaded before running the CPU.
 void cpuInit(CPU *cpu, bool trace);
 
+// cpuDestroy releases the CPU's program and snapshot.
+void cpuDestroy(CPU *cpu);
+
+// cpuReset resets the CPU's registers and signals to their initial state,
+// leaving the program memory and IO bus untouched.
+void cpuReset(CPU *cpu);
+
 // cpuInitBusDevices initializes the IO bus with the given device list.
 void cpuInitBusDevices(CPU *cpu, Device *devices, int numDevices);
 
-// cpuWriteProgMem writes the program into the CPU's program memory.
-// The program is pre-decoded for speed such that the regular 16 bit
-// instructions are unpacked into 32 bits. This is fine because the program
-// memory is only 128kb, and unpacking will make it only 256kb. If you're
-// porting this emulator to a 32-bit architecture you probably don't want to do
-// this, and instead decode the program during execution.
-void cpuWriteProgMem(CPU *cpu, const uint16_t *progMem, int progLength);
+// cpuSetProgram points the CPU at the program, adding a reference to it, and
+// releases the program it had before. The program is shared rather than
+// copied, so many CPUs can run the same program for the cost of one.
+void cpuSetProgram(CPU *cpu, Program *prog);
+
+// cpuWriteProgMem decodes the program into the CPU's program memory. If the
+// CPU already has a program that isn't shared with anything else, it's
+// reused, and only the words of the new program and whatever is left over
+// from the old one are decoded. Otherwise a new program is created. Returns
+// false if out of memory, leaving the old program in place.
+bool cpuWriteProgMem(CPU *cpu, const uint16_t *progMem, int progLength);
 
 // cpuWriteDataMem writes the data into the CPU's IO bus, which can write it
-// into data memory, or into other devices on the IO bus.
+// into data memory, or into other devices on the IO bus. Pages mapped to
+// memory are copied in bulk.
 void cpuWriteDataMem(CPU *cpu, const uint16_t *dataMem, int dataLength);
 
+// cpuWriteMem is like cpuWriteDataMem, but writes the words starting at the
+// given address instead of 0.
+void cpuWriteMem(CPU *cpu, uint16_t address, const uint16_t *words,
+                 int length);
+
+// cpuSnapshot takes a snapshot of the CPU, and write protects its memory to
+// track the pages written from then on. Only those pages have to be copied
+// by the next snapshot or restore. Returns NULL if out of memory.
+Snapshot *cpuSnapshot(CPU *cpu);
+
+// cpuRestore puts the CPU and its memory back to the state in the snapshot,
+// only copying the pages that differ from it. The CPU keeps its program and
+// IO devices, and is expected to have the same memory layout as the CPU the
+// snapshot was taken from.
+void cpuRestore(CPU *cpu, Snapshot *snap);
+
+// cpuDropSnapshot releases the snapshot the CPU's memory matched as of the
+// last snapshot or restore, for when the memory is changed behind the CPU's
+// back, so the next restore copies every page.
+void cpuDropSnapshot(CPU *cpu);
+
+// cpuFork copies the state of the parent CPU into the child, which needs its
+// own IO devices with the same memory layout. Forking a parent repeatedly
+// into the same child only copies the pages that changed in either of them.
+// Returns false if out of memory.
+bool cpuFork(CPU *child, CPU *parent);
+
+// snapshotRelease drops a reference to the snapshot, freeing it along with
+// any pages no other snapshot shares. snap can be NULL.
+void snapshotRelease(Snapshot *snap);
+
+// snapshotSave writes the snapshot to a file. Returns false on error.
+bool snapshotSave(const Snapshot *snap, const char *filename);
+
+// snapshotLoad reads a snapshot written by snapshotSave. Returns NULL if the
+// file can't be read or isn't a snapshot.
+Snapshot *snapshotLoad(const char *filename);
+
+// cpuWriteCsr writes a control and status register as of cpu->cycles.
+// Writes to registers that don't exist are ignored.
+void cpuWriteCsr(CPU *cpu, int csr, uint16_t value);
+
+// cpuInterruptPoint is called wherever the CPU can take an interrupt, with
+// the address of the next instruction. If an interrupt is pending and
+// enabled, it's taken, returning the address to go to instead.
+static inline uint16_t cpuInterruptPoint(CPU *cpu, uint16_t next) {
+  if (!cpu->irq || !(cpu->csr[CSR_STATUS] & CSR_STATUS_IE)) {
+    return next;
+  }
+  cpu->irq = false;
+  cpu->csr[CSR_EPC] = next;
+  cpu->csr[CSR_STATUS] &= ~CSR_STATUS_IE;
+  return cpu->csr[CSR_VECTOR];
+}
+
+// cpuService runs the CPU's events that are due, and takes a pending
+// interrupt if it can. Returns the cycle count the CPU can run up to before
+// it has to be called again. cpuRun calls it between runs of the loop, so
+// neither events nor interrupts are checked for on each instruction.
+uint64_t cpuService(CPU *cpu);
+
+// preTrace formats the text trace of the instruction ir at cpu->pc, from the
+// registers before it runs.
+char *preTrace(char *buf, int sz, const CPU *cpu, Inst ir);
+
+// postTrace formats the text trace of what the instruction ir did, from the
+// registers after it ran.
+char *postTrace(char *buf, int sz, const CPU *cpu, Inst ir);
+
 // cpuRun runs the CPU for the specified number of cycles. It's faster to run
 // at least a few cycles at a time, but cycles can be 1 if you want to single
 // step. If the CPU halts, it will return early and cpu->halt or cpu->error will
 // be set. If it returns without those signals being set, it indicates the CPU
-// hit the cycle limit.
-void cpuRun(CPU *cpu, int cycles);
+// hit the cycle limit, or a breakpoint if cpu->breakHit is set. cycles can
+// be as large as it likes, and the run stops at UINT64_MAX. Events in
+// cpu->events run when cpu->cycles reaches their cycle count, before the
+// instruction at that cycle, and an interrupt they raise is taken right then,
+// unless interrupts are disabled, in which case it's taken by the wcsr or
+// rets that enables them.
+void cpuRun(CPU *cpu, uint64_t cycles);
 
 #endif
\ No newline at end of file
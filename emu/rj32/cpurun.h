@@ -0,0 +1,469 @@
+// cpurun.h is a template for the CPU run loop. It's included by cpu.c once
+// for each variant of the loop, so that each variant is compiled with only the
+// code it needs. Before including it, define:
+//
+//   RUN_NAME  - the name of the run loop function to generate
+//   RUN_TRACE - 1 to emit detailed instruction traces, 0 for no tracing at all
+//   RUN_RECORD - 1 to record a binary trace in cpu->record, 0 for none
+//   RUN_PROFILE - 1 to count execution in cpu->profile, 0 for no profiling
+//   RUN_WATCH - 1 to stop where cpu->trigger switches tracing on or off
+//   RUN_BREAK - 1 to stop at the breakpoints in cpu->breakpoints and the
+//               watchpoints on the IO bus
+//
+// Idle loops are only skipped by the loop without any of these, since the
+// others have to see every instruction.
+#define RUN_IDLE                                                               \
+  !(RUN_TRACE || RUN_RECORD || RUN_PROFILE || RUN_WATCH || RUN_BREAK)
+
+#if RUN_TRACE
+#define PRE_TRACE()                                                            \
+  cpu->pc = pc;                                                                \
+  fprintf(stderr, "%04x: %s\n", pc, preTrace(buf, sizeof(buf), cpu, *ir))
+#define POST_TRACE()                                                           \
+  cpu->pc = pc;                                                                \
+  cpu->skip = skip;                                                            \
+  fprintf(stderr, "  %s\n", postTrace(buf, sizeof(buf), cpu, *ir))
+#else
+#define PRE_TRACE()
+#define POST_TRACE()
+#endif
+
+#if RUN_RECORD
+#define RECORD_BEGIN()                                                         \
+  if (record->used > record->limit) {                                         \
+    recordKey(cpu, pc, cycles - ir->len, ir == &prefixed);                     \
+  }                                                                            \
+  traceBegin(record, pc)
+#define RECORD_END(skip) traceEnd(record, ir, cpu->reg, skip)
+#else
+#define RECORD_BEGIN()
+#define RECORD_END(skip)
+#endif
+
+#if RUN_PROFILE
+#define PROFILE_IR() profile->counts[pc]++
+#define PROFILE_SKIP() profile->skips[pc]++
+#define PROFILE_LOAD(address) profile->loads[address]++
+#define PROFILE_STORE(address) profile->stores[address]++
+#define PROFILE_CALL(target) profileCall(profile, target, pc + ir->len, cycles)
+#define PROFILE_JUMP(target) profileJump(profile, target, cycles)
+#define PROFILE_EXIT() profileFlush(profile, cycles)
+#else
+#define PROFILE_IR()
+#define PROFILE_SKIP()
+#define PROFILE_LOAD(address)
+#define PROFILE_STORE(address)
+#define PROFILE_CALL(target)
+#define PROFILE_JUMP(target)
+#define PROFILE_EXIT()
+#endif
+
+#if RUN_WATCH
+// WATCH_IR stops the loop before the instruction at pc if it's where tracing
+// switches on or off. It's only checked when fetching, so the first
+// instruction always runs and the loop can't stop without making progress.
+#define WATCH_IR()                                                             \
+  if (stop || (watchPcs && traceTriggerHas(trigger, pc) == stopInside)) {     \
+    goto stop;                                                                 \
+  }
+// WATCH_STORE stops the loop after a store to the trigger's address.
+#define WATCH_STORE(address)                                                   \
+  if (watchStore && (address) == trigger->storeAddress) {                      \
+    trigger->storeSeen = true;                                                 \
+    stop = true;                                                               \
+  }
+#else
+#define WATCH_IR()
+#define WATCH_STORE(address)
+#endif
+
+#if RUN_BREAK
+// BREAK_IR stops the loop before the instruction at pc if it has a
+// breakpoint. Like WATCH_IR, it's only checked when fetching, so a run that
+// starts at a breakpoint runs the instruction there instead of stopping.
+#define BREAK_IR()                                                             \
+  if (breakpoints[pc / 64] >> (pc % 64) & 1) {                                 \
+    cpu->breakHit = true;                                                      \
+    goto stop;                                                                 \
+  }
+// BREAK_MEM stops the loop after a load or store that hit a watchpoint, by
+// bringing the end of the run forward to the current cycle. Only accesses
+// to watched pages can set watchHit, since the rest are still mapped.
+#define BREAK_MEM()                                                            \
+  if (cpu->bus.watchHit) {                                                     \
+    cpu->breakHit = true;                                                      \
+    endCycle = cycles;                                                         \
+  }
+#else
+#define BREAK_IR()
+#define BREAK_MEM()
+#endif
+
+#if RUN_IDLE
+// IDLE_JUMP skips ahead at a jump closing an idle loop (see idleLoop in
+// inst.c), once it's seen the whole loop run since the last time it got to
+// the jump, without reading from a device. Nothing can change until the end
+// of the run, so it adds as many whole times around the loop as fit before
+// then, leaving the rest to run as usual so the cycle count is exactly the
+// same as running every instruction.
+#define IDLE_JUMP()                                                            \
+  if (ir->idle) {                                                              \
+    uint16_t words = -ir->imm;                                                 \
+    if (pc == idlePc && cycles - idleCycles == words && !cpu->deviceRead) {    \
+      cycles += (endCycle - cycles) / words * words;                           \
+      cpu->idle = true;                                                        \
+    }                                                                          \
+    idlePc = pc;                                                               \
+    idleCycles = cycles;                                                       \
+    cpu->deviceRead = false;                                                   \
+  }
+#else
+#define IDLE_JUMP()
+#endif
+
+static void RUN_NAME(CPU *cpu, uint64_t endCycle) {
+  if (endCycle <= cpu->cycles) {
+    // nothing to run, so leave a pending imm prefix alone instead of
+    // taking it up and losing it at the limit
+    return;
+  }
+#if RUN_TRACE
+  char buf[256];
+#endif
+#if RUN_RECORD
+  Trace *record = cpu->record;
+  traceSync(record);
+#endif
+#if RUN_PROFILE
+  Profile *profile = cpu->profile;
+  profile->lastCycles = cpu->cycles;
+#endif
+#if RUN_WATCH
+  // a tracing loop stops when the pc leaves the trigger's ranges, and the
+  // loop watching for the trigger stops when its store happens, or once it's
+  // armed, when the pc enters its ranges
+  TraceTrigger *trigger = cpu->trigger;
+  const bool stopInside = !(RUN_TRACE || RUN_RECORD);
+  bool stop = false;
+  bool watchPcs = false;
+  bool watchStore = false;
+  if (trigger != NULL) {
+    watchPcs = trigger->pcFilter &&
+               (!stopInside || traceTriggerArmed(trigger, cpu->cycles));
+    watchStore = trigger->storeTrigger && !trigger->storeSeen;
+  }
+#endif
+#if RUN_BREAK
+  // with only watchpoints, there's an empty bitmap to check
+  const uint64_t *breakpoints =
+      cpu->breakpoints != NULL ? cpu->breakpoints : noBreakpoints;
+#endif
+#if RUN_IDLE
+  // the pc and cycle count as of the last jump closing an idle loop
+  int idlePc = -1;
+  uint64_t idleCycles = 0;
+#endif
+  const Inst *prog = cpu->prog->inst;
+  uint16_t pc = cpu->pc;
+  uint64_t cycles = cpu->cycles;
+  bool skip = false;
+  const Inst *ir;
+
+  // an instruction with an imm prefix applied at run time, instead of being
+  // folded in when the program was decoded
+  Inst prefixed;
+
+#ifdef RJ32_THREADED_DISPATCH
+  static const void *const dispatch[32] = {
+      [NOP] = &&op_NOP,       [RETS] = &&op_RETS,     [ERROR] = &&op_ERROR,
+      [HALT] = &&op_HALT,     [RCSR] = &&op_RCSR,     [WCSR] = &&op_WCSR,
+      [MOVE] = &&op_MOVE,     [LOADC] = &&op_LOADC,   [JUMP] = &&op_JUMP,
+      [IMM] = &&op_IMM,       [CALL] = &&op_CALL,     [IMM2] = &&op_IMM,
+      [LOAD] = &&op_LOAD,     [STORE] = &&op_STORE,   [LOADB] = &&op_LOADB,
+      [STOREB] = &&op_STOREB, [ADD] = &&op_ADD,       [SUB] = &&op_SUB,
+      [ADDC] = &&op_ADDC,     [SUBC] = &&op_SUBC,     [XOR] = &&op_XOR,
+      [AND] = &&op_AND,       [OR] = &&op_OR,         [SHL] = &&op_SHL,
+      [SHR] = &&op_SHR,       [ASR] = &&op_ASR,       [IFEQ] = &&op_IFEQ,
+      [IFNE] = &&op_IFNE,     [IFLT] = &&op_IFLT,     [IFGE] = &&op_IFGE,
+      [IFULT] = &&op_IFULT,   [IFUGE] = &&op_IFUGE,
+  };
+#endif
+
+  if (cpu->immValid) {
+    // the last run stopped between an imm prefix and its instruction
+    cpu->immValid = false;
+    prefixed = instPrefix(prog[pc], cpu->imm);
+    ir = &prefixed;
+  } else {
+    ir = &prog[pc];
+  }
+
+  for (;;) {
+    BEGIN_IR();
+
+    SWITCH(ir->op) {
+      CASE(NOP) {
+        // do nothing
+        NEXT();
+      }
+
+      CASE(HALT) {
+        // the halt itself doesn't take a cycle
+        cycles--;
+        cpu->halt = true;
+        EXIT();
+      }
+
+      CASE(ERROR) {
+        cycles--;
+        cpu->error = true;
+        EXIT();
+      }
+
+      CASE(RCSR) {
+        // temporary jump instruction
+#if RUN_TRACE
+        fprintf(stderr, "  temp jump, PC <- %04x\n", cpu->reg[ir->rd] + 1);
+#endif
+        JUMP_TO(cpu->reg[ir->rd] + 1);
+      }
+
+      CASE(RETS) {
+        // return from an interrupt, taking the next one straight away if
+        // it's already pending
+        cpu->csr[CSR_STATUS] |= CSR_STATUS_IE;
+        JUMP_TO(cpuInterruptPoint(cpu, cpu->csr[CSR_EPC]));
+      }
+
+      CASE(WCSR) {
+        // the timer is started from the cycle count as of this instruction,
+        // and enabling interrupts takes one that's pending
+        cpu->cycles = cycles;
+        cpuWriteCsr(cpu, ir->rd, cpu->reg[ir->rs]);
+        if (cpu->events != NULL && eventNext(cpu->events) < endCycle) {
+          // stop at the timer's first tick if it comes before the end
+          endCycle = eventNext(cpu->events);
+        }
+        JUMP_TO(cpuInterruptPoint(cpu, pc + ir->len));
+      }
+
+      CASE(MOVE) {
+        cpu->reg[ir->rd] = cpuRsval(cpu, ir);
+        NEXT();
+      }
+
+#ifndef RJ32_THREADED_DISPATCH
+    case IMM2: // fall through
+#endif
+      CASE(IMM) {
+        // an imm that couldn't be folded into the next instruction because
+        // it's part of a chain of imm instructions
+        cpu->imm = ir->imm << 4;
+        POST_TRACE();
+        RECORD_END(false);
+        pc++;
+        if (cycles >= endCycle) {
+          cpu->immValid = true;
+          EXIT();
+        }
+        prefixed = instPrefix(prog[pc], cpu->imm);
+        ir = &prefixed;
+        DISPATCH_IR();
+      }
+
+      CASE(CALL) {
+        // the return address is written first, so a call through ra calls
+        // the next instruction
+        cpu->reg[0] = pc + ir->len - 1;
+        uint16_t target = pc + ir->len + ir->imm;
+        if (ir->fmt == FMT_RR) {
+          target = cpu->reg[ir->rs] + 1;
+        }
+        PROFILE_CALL(target);
+        JUMP_TO(target);
+      }
+
+      CASE(JUMP) {
+        if (ir->fmt == FMT_RR) {
+          PROFILE_JUMP(cpu->reg[ir->rs] + 1);
+          JUMP_TO(cpu->reg[ir->rs] + 1);
+        }
+        IDLE_JUMP();
+        JUMP_TO(pc + ir->len + ir->imm);
+      }
+
+      CASE(LOAD) {
+        uint16_t address = cpu->reg[ir->rs] + ir->imm;
+        PROFILE_LOAD(address);
+        cpu->reg[ir->rd] = cpuRead(cpu, address, cycles);
+        BREAK_MEM();
+        NEXT();
+      }
+
+      CASE(STORE) {
+        uint16_t address = cpu->reg[ir->rs] + ir->imm;
+        PROFILE_STORE(address);
+        WATCH_STORE(address);
+        ioBusWrite(&cpu->bus, address, cpu->reg[ir->rd]);
+        BREAK_MEM();
+        NEXT();
+      }
+
+      CASE(LOADB) {
+        // bytes are addressed little endian, two to a word, so byte
+        // addresses only reach the first half of memory
+        uint16_t address = cpu->reg[ir->rs] + ir->imm;
+        PROFILE_LOAD(address >> 1);
+        uint16_t word = cpuRead(cpu, address >> 1, cycles);
+        cpu->reg[ir->rd] = (address & 1) ? word >> 8 : word & 0xff;
+        BREAK_MEM();
+        NEXT();
+      }
+
+      CASE(STOREB) {
+        uint16_t address = cpu->reg[ir->rs] + ir->imm;
+        int shift = (address & 1) * 8;
+        PROFILE_STORE(address >> 1);
+        WATCH_STORE(address >> 1);
+        uint16_t word = cpuRead(cpu, address >> 1, cycles);
+        word = (word & ~(0xff << shift)) | (cpu->reg[ir->rd] & 0xff) << shift;
+        ioBusWrite(&cpu->bus, address >> 1, word);
+        BREAK_MEM();
+        NEXT();
+      }
+
+      CASE(LOADC) {
+        // load from program memory
+        cpu->reg[ir->rd] = cpu->prog->words[cpu->reg[ir->rs]];
+        NEXT();
+      }
+
+      CASE(ADD) {
+        uint32_t sum = (uint32_t)cpu->reg[ir->rd] + cpuRsval(cpu, ir);
+        cpu->reg[ir->rd] = sum;
+        cpu->carry = sum >> 16;
+        NEXT();
+      }
+
+      CASE(SUB) {
+        uint16_t a = cpu->reg[ir->rd];
+        uint16_t b = cpuRsval(cpu, ir);
+        cpu->reg[ir->rd] = a - b;
+        cpu->carry = a < b;
+        NEXT();
+      }
+
+      CASE(ADDC) {
+        uint32_t sum = (uint32_t)cpu->reg[ir->rd] + cpuRsval(cpu, ir) +
+                       cpu->carry;
+        cpu->reg[ir->rd] = sum;
+        cpu->carry = sum >> 16;
+        NEXT();
+      }
+
+      CASE(SUBC) {
+        uint32_t a = cpu->reg[ir->rd];
+        uint32_t b = (uint32_t)cpuRsval(cpu, ir) + cpu->carry;
+        cpu->reg[ir->rd] = a - b;
+        cpu->carry = a < b;
+        NEXT();
+      }
+
+      CASE(XOR) {
+        cpu->reg[ir->rd] = cpu->reg[ir->rd] ^ cpuRsval(cpu, ir);
+        NEXT();
+      }
+
+      CASE(AND) {
+        cpu->reg[ir->rd] = cpu->reg[ir->rd] & cpuRsval(cpu, ir);
+        NEXT();
+      }
+
+      CASE(OR) {
+        cpu->reg[ir->rd] = cpu->reg[ir->rd] | cpuRsval(cpu, ir);
+        NEXT();
+      }
+
+      CASE(SHL) {
+        cpu->reg[ir->rd] = cpu->reg[ir->rd] << (cpuRsval(cpu, ir) & 0xf);
+        NEXT();
+      }
+
+      CASE(SHR) {
+        cpu->reg[ir->rd] = cpu->reg[ir->rd] >> (cpuRsval(cpu, ir) & 0xf);
+        NEXT();
+      }
+
+      CASE(ASR) {
+        int16_t a = (int16_t)cpu->reg[ir->rd];
+        int16_t b = (int16_t)(cpuRsval(cpu, ir) & 0xf);
+        cpu->reg[ir->rd] = (uint16_t)(a >> b);
+        NEXT();
+      }
+
+      CASE(IFEQ) {
+        NEXT_SKIP_IF(cpu->reg[ir->rd] != cpuRsval(cpu, ir));
+      }
+
+      CASE(IFNE) {
+        NEXT_SKIP_IF(cpu->reg[ir->rd] == cpuRsval(cpu, ir));
+      }
+
+      CASE(IFLT) {
+        NEXT_SKIP_IF((int16_t)cpu->reg[ir->rd] >= (int16_t)cpuRsval(cpu, ir));
+      }
+
+      CASE(IFGE) {
+        NEXT_SKIP_IF((int16_t)cpu->reg[ir->rd] < (int16_t)cpuRsval(cpu, ir));
+      }
+
+      CASE(IFULT) {
+        NEXT_SKIP_IF(cpu->reg[ir->rd] >= cpuRsval(cpu, ir));
+      }
+
+      CASE(IFUGE) {
+        NEXT_SKIP_IF(cpu->reg[ir->rd] < cpuRsval(cpu, ir));
+      }
+    }
+  }
+
+#if RUN_WATCH || RUN_BREAK
+stop:
+  EXIT();
+#endif
+
+limit:
+  if (cycles < endCycle) {
+    // only an instruction with an imm prefix folded in can straddle the
+    // cycle limit, so run just the prefix and leave the rest pending
+    cpu->imm = ir->imm & 0xfff0;
+    cpu->immValid = true;
+    pc++;
+    cycles++;
+  }
+  EXIT();
+}
+
+#undef PRE_TRACE
+#undef POST_TRACE
+#undef RECORD_BEGIN
+#undef RECORD_END
+#undef PROFILE_IR
+#undef PROFILE_SKIP
+#undef PROFILE_LOAD
+#undef PROFILE_STORE
+#undef PROFILE_CALL
+#undef PROFILE_JUMP
+#undef PROFILE_EXIT
+#undef WATCH_IR
+#undef WATCH_STORE
+#undef BREAK_IR
+#undef BREAK_MEM
+#undef IDLE_JUMP
+#undef RUN_NAME
+#undef RUN_TRACE
+#undef RUN_RECORD
+#undef RUN_PROFILE
+#undef RUN_WATCH
+#undef RUN_BREAK
+#undef RUN_IDLE
@@ -0,0 +1,217 @@
+#include "debug.h"
+#include "bus.h"
+#include "cpu.h"
+#include "inst.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void debuggerInit(Debugger *dbg, CPU *cpu, uint64_t maxCycles) {
+  memset(dbg, 0, sizeof(Debugger));
+  dbg->cpu = cpu;
+  dbg->maxCycles = maxCycles;
+  cpu->breakpoints = NULL;
+  ioBusSetWatch(&cpu->bus, NULL);
+}
+
+void debuggerSetBreakpoint(Debugger *dbg, uint16_t pc, bool set) {
+  if (debuggerHasBreakpoint(dbg, pc) == set) {
+    return;
+  }
+  dbg->breakpoints[pc / 64] ^= (uint64_t)1 << (pc % 64);
+  dbg->numBreakpoints += set ? 1 : -1;
+
+  // without any breakpoints, the CPU goes back to the regular run loop
+  dbg->cpu->breakpoints = dbg->numBreakpoints > 0 ? dbg->breakpoints : NULL;
+}
+
+void debuggerSetWatchpoint(Debugger *dbg, uint16_t address, bool read,
+                           bool write) {
+  IOBus *bus = &dbg->cpu->bus;
+  bool had = debuggerHasWatchpoint(dbg, address);
+  if (bus->watch == NULL) {
+    ioBusSetWatch(bus, &dbg->watch);
+  }
+  ioBusSetWatchpoint(bus, address, read, write);
+  dbg->numWatchpoints += (read || write) - had;
+
+  // without any watchpoints, every page is mapped again
+  if (dbg->numWatchpoints == 0) {
+    ioBusSetWatch(bus, NULL);
+  }
+}
+
+void debuggerContinue(Debugger *dbg) {
+  CPU *cpu = dbg->cpu;
+  if (!cpu->halt && !cpu->error && cpu->cycles < dbg->maxCycles) {
+    cpuRun(cpu, dbg->maxCycles - cpu->cycles);
+  }
+}
+
+void debuggerStep(Debugger *dbg) {
+  CPU *cpu = dbg->cpu;
+  // running a cycle at a time stops between an imm prefix and its
+  // instruction, so keep going until the instruction has run too
+  do {
+    cpuRun(cpu, 1);
+  } while (cpu->immValid && !cpu->halt && !cpu->error);
+}
+
+// showInst shows the instruction at pc, marking it if it has a breakpoint.
+static void showInst(Debugger *dbg, FILE *out, uint16_t pc) {
+  char buf[64];
+  Inst ir = dbg->cpu->prog->inst[pc];
+  fprintf(out, "%c %04x: %s\n", debuggerHasBreakpoint(dbg, pc) ? '*' : ' ',
+          pc, instString(buf, sizeof(buf), ir));
+}
+
+// showStop shows why the CPU stopped, and the instruction it stopped at.
+static void showStop(Debugger *dbg, FILE *out) {
+  CPU *cpu = dbg->cpu;
+  unsigned long long cycles = cpu->cycles;
+  if (cpu->halt) {
+    fprintf(out, "halted after %llu cycles\n", cycles);
+  } else if (cpu->error) {
+    fprintf(out, "error %d after %llu cycles\n", cpu->reg[1], cycles);
+  } else {
+    if (cpu->bus.watchHit) {
+      fprintf(out, "watchpoint: mem[%04x] %s after %llu cycles\n",
+              cpu->bus.watchAddress, cpu->bus.watchWrite ? "written" : "read",
+              cycles);
+    } else if (cpu->breakHit) {
+      fprintf(out, "breakpoint at %04x after %llu cycles\n", cpu->pc, cycles);
+    } else if (cpu->cycles >= dbg->maxCycles) {
+      fprintf(out, "out of cycles after %llu cycles\n", cycles);
+    }
+    showInst(dbg, out, cpu->pc);
+  }
+}
+
+static void showRegs(CPU *cpu, FILE *out) {
+  for (int i = 0; i < 16; i++) {
+    fprintf(out, "%3s %04x%s", regString(i), cpu->reg[i],
+            i % 4 == 3 ? "\n" : "  ");
+  }
+  fprintf(out, " pc %04x  carry %d  cycles %llu\n", cpu->pc, cpu->carry,
+          (unsigned long long)cpu->cycles);
+}
+
+// parseArg parses the next argument on the line in the given base, leaving
+// value alone if there isn't one. Returns false if it isn't a number.
+static bool parseArg(char **line, int base, unsigned long *value) {
+  char *end;
+  unsigned long parsed = strtoul(*line, &end, base);
+  if (end == *line) {
+    // nothing but spaces left means the argument was left out
+    return strspn(*line, " \t\r\n") == strlen(*line);
+  }
+  *line = end;
+  *value = parsed;
+  return true;
+}
+
+int debuggerRun(Debugger *dbg, FILE *in, FILE *out, bool prompt) {
+  CPU *cpu = dbg->cpu;
+  char line[256];
+  for (;;) {
+    if (prompt) {
+      fprintf(out, "(rj32) ");
+      fflush(out);
+    }
+    if (fgets(line, sizeof(line), in) == NULL) {
+      break;
+    }
+    char cmd[16];
+    int length;
+    if (sscanf(line, "%15s%n", cmd, &length) != 1) {
+      continue;
+    }
+    char *args = line + length;
+    unsigned long a = cpu->pc;
+    unsigned long b = 1;
+
+    if (strcmp(cmd, "break") == 0 || strcmp(cmd, "b") == 0 ||
+        strcmp(cmd, "delete") == 0 || strcmp(cmd, "d") == 0) {
+      bool set = cmd[0] == 'b';
+      if (!parseArg(&args, 16, &a) || a > 0xffff) {
+        fprintf(out, "usage: %s [pc]\n", cmd);
+        continue;
+      }
+      debuggerSetBreakpoint(dbg, a, set);
+    } else if (strcmp(cmd, "watch") == 0 || strcmp(cmd, "w") == 0 ||
+               strcmp(cmd, "rwatch") == 0 || strcmp(cmd, "unwatch") == 0) {
+      a = 0x10000;
+      if (!parseArg(&args, 16, &a) || a > 0xffff) {
+        fprintf(out, "usage: %s <address>\n", cmd);
+        continue;
+      }
+      bool set = strcmp(cmd, "unwatch") != 0;
+      debuggerSetWatchpoint(dbg, a, cmd[0] == 'r', set);
+    } else if (strcmp(cmd, "continue") == 0 || strcmp(cmd, "c") == 0) {
+      debuggerContinue(dbg);
+      showStop(dbg, out);
+    } else if (strcmp(cmd, "step") == 0 || strcmp(cmd, "s") == 0) {
+      if (!parseArg(&args, 10, &b)) {
+        fprintf(out, "usage: %s [count]\n", cmd);
+        continue;
+      }
+      for (unsigned long i = 0; i < b && !cpu->halt && !cpu->error; i++) {
+        debuggerStep(dbg);
+        if (cpu->bus.watchHit) {
+          break;
+        }
+      }
+      cpu->breakHit = false;
+      showStop(dbg, out);
+    } else if (strcmp(cmd, "regs") == 0 || strcmp(cmd, "r") == 0) {
+      showRegs(cpu, out);
+    } else if (strcmp(cmd, "mem") == 0 || strcmp(cmd, "x") == 0) {
+      a = 0;
+      if (!parseArg(&args, 16, &a) || !parseArg(&args, 10, &b) ||
+          a > 0xffff) {
+        fprintf(out, "usage: %s <address> [count]\n", cmd);
+        continue;
+      }
+      for (unsigned long i = 0; i < b && a + i <= 0xffff; i++) {
+        if (i % 8 == 0) {
+          fprintf(out, "%04lx:", a + i);
+        }
+        // memory is read directly, so showing it can't set off devices,
+        // watchpoints or the IO log, and the rest is left out
+        const uint16_t *page = ioBusPage(&cpu->bus, (a + i) >> IOBUS_PAGE_BITS);
+        if (page != NULL) {
+          fprintf(out, " %04x", page[(a + i) & (IOBUS_PAGE_SIZE - 1)]);
+        } else {
+          fprintf(out, " ----");
+        }
+        if (i % 8 == 7 || i + 1 == b || a + i == 0xffff) {
+          fprintf(out, "\n");
+        }
+      }
+    } else if (strcmp(cmd, "list") == 0 || strcmp(cmd, "l") == 0) {
+      b = 8;
+      if (!parseArg(&args, 16, &a) || !parseArg(&args, 10, &b) ||
+          a > 0xffff) {
+        fprintf(out, "usage: %s [pc] [count]\n", cmd);
+        continue;
+      }
+      // instructions with an imm prefix are shown once, at the prefix
+      for (unsigned long i = 0; i < b && a <= 0xffff; i++) {
+        showInst(dbg, out, a);
+        a += cpu->prog->inst[a].len;
+      }
+    } else if (strcmp(cmd, "quit") == 0 || strcmp(cmd, "q") == 0) {
+      break;
+    } else {
+      fprintf(out, "unknown command: %s\n", cmd);
+    }
+  }
+
+  if (cpu->error) {
+    return cpu->reg[1];
+  }
+  return cpu->halt ? 0 : 1;
+}
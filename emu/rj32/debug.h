@@ -0,0 +1,87 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Debugger runs a CPU under the control of commands, typed in or read from a
+// script, to stop at breakpoints, single step, and look at the registers,
+// memory and the disassembled program. Breakpoints are a bitmap the run loop
+// checks as it fetches each instruction, in a variant of the loop that's only
+// used while there are breakpoints or watchpoints, so the program runs at
+// close to full speed between them, and at full speed when there aren't any.
+// Watchpoints unmap their pages on the IO bus, so only accesses to those
+// pages are checked against them.
+typedef struct Debugger {
+  CPU *cpu;
+
+  // the pcs with breakpoints, and how many there are
+  uint64_t breakpoints[65536 / 64];
+  int numBreakpoints;
+
+  // the addresses with watchpoints, and how many there are
+  IOWatch watch;
+  int numWatchpoints;
+
+  // the cycle count the program can run up to
+  uint64_t maxCycles;
+} Debugger;
+
+// debuggerInit sets up a debugger for the CPU, with no breakpoints, that runs
+// it for at most maxCycles cycles in total.
+void debuggerInit(Debugger *dbg, CPU *cpu, uint64_t maxCycles);
+
+// debuggerSetBreakpoint sets or clears the breakpoint at pc.
+void debuggerSetBreakpoint(Debugger *dbg, uint16_t pc, bool set);
+
+// debuggerHasBreakpoint returns whether there's a breakpoint at pc.
+static inline bool debuggerHasBreakpoint(const Debugger *dbg, uint16_t pc) {
+  return dbg->breakpoints[pc / 64] >> (pc % 64) & 1;
+}
+
+// debuggerSetWatchpoint watches the address for reads, writes, both, or
+// neither to clear its watchpoint.
+void debuggerSetWatchpoint(Debugger *dbg, uint16_t address, bool read,
+                           bool write);
+
+// debuggerHasWatchpoint returns whether there's a watchpoint at the address.
+static inline bool debuggerHasWatchpoint(const Debugger *dbg,
+                                         uint16_t address) {
+  uint64_t watched = dbg->watch.reads[address / 64] |
+                     dbg->watch.writes[address / 64];
+  return watched >> (address % 64) & 1;
+}
+
+// debuggerContinue runs the CPU until it reaches a breakpoint, hits a
+// watchpoint, halts, errors or runs out of cycles. If it's at a breakpoint,
+// the instruction there runs first, so it doesn't stop straight away.
+void debuggerContinue(Debugger *dbg);
+
+// debuggerStep runs a single instruction, along with its imm prefix.
+void debuggerStep(Debugger *dbg);
+
+// debuggerRun reads commands from in until the end of the input or a quit,
+// writing what they show to out, with a prompt before each one if prompt is
+// set. Addresses are in hex, with breakpoints and list defaulting to the pc,
+// and counts are in decimal. The commands are:
+//
+//   break [pc]            (b) set a breakpoint
+//   delete [pc]           (d) clear a breakpoint
+//   watch <address>       (w) stop after writes to the address
+//   rwatch <address>          stop after reads or writes of the address
+//   unwatch <address>         clear a watchpoint
+//   continue              (c) run to the next breakpoint or the end
+//   step [count]          (s) run one or more instructions
+//   regs                  (r) show the registers
+//   mem <address> [count] (x) show words of memory, with ---- for devices
+//   list [pc] [count]     (l) disassemble, from the pc by default
+//   quit                  (q) stop debugging
+//
+// Returns the program's error code the same way as emuRun, or 1 if it didn't
+// finish.
+int debuggerRun(Debugger *dbg, FILE *in, FILE *out, bool prompt);
+
+#endif
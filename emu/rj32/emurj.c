@@ -1,48 +1,302 @@
+#include "emurj.h"
 #include "bus.h"
 #include "cpu.h"
+#include "image.h"
 #include "inst.h"
+#include "jit.h"
+#include "profile.h"
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-// runRj32Emu runs the emulator for the specified number of cycles with a
-// default set of IO devices and the specified program and data memory.
-// Returns the error code.
-int runRj32Emu(uint64_t maxCycles, const uint16_t *progMem, int progLength,
-               const uint16_t *dataMem, int dataLength, bool trace) {
+struct Emu {
   CPU cpu;
-  Device devices[] = {
-      {
-          .address = 0xFF00,
-          .size = 1,
-          .handler = stdoutWriter,
-          .context = NULL,
-      },
-      {
-          .address = 0,
-          .size = 0xffff,
-          .handler = memoryHandler,
-          .context = malloc(0x10000 * sizeof(uint16_t)),
-      },
+  Device devices[2];
+
+  // the stdout device, which buffers the program's output
+  Console console;
+
+  // where emuSetOutput sent the output, which the emulator's own messages
+  // about the run go to as well, or NULL for stderr
+  FILE *out;
+
+  // events scheduled by the devices
+  EventQueue events;
+
+  // data memory. A reset only has to clear the pages the IO bus marked as
+  // written.
+  uint16_t *ram;
+
+  // engine to run programs with, and the JIT, created the first time it's
+  // needed
+  Engine engine;
+  Jit *jit;
+};
+
+Emu *emuCreate(void) {
+  Emu *emu = malloc(sizeof(Emu));
+  if (emu == NULL) {
+    return NULL;
+  }
+  emu->ram = calloc(0x10000, sizeof(uint16_t));
+  if (emu->ram == NULL) {
+    free(emu);
+    return NULL;
+  }
+
+  consoleInit(&emu->console, consoleFileSink, NULL);
+  emu->out = NULL;
+  emu->devices[0] = (Device){
+      .address = 0xFF00,
+      .size = 1,
+      .handler = consoleHandler,
+      .context = &emu->console,
+  };
+  emu->devices[1] = (Device){
+      .address = 0,
+      .size = 0xffff,
+      .handler = memoryHandler,
+      .context = emu->ram,
+      .memory = emu->ram,
   };
+  emu->engine = ENGINE_INTERPRETER;
+  emu->jit = NULL;
+
+  eventQueueInit(&emu->events);
+  cpuInit(&emu->cpu, false);
+  emu->cpu.events = &emu->events;
+  if (!cpuWriteProgMem(&emu->cpu, NULL, 0)) {
+    free(emu->ram);
+    free(emu);
+    return NULL;
+  }
+  cpuInitBusDevices(&emu->cpu, emu->devices,
+                    sizeof(emu->devices) / sizeof(emu->devices[0]));
+  ioBusProtect(&emu->cpu.bus);
+  return emu;
+}
+
+bool emuLoad(Emu *emu, const uint16_t *progMem, int progLength,
+             const uint16_t *dataMem, int dataLength) {
+  emuReset(emu);
+  if (!cpuWriteProgMem(&emu->cpu, progMem, progLength)) {
+    return false;
+  }
+  if (emu->jit != NULL) {
+    jitInvalidate(emu->jit);
+  }
+  cpuWriteDataMem(&emu->cpu, dataMem, dataLength);
+  return true;
+}
 
-  cpuInit(&cpu, trace);
-  cpuWriteProgMem(&cpu, progMem, progLength);
-  cpuInitBusDevices(&cpu, devices, sizeof(devices) / sizeof(devices[0]));
-  cpuWriteDataMem(&cpu, dataMem, dataLength);
-  cpuRun(&cpu, maxCycles);
+void emuLoadProgram(Emu *emu, Program *prog, const uint16_t *dataMem,
+                    int dataLength) {
+  emuReset(emu);
+  cpuSetProgram(&emu->cpu, prog);
+  if (emu->jit != NULL) {
+    jitInvalidate(emu->jit);
+  }
+  cpuWriteDataMem(&emu->cpu, dataMem, dataLength);
+}
+
+// emuLoadSection loads the words at the address. Whole pages of memory are
+// backed by the words where they are, and only copied if they're written,
+// and the rest are written to the IO bus.
+static void emuLoadSection(Emu *emu, uint16_t address, const uint16_t *words,
+                           int length) {
+  IOBus *bus = &emu->cpu.bus;
+  int end = address + length;
+  int i = address;
+  while (i < end) {
+    int page = i >> IOBUS_PAGE_BITS;
+    int pageEnd = (page + 1) * IOBUS_PAGE_SIZE;
+    if (i == page * IOBUS_PAGE_SIZE && pageEnd <= end &&
+        bus->memoryPages[page] != NULL) {
+      ioBusShare(bus, page, words + (i - address));
+      i = pageEnd;
+      continue;
+    }
+    int n = (pageEnd < end ? pageEnd : end) - i;
+    cpuWriteMem(&emu->cpu, i, words + (i - address), n);
+    i += n;
+  }
+}
+
+bool emuLoadImage(Emu *emu, const Image *image) {
+  emuReset(emu);
+  const ImageSection *code = NULL;
+  for (int i = 0; i < image->numSections; i++) {
+    if (image->sections[i].kind == IMAGE_CODE) {
+      code = &image->sections[i];
+    }
+  }
+  if (!cpuWriteProgMem(&emu->cpu,
+                       code != NULL ? imageWords(image, code) : NULL,
+                       code != NULL ? code->length : 0)) {
+    return false;
+  }
+  if (emu->jit != NULL) {
+    jitInvalidate(emu->jit);
+  }
+  for (int i = 0; i < image->numSections; i++) {
+    const ImageSection *section = &image->sections[i];
+    if (section->kind == IMAGE_DATA) {
+      emuLoadSection(emu, section->address, imageWords(image, section),
+                     section->length);
+    }
+  }
+  emu->cpu.pc = image->entry;
+  return true;
+}
 
-  // make sure to free the data memory allocated
-  free(devices[1].context);
+void emuReset(Emu *emu) {
+  consoleFlush(&emu->console);
+  eventQueueClear(&emu->events);
+  cpuReset(&emu->cpu);
+  IOBus *bus = &emu->cpu.bus;
+  for (int i = 0; i < IOBUS_NUM_PAGES / 64; i++) {
+    uint64_t written = bus->written[i];
+    while (written) {
+      int page = i * 64 + __builtin_ctzll(written);
+      memset(emu->ram + page * IOBUS_PAGE_SIZE, 0,
+             IOBUS_PAGE_SIZE * sizeof(uint16_t));
+      written &= written - 1;
+    }
+  }
+  memset(bus->written, 0, sizeof(bus->written));
+  for (int page = 0; page < IOBUS_NUM_PAGES; page++) {
+    if (bus->sharedPages[page] != NULL) {
+      ioBusUnshare(bus, page);
+    }
+  }
+  ioBusProtect(bus);
+  // the memory no longer matches the last snapshot or restore
+  cpuDropSnapshot(&emu->cpu);
+}
 
-  if (cpu.error) {
-    return cpu.reg[1];
+// emuRunCycles runs the CPU with the emulator's engine, flushing the
+// program's output if it finishes.
+static void emuRunCycles(Emu *emu, uint64_t cycles) {
+  CPU *cpu = &emu->cpu;
+  cpu->idle = false;
+  if (emu->engine == ENGINE_JIT && emu->jit == NULL) {
+    emu->jit = jitCreate();
+  }
+  if (emu->engine == ENGINE_JIT && emu->jit != NULL) {
+    jitRun(emu->jit, cpu, cycles);
+  } else {
+    cpuRun(cpu, cycles);
   }
-  if (cpu.halt) {
-    return 0;
+
+  if (cpu->halt || cpu->error) {
+    consoleFlush(&emu->console);
   }
-  fprintf(stderr, "Program failed to terminate\n");
-  return 1;
+}
+
+int emuRun(Emu *emu, uint64_t maxCycles, bool trace) {
+  CPU *cpu = &emu->cpu;
+  cpu->trace = trace;
+  emuRunCycles(emu, maxCycles);
+  if (!cpu->halt && !cpu->error) {
+    // in the same stream as the program's output if it's been redirected,
+    // so a batch job's output has it, after whatever the program printed
+    if (emu->out != NULL) {
+      consoleFlush(&emu->console);
+    }
+    fprintf(emu->out != NULL ? emu->out : stderr,
+            "Program failed to terminate\n");
+  }
+  return emuExitCode(emu);
+}
+
+EmuStatus emuStep(Emu *emu, uint64_t slice) {
+  CPU *cpu = &emu->cpu;
+  if (!cpu->halt && !cpu->error && slice > 0) {
+    cpu->trace = false;
+    emuRunCycles(emu, slice);
+  }
+  if (cpu->error) {
+    return EMU_ERROR;
+  }
+  if (cpu->halt) {
+    return EMU_HALTED;
+  }
+  return cpu->idle ? EMU_WAITING : EMU_RUNNING;
+}
+
+int emuExitCode(const Emu *emu) {
+  if (emu->cpu.error) {
+    return emu->cpu.reg[1];
+  }
+  return emu->cpu.halt ? 0 : 1;
+}
+
+void emuSetOutput(Emu *emu, FILE *out) {
+  consoleSetSink(&emu->console, consoleFileSink, out);
+  emu->out = out;
+}
+
+Console *emuConsole(Emu *emu) { return &emu->console; }
+
+CPU *emuCpu(Emu *emu) { return &emu->cpu; }
+
+EventQueue *emuEvents(Emu *emu) { return &emu->events; }
+
+void emuSetEngine(Emu *emu, Engine engine) { emu->engine = engine; }
+
+void emuSetProfile(Emu *emu, Profile *profile) { emu->cpu.profile = profile; }
+
+void emuSetRecord(Emu *emu, Trace *trace) { emu->cpu.record = trace; }
+
+void emuSetTraceTrigger(Emu *emu, TraceTrigger *trigger) {
+  emu->cpu.trigger = trigger;
+}
+
+void emuProfileReport(Emu *emu, const Profile *profile, FILE *out,
+                      FILE *stacks) {
+  profileReport(out, profile, emu->cpu.prog->inst, &emu->cpu.bus);
+  if (stacks != NULL) {
+    profileWriteStacks(stacks, profile);
+  }
+}
+
+uint64_t emuCycles(const Emu *emu) { return emu->cpu.cycles; }
+
+void emuDestroy(Emu *emu) {
+  if (emu == NULL) {
+    return;
+  }
+  jitDestroy(emu->jit);
+  cpuDestroy(&emu->cpu);
+  consoleDestroy(&emu->console);
+  eventQueueDestroy(&emu->events);
+  free(emu->ram);
+  free(emu);
+}
+
+// runRj32Emu runs the emulator for the specified number of cycles with a
+// default set of IO devices and the specified program and data memory, using
+// the specified engine. Returns the error code.
+int runRj32Emu(uint64_t maxCycles, const uint16_t *progMem, int progLength,
+               const uint16_t *dataMem, int dataLength, bool trace,
+               Engine engine) {
+  Emu *emu = emuCreate();
+  if (emu == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  emuSetEngine(emu, engine);
+  if (!emuLoad(emu, progMem, progLength, dataMem, dataLength)) {
+    fprintf(stderr, "Out of memory\n");
+    emuDestroy(emu);
+    return 1;
+  }
+  int ret = emuRun(emu, maxCycles, trace);
+
+  emuDestroy(emu);
+  return ret;
 }
@@ -1,11 +1,158 @@
 #ifndef EMURJ_H
 #define EMURJ_H
 
-#include <stdint.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Engine selects how the emulator runs programs. The JIT is only available on
+// x86-64, elsewhere it quietly falls back to the interpreter, as do tracing
+// and profiling.
+typedef enum Engine {
+  ENGINE_INTERPRETER,
+  ENGINE_JIT,
+} Engine;
 
 int runRj32Emu(uint64_t maxCycles, const uint16_t *progMem, int progLength,
-               const uint16_t *dataMem, int dataLength, bool trace);
+               const uint16_t *dataMem, int dataLength, bool trace,
+               Engine engine);
+
+// Emu is a reusable emulator context with the default set of IO devices. It
+// keeps the CPU and data memory allocated between runs, and only resets the
+// state that a run actually touched, so running many small programs doesn't
+// pay for setting up a whole new emulator each time.
+typedef struct Emu Emu;
+
+// CPU is the emulated CPU, see cpu.h.
+typedef struct CPU CPU;
+
+// Program is a pre-decoded program that can be shared between emulators, see
+// cpu.h.
+typedef struct Program Program;
+
+// Console is the buffered stdout device, see bus.h.
+typedef struct Console Console;
+
+// EventQueue schedules device events by cycle count, see event.h.
+typedef struct EventQueue EventQueue;
+
+// Profile counts where a program spends its time, see profile.h.
+typedef struct Profile Profile;
+
+// Trace is a binary trace of every instruction run, see trace.h.
+typedef struct Trace Trace;
+
+// TraceTrigger limits tracing to part of a run, see trace.h.
+typedef struct TraceTrigger TraceTrigger;
+
+// Image is a mapped ROM image file, see image.h.
+typedef struct Image Image;
+
+// emuCreate allocates a new emulator context with no program loaded. Returns
+// NULL if out of memory.
+Emu *emuCreate(void);
+
+// emuLoad resets the emulator and loads the program and data memory. Unless
+// the previously loaded program is shared, only the words of the new program,
+// and whatever is left over from the previous one, are decoded. Returns false
+// if out of memory.
+bool emuLoad(Emu *emu, const uint16_t *progMem, int progLength,
+             const uint16_t *dataMem, int dataLength);
+
+// emuLoadProgram is like emuLoad, but shares an already decoded program
+// instead of decoding one, so running many emulators on the same program only
+// needs one copy of it.
+void emuLoadProgram(Emu *emu, Program *prog, const uint16_t *dataMem,
+                    int dataLength);
+
+// emuLoadImage resets the emulator, loads the image's code section as the
+// program and each of its data sections at its address, and starts the CPU at
+// the image's entry point. Whole pages of data are read from the image where
+// it's mapped, and only copied into memory when they're first written, so the
+// image has to stay open until the emulator is reset, loads something else or
+// is destroyed. Returns false if out of memory.
+bool emuLoadImage(Emu *emu, const Image *image);
+
+// emuReset resets the CPU and clears any data memory pages that were written
+// since the last reset. The program stays loaded.
+void emuReset(Emu *emu);
+
+// emuRun runs the loaded program for at most maxCycles cycles and returns the
+// error code, the same way as runRj32Emu.
+int emuRun(Emu *emu, uint64_t maxCycles, bool trace);
+
+// EmuStatus is what the program is doing at the end of a slice run by emuStep.
+typedef enum EmuStatus {
+  // it ran for the whole slice, and can be stepped again
+  EMU_RUNNING,
+  // it halted
+  EMU_HALTED,
+  // it stopped with an error, see emuExitCode
+  EMU_ERROR,
+  // it's in a loop waiting for a device event, which can't happen until the
+  // next one that's scheduled. Only the interpreter notices, and it skips
+  // ahead through the loop, so a slice spent waiting costs next to nothing.
+  EMU_WAITING,
+} EmuStatus;
+
+// emuStep runs the loaded program for a slice of at most slice cycles, then
+// returns, so many emulators can take turns on one thread. The next call
+// carries on where the last one left off, and an emulator stepped through a
+// program in slices runs to exactly the same cycle count as one that runs it
+// in one go. A program that's halted or errored stays that way until the
+// emulator is reset. A slice of 0 does nothing, and returns the same status
+// as the last call, so stepping by 0 over and over never finishes.
+EmuStatus emuStep(Emu *emu, uint64_t slice);
+
+// emuExitCode returns the error code of the program, the same way as emuRun:
+// 0 if it halted, its error code if it errored, and 1 if it hasn't finished.
+int emuExitCode(const Emu *emu);
+
+// emuSetOutput sets where the program's output to the stdout device at
+// 0xFF00 goes. The default is NULL, which is stdout. Output is buffered, and
+// written out a line at a time, when the program halts or errors, and before
+// the emulator is reset or the output is changed. emuRun's message for a
+// program that fails to terminate goes there too, or to stderr by default.
+void emuSetOutput(Emu *emu, FILE *out);
+
+// emuConsole returns the stdout device, so its output can be sent to any of
+// the console sinks in bus.h instead of a file.
+Console *emuConsole(Emu *emu);
+
+// emuCpu returns the emulator's CPU, for tools like the debugger that need to
+// run it themselves.
+CPU *emuCpu(Emu *emu);
+
+// emuEvents returns the emulator's event queue, for devices to schedule
+// events on. It's cleared whenever the emulator is reset.
+EventQueue *emuEvents(Emu *emu);
+
+// emuSetEngine selects the engine used by emuRun. The default is
+// ENGINE_INTERPRETER.
+void emuSetEngine(Emu *emu, Engine engine);
+
+// emuSetProfile sets the profile that emuRun counts the program's execution
+// in. The default is NULL, which turns profiling off.
+void emuSetProfile(Emu *emu, Profile *profile);
+
+// emuSetRecord sets the binary trace that emuRun records every instruction
+// in. The default is NULL, which turns recording off.
+void emuSetRecord(Emu *emu, Trace *trace);
+
+// emuSetTraceTrigger limits both the text trace and the binary trace to the
+// part of the run the trigger selects. The default is NULL, which traces the
+// whole run.
+void emuSetTraceTrigger(Emu *emu, TraceTrigger *trigger);
+
+// emuProfileReport writes the profile's report and, if stacks isn't NULL, its
+// collapsed call stacks, using the loaded program and IO devices.
+void emuProfileReport(Emu *emu, const Profile *profile, FILE *out,
+                      FILE *stacks);
+
+// emuCycles returns the number of cycles run since the last reset.
+uint64_t emuCycles(const Emu *emu);
 
+// emuDestroy frees the emulator context.
+void emuDestroy(Emu *emu);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,410 @@
+// emurj2c translates an rj32 ROM ahead of time into a C program that runs it.
+// Every instruction in the program gets a label, so direct jumps and skips
+// become gotos, and only indirect jumps go through a switch on the pc. The
+// generated program uses the IO bus from bus.c with the same devices as
+// runRj32Emu, and exits with the same error code, so build it with:
+//
+//   emurj2c rom.bin rom.c && cc -O2 -Iemu/rj32 -o rom rom.c emu/rj32/bus.c
+//
+// It can be run with a different data memory image than the one in the ROM.
+// There's no event queue or timer, so ROMs that use interrupts, with wcsr or
+// rets, are refused.
+#include "inst.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static Inst prog[65536];
+static const uint16_t *progWords;
+static int progLength;
+
+// whether the program has any halt or error instructions
+static bool hasHalt;
+static bool hasError;
+
+// emitGoto emits a goto to the label for the target address. Addresses past
+// the end of the program run nops, which don't get labels of their own.
+static void emitGoto(FILE *out, uint16_t target) {
+  if (target <= progLength && target < 0x10000) {
+    fprintf(out, "  goto L%04x;\n", target);
+  } else {
+    fprintf(out, "  pc = 0x%04x;\n", target);
+    fprintf(out, "  goto nops;\n");
+  }
+}
+
+// emitInst emits the C code for the instruction at pc.
+static void emitInst(FILE *out, Inst ir, uint16_t pc) {
+  char buf[64];
+  fprintf(out, "  // %s\n", instString(buf, sizeof(buf), ir));
+
+  if (ir.op == IMM || ir.op == IMM2) {
+    // an imm that couldn't be folded because it's part of a chain of imm
+    // instructions, so fold it here into the instruction after it
+    fprintf(out, "  c += 1;\n");
+    emitInst(out, instPrefix(prog[(uint16_t)(pc + 1)], ir.imm << 4), pc + 1);
+    return;
+  }
+
+  uint16_t next = pc + ir.len;
+  const char *rsval = buf;
+  if (ir.fmt == FMT_RR) {
+    snprintf(buf, sizeof(buf), "r[%d]", ir.rs);
+  } else {
+    snprintf(buf, sizeof(buf), "0x%04x", ir.imm);
+  }
+
+  fprintf(out, "  c += %d;\n", ir.len);
+  switch (ir.op) {
+  case NOP:
+    break;
+
+  case HALT:
+  case ERROR:
+    // the halt itself doesn't take a cycle
+    fprintf(out, "  if (c > maxCycles) goto timeout;\n");
+    fprintf(out, "  c--;\n");
+    if (ir.op == HALT) {
+      hasHalt = true;
+      fprintf(out, "  goto halt;\n");
+    } else {
+      hasError = true;
+      fprintf(out, "  goto error;\n");
+    }
+    return;
+
+  case RCSR:
+    // temporary jump instruction
+    fprintf(out, "  if (c > maxCycles) goto timeout;\n");
+    fprintf(out, "  pc = r[%d] + 1;\n", ir.rd);
+    fprintf(out, "  goto dispatch;\n");
+    return;
+
+  case MOVE:
+    fprintf(out, "  r[%d] = %s;\n", ir.rd, rsval);
+    break;
+
+  case CALL:
+  case JUMP:
+    if (ir.op == CALL) {
+      fprintf(out, "  r[0] = 0x%04x;\n", (uint16_t)(next - 1));
+    }
+    fprintf(out, "  if (c > maxCycles) goto timeout;\n");
+    if (ir.fmt == FMT_RR) {
+      fprintf(out, "  pc = r[%d] + 1;\n", ir.rs);
+      fprintf(out, "  goto dispatch;\n");
+    } else {
+      emitGoto(out, next + ir.imm);
+    }
+    return;
+
+  case LOAD:
+    fprintf(out, "  r[%d] = load(r[%d] + 0x%04x);\n", ir.rd, ir.rs, ir.imm);
+    break;
+
+  case STORE:
+    // the cycle limit is otherwise only checked at jumps, so check it before
+    // anything the program does can be seen, like console output
+    fprintf(out, "  if (c > maxCycles) goto timeout;\n");
+    fprintf(out, "  store(r[%d] + 0x%04x, r[%d]);\n", ir.rs, ir.imm, ir.rd);
+    break;
+
+  case LOADB:
+    fprintf(out, "  r[%d] = loadb(r[%d] + 0x%04x);\n", ir.rd, ir.rs, ir.imm);
+    break;
+
+  case STOREB:
+    fprintf(out, "  if (c > maxCycles) goto timeout;\n");
+    fprintf(out, "  storeb(r[%d] + 0x%04x, r[%d]);\n", ir.rs, ir.imm, ir.rd);
+    break;
+
+  case LOADC:
+    fprintf(out, "  r[%d] = loadc(r[%d]);\n", ir.rd, ir.rs);
+    break;
+
+  case ADD:
+  case ADDC:
+    fprintf(out, "  t = (uint32_t)r[%d] + %s%s;\n", ir.rd, rsval,
+            ir.op == ADDC ? " + carry" : "");
+    fprintf(out, "  carry = t >> 16;\n");
+    fprintf(out, "  r[%d] = t;\n", ir.rd);
+    break;
+
+  case SUB:
+  case SUBC:
+    fprintf(out, "  t = (uint32_t)%s%s;\n", rsval,
+            ir.op == SUBC ? " + carry" : "");
+    fprintf(out, "  carry = r[%d] < t;\n", ir.rd);
+    fprintf(out, "  r[%d] -= t;\n", ir.rd);
+    break;
+
+  case XOR:
+    fprintf(out, "  r[%d] ^= %s;\n", ir.rd, rsval);
+    break;
+
+  case AND:
+    fprintf(out, "  r[%d] &= %s;\n", ir.rd, rsval);
+    break;
+
+  case OR:
+    fprintf(out, "  r[%d] |= %s;\n", ir.rd, rsval);
+    break;
+
+  case SHL:
+    fprintf(out, "  r[%d] <<= (%s & 0xf);\n", ir.rd, rsval);
+    break;
+
+  case SHR:
+    fprintf(out, "  r[%d] >>= (%s & 0xf);\n", ir.rd, rsval);
+    break;
+
+  case ASR:
+    fprintf(out, "  r[%d] = (uint16_t)((int16_t)r[%d] >> (%s & 0xf));\n", ir.rd,
+            ir.rd, rsval);
+    break;
+
+  case IFEQ:
+  case IFNE:
+  case IFLT:
+  case IFGE:
+  case IFULT:
+  case IFUGE: {
+    static const char *const skipConds[] = {
+        [IFEQ - IFEQ] = "r[%d] != (uint16_t)%s",
+        [IFNE - IFEQ] = "r[%d] == (uint16_t)%s",
+        [IFLT - IFEQ] = "(int16_t)r[%d] >= (int16_t)%s",
+        [IFGE - IFEQ] = "(int16_t)r[%d] < (int16_t)%s",
+        [IFULT - IFEQ] = "r[%d] >= (uint16_t)%s",
+        [IFUGE - IFEQ] = "r[%d] < (uint16_t)%s",
+    };
+    fprintf(out, "  if (");
+    fprintf(out, skipConds[ir.op - IFEQ], ir.rd, rsval);
+    fprintf(out, ") {\n  ");
+    emitGoto(out, next + ir.skip);
+    fprintf(out, "  }\n");
+  } break;
+
+  default:
+    fprintf(out, "  unknown(%d);\n", ir.op);
+    break;
+  }
+
+  if (next != pc + 1) {
+    emitGoto(out, next);
+  }
+}
+
+static void emitProgram(FILE *out, const uint16_t *data, int dataLength,
+                        uint64_t maxCycles) {
+  fprintf(out, "// Generated by emurj2c, do not edit.\n"
+               "#include \"bus.h\"\n\n"
+               "#include <stdint.h>\n"
+               "#include <stdio.h>\n"
+               "#include <stdlib.h>\n\n");
+
+  fprintf(out, "static const uint64_t maxCycles = %lluull;\n\n",
+          (unsigned long long)maxCycles);
+
+  fprintf(out, "static const uint16_t dataMem[] = {");
+  for (int i = 0; i < dataLength; i++) {
+    fprintf(out, "%s0x%04x,", i % 8 ? " " : "\n    ", data[i]);
+  }
+  fprintf(out, "\n    0};\n");
+  fprintf(out, "static const int dataLength = %d;\n\n", dataLength);
+
+  // the program memory is only needed for loadc
+  bool hasLoadc = false;
+  for (int pc = 0; pc < progLength; pc++) {
+    hasLoadc = hasLoadc || prog[pc].op == LOADC;
+  }
+  if (hasLoadc) {
+    fprintf(out, "static const uint16_t code[] = {");
+    for (int i = 0; i < progLength; i++) {
+      fprintf(out, "%s0x%04x,", i % 8 ? " " : "\n    ", progWords[i]);
+    }
+    fprintf(out, "\n    0};\n\n");
+    fprintf(out,
+            "static inline uint16_t loadc(uint16_t address) {\n"
+            "  return address < %d ? code[address] : 0;\n"
+            "}\n\n",
+            progLength);
+  }
+
+  fprintf(out,
+          "static uint16_t ram[0x10000];\n"
+          "static Console console;\n"
+          "static Device devices[] = {\n"
+          "    {.address = 0xFF00, .size = 1, .handler = consoleHandler,\n"
+          "     .context = &console},\n"
+          "    {.address = 0, .size = 0xffff, .handler = memoryHandler,\n"
+          "     .context = ram, .memory = ram},\n"
+          "};\n"
+          "static IOBus bus;\n\n"
+          "static inline uint16_t load(uint16_t address) {\n"
+          "  return ioBusRead(&bus, address);\n"
+          "}\n\n"
+          "static inline void store(uint16_t address, uint16_t data) {\n"
+          "  ioBusWrite(&bus, address, data);\n"
+          "}\n\n"
+          "static inline uint16_t loadb(uint16_t address) {\n"
+          "  uint16_t word = ioBusRead(&bus, address >> 1);\n"
+          "  return (address & 1) ? word >> 8 : word & 0xff;\n"
+          "}\n\n"
+          "static inline void storeb(uint16_t address, uint16_t data) {\n"
+          "  int shift = (address & 1) * 8;\n"
+          "  uint16_t word = ioBusRead(&bus, address >> 1);\n"
+          "  word = (word & ~(0xff << shift)) | (data & 0xff) << shift;\n"
+          "  ioBusWrite(&bus, address >> 1, word);\n"
+          "}\n\n"
+          "static inline void unknown(int op) {\n"
+          "  fprintf(stderr, \"Unknown opcode: %%d\\n\", op);\n"
+          "  abort();\n"
+          "}\n\n");
+
+  fprintf(out,
+          "// loadData loads a data memory image, the same as the data after "
+          "the\n"
+          "// program in a ROM.\n"
+          "static void loadData(const char *filename) {\n"
+          "  FILE *f = fopen(filename, \"rb\");\n"
+          "  if (f == NULL) {\n"
+          "    perror(filename);\n"
+          "    exit(1);\n"
+          "  }\n"
+          "  uint16_t word;\n"
+          "  for (int i = 0; i < 0x10000 && fread(&word, 2, 1, f) == 1; i++) "
+          "{\n"
+          "    ioBusWrite(&bus, i, word);\n"
+          "  }\n"
+          "  fclose(f);\n"
+          "}\n\n");
+
+  fprintf(out, "int main(int argc, const char *argv[]) {\n"
+               "  if (argc > 2) {\n"
+               "    printf(\"Usage: %%s [data file]\\n\", argv[0]);\n"
+               "    exit(1);\n"
+               "  }\n\n"
+               "  consoleInit(&console, consoleFileSink, NULL);\n"
+               "  ioBusInit(&bus, devices, 2);\n"
+               "  if (argc == 2) {\n"
+               "    loadData(argv[1]);\n"
+               "  } else {\n"
+               "    for (int i = 0; i < dataLength; i++) {\n"
+               "      ioBusWrite(&bus, i, dataMem[i]);\n"
+               "    }\n"
+               "  }\n\n"
+               "  uint16_t r[16] = {0};\n"
+               "  uint16_t pc = 0;\n"
+               "  uint64_t c = 0;\n"
+               "  uint32_t t = 0;\n"
+               "  uint16_t carry = 0;\n"
+               "  (void)t;\n"
+               "  (void)carry;\n"
+               "  goto dispatch;\n\n");
+
+  for (int pc = 0; pc < progLength; pc++) {
+    fprintf(out, "L%04x:\n", pc);
+    emitInst(out, prog[pc], pc);
+  }
+
+  // past the end of the program is all nops, which wrap around to the start
+  if (progLength < 0x10000) {
+    fprintf(out, "L%04x:\n"
+                 "  pc = 0x%04x;\n",
+            progLength, progLength);
+  }
+  fprintf(out, "nops:\n"
+               "  c += 0x10000 - pc;\n"
+               "  if (c > maxCycles) goto timeout;\n"
+               "  goto L0000;\n\n");
+
+  fprintf(out, "dispatch:\n"
+               "  switch (pc) {\n");
+  for (int pc = 0; pc <= progLength && pc < 0x10000; pc++) {
+    fprintf(out, "  case 0x%04x: goto L%04x;\n", pc, pc);
+  }
+  fprintf(out, "  default: goto nops;\n"
+               "  }\n\n");
+
+  if (hasHalt) {
+    fprintf(out, "halt:\n"
+                 "  consoleFlush(&console);\n"
+                 "  return 0;\n");
+  }
+  if (hasError) {
+    fprintf(out, "error:\n"
+                 "  consoleFlush(&console);\n"
+                 "  return r[1];\n");
+  }
+  fprintf(out, "timeout:\n"
+               "  consoleFlush(&console);\n"
+               "  fprintf(stderr, \"Program failed to terminate\\n\");\n"
+               "  return 1;\n"
+               "}\n");
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc != 3 && argc != 4) {
+    printf("Usage: %s <rom file> <output.c> [max cycles]\n", argv[0]);
+    exit(1);
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    perror(argv[1]);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  long fsize = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  uint16_t *rom = malloc(fsize + 1);
+  fread(rom, fsize, 1, f);
+  fclose(f);
+
+  // same layout as emurj: the program, then optionally the data memory
+  int romsize = fsize / 2;
+  uint16_t *data = NULL;
+  int datasize = 0;
+  if (romsize > 0x10000) {
+    data = rom + 0x10000;
+    datasize = romsize - 0x10000;
+    romsize = 0x10000;
+  }
+
+  // same default as emurj
+  uint64_t maxCycles = 1000000;
+  if (argc == 4) {
+    maxCycles = strtoull(argv[3], NULL, 0);
+  }
+
+  progLength = romsize;
+  progWords = rom;
+  decodeProgram(prog, rom, romsize);
+  for (int i = romsize; i < 0x10000; i++) {
+    prog[i] = decodeTable()[0];
+  }
+  for (int pc = 0; pc < romsize; pc++) {
+    if (prog[pc].op == WCSR || prog[pc].op == RETS) {
+      char buf[64];
+      fprintf(stderr,
+              "%s: %04x: %s: interrupts aren't supported, run the ROM with "
+              "emurj instead\n",
+              argv[1], pc, instString(buf, sizeof(buf), prog[pc]));
+      exit(1);
+    }
+  }
+
+  FILE *out = fopen(argv[2], "w");
+  if (out == NULL) {
+    perror(argv[2]);
+    exit(1);
+  }
+  emitProgram(out, data, datasize, maxCycles);
+  fclose(out);
+
+  free(rom);
+  return 0;
+}
@@ -0,0 +1,86 @@
+// emurjtrace decodes a binary trace recorded with emurj -record back into the
+// same text as emurj's trace, given the ROM it was recorded from:
+//
+//   emurj -record run.trace rom.bin && emurjtrace rom.bin run.trace
+//
+// Each keyframe in the trace is shown with the cycle count at that point, so
+// it's easy to find where in a long run the trace starts.
+#include "cpu.h"
+#include "image.h"
+#include "trace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// setState copies the replayed state into the CPU, for formatting the trace.
+static void setState(CPU *cpu, const TraceReader *reader, uint16_t pc) {
+  memcpy(cpu->reg, reader->state.reg, sizeof(cpu->reg));
+  cpu->pc = pc;
+  cpu->imm = reader->state.imm;
+  cpu->skip = reader->skip;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc != 3) {
+    printf("Usage: %s <rom file> <trace file>\n", argv[0]);
+    exit(1);
+  }
+
+  Image image;
+  if (!imageOpen(&image, argv[1])) {
+    fprintf(stderr, "Unable to read %s\n", argv[1]);
+    exit(1);
+  }
+  // only the code is needed, the data is in the trace's register values
+  const uint16_t *code = NULL;
+  int codeLength = 0;
+  for (int i = 0; i < image.numSections; i++) {
+    if (image.sections[i].kind == IMAGE_CODE) {
+      code = imageWords(&image, &image.sections[i]);
+      codeLength = image.sections[i].length;
+    }
+  }
+  Program *prog = programCreate(code, codeLength);
+  imageClose(&image);
+
+  TraceReader *reader = malloc(sizeof(TraceReader));
+  if (prog == NULL || reader == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  if (!traceReaderOpen(reader, argv[2])) {
+    fprintf(stderr, "%s: not a trace file\n", argv[2]);
+    exit(1);
+  }
+
+  CPU cpu;
+  cpuInit(&cpu, false);
+  char buf[256];
+  TraceRecord record;
+  while (traceRead(reader, &record)) {
+    if (record.flags & TRACE_KEY) {
+      traceApply(reader, NULL, &record);
+      printf("-- cycle %llu\n", (unsigned long long)record.key.cycles);
+      continue;
+    }
+
+    Inst ir = traceInst(reader, prog->inst, &record);
+    setState(&cpu, reader, record.pc);
+    printf("%04x: %s\n", record.pc, preTrace(buf, sizeof(buf), &cpu, ir));
+    traceApply(reader, &ir, &record);
+
+    // halt and error end the run before their results are traced
+    if (ir.op != HALT && ir.op != ERROR) {
+      setState(&cpu, reader, reader->state.pc);
+      printf("  %s\n", postTrace(buf, sizeof(buf), &cpu, ir));
+    }
+  }
+
+  traceReaderClose(reader);
+  free(reader);
+  programRelease(prog);
+  return 0;
+}
@@ -0,0 +1,106 @@
+#include "event.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void eventQueueInit(EventQueue *queue) {
+  memset(queue, 0, sizeof(EventQueue));
+}
+
+void eventQueueClear(EventQueue *queue) { queue->count = 0; }
+
+void eventQueueDestroy(EventQueue *queue) {
+  free(queue->heap);
+  eventQueueInit(queue);
+}
+
+static bool eventBefore(const Event *a, const Event *b) {
+  return a->cycle != b->cycle ? a->cycle < b->cycle : a->seq < b->seq;
+}
+
+// siftUp moves the event at i up the heap to where it belongs.
+static void siftUp(EventQueue *queue, int i) {
+  Event *heap = queue->heap;
+  Event event = heap[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!eventBefore(&event, &heap[parent])) {
+      break;
+    }
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = event;
+}
+
+// siftDown moves the event at i down the heap to where it belongs.
+static void siftDown(EventQueue *queue, int i) {
+  Event *heap = queue->heap;
+  Event event = heap[i];
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= queue->count) {
+      break;
+    }
+    if (child + 1 < queue->count &&
+        eventBefore(&heap[child + 1], &heap[child])) {
+      child++;
+    }
+    if (!eventBefore(&heap[child], &event)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = event;
+}
+
+bool eventSchedule(EventQueue *queue, uint64_t cycle, EventHandler handler,
+                   void *context) {
+  if (queue->count == queue->cap) {
+    int cap = queue->cap ? queue->cap * 2 : 16;
+    Event *heap = realloc(queue->heap, cap * sizeof(Event));
+    if (heap == NULL) {
+      return false;
+    }
+    queue->heap = heap;
+    queue->cap = cap;
+  }
+  queue->heap[queue->count] = (Event){
+      .cycle = cycle,
+      .seq = queue->seq++,
+      .handler = handler,
+      .context = context,
+  };
+  siftUp(queue, queue->count++);
+  return true;
+}
+
+void eventCancel(EventQueue *queue, EventHandler handler, void *context) {
+  int count = 0;
+  for (int i = 0; i < queue->count; i++) {
+    const Event *event = &queue->heap[i];
+    if (event->handler != handler || event->context != context) {
+      queue->heap[count++] = *event;
+    }
+  }
+  queue->count = count;
+  for (int i = count / 2 - 1; i >= 0; i--) {
+    siftDown(queue, i);
+  }
+}
+
+uint64_t eventRunDue(EventQueue *queue, uint64_t cycles) {
+  while (queue->count > 0 && queue->heap[0].cycle <= cycles) {
+    // take the event off the heap before calling it, so it can schedule more
+    Event event = queue->heap[0];
+    queue->heap[0] = queue->heap[--queue->count];
+    if (queue->count > 0) {
+      siftDown(queue, 0);
+    }
+    event.handler(event.context, event.cycle);
+  }
+  return eventNext(queue);
+}
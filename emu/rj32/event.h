@@ -0,0 +1,61 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// EventHandler is called when an event is due, with the cycle count it was
+// scheduled for. It can schedule more events, such as the next tick of a
+// periodic timer, but they have to be for a later cycle.
+typedef void (*EventHandler)(void *context, uint64_t cycle);
+
+// Event is a call to handler at a cycle count. seq breaks ties between
+// events at the same cycle, so they run in the order they were scheduled.
+typedef struct Event {
+  uint64_t cycle;
+  uint64_t seq;
+  EventHandler handler;
+  void *context;
+} Event;
+
+// EventQueue is a min-heap of events ordered by cycle count, for devices
+// that need to do something at a point in time, like a timer or a serial
+// port that sends at a fixed rate. When a CPU has an event queue, cpuRun
+// runs the regular loop up to the next event, runs the events that are due,
+// and carries on, so devices don't have to be polled and the loop itself has
+// no checks for them.
+typedef struct EventQueue {
+  Event *heap;
+  int count;
+  int cap;
+  uint64_t seq;
+} EventQueue;
+
+// eventQueueInit initializes an empty event queue.
+void eventQueueInit(EventQueue *queue);
+
+// eventQueueClear removes all the events from the queue.
+void eventQueueClear(EventQueue *queue);
+
+// eventQueueDestroy frees the queue's events.
+void eventQueueDestroy(EventQueue *queue);
+
+// eventSchedule adds an event that calls handler at the given cycle count.
+// Returns false if out of memory.
+bool eventSchedule(EventQueue *queue, uint64_t cycle, EventHandler handler,
+                   void *context);
+
+// eventCancel removes every event with the given handler and context.
+void eventCancel(EventQueue *queue, EventHandler handler, void *context);
+
+// eventNext returns the cycle count of the next event, or UINT64_MAX if
+// there aren't any.
+static inline uint64_t eventNext(const EventQueue *queue) {
+  return queue->count > 0 ? queue->heap[0].cycle : UINT64_MAX;
+}
+
+// eventRunDue runs the events due at or before the given cycle count, in
+// order, and returns the cycle count of the next one like eventNext.
+uint64_t eventRunDue(EventQueue *queue, uint64_t cycles);
+
+#endif
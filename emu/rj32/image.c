@@ -0,0 +1,203 @@
+// needed for mmap and fstat when compiling with -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include "image.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the structs are the file format, so they can't have any padding
+_Static_assert(sizeof(ImageHeader) == 24, "ImageHeader is 24 bytes");
+_Static_assert(sizeof(ImageSection) == 12, "ImageSection is 12 bytes");
+_Static_assert(sizeof(ImageSymbol) == 32, "ImageSymbol is 32 bytes");
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t length) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+// imageCheck checks the header, sections and symbols of a mapped image, and
+// points the image at them. It doesn't read the sections' words, so it only
+// touches the start of the file.
+static bool imageCheck(Image *image) {
+  const ImageHeader *header = (const ImageHeader *)image->map;
+  size_t tables = sizeof(ImageHeader) +
+                  (size_t)header->numSections * sizeof(ImageSection) +
+                  (size_t)header->numSymbols * sizeof(ImageSymbol);
+  if (tables > image->size) {
+    return false;
+  }
+  image->entry = header->entry;
+  image->sections = (const ImageSection *)(header + 1);
+  image->numSections = header->numSections;
+  image->symbols = (const ImageSymbol *)(image->sections + header->numSections);
+  image->numSymbols = header->numSymbols;
+
+  bool hasCode = false;
+  for (int i = 0; i < image->numSections; i++) {
+    const ImageSection *section = &image->sections[i];
+    if (section->offset % 8 != 0 || section->offset < tables ||
+        section->offset > image->size ||
+        section->length > (image->size - section->offset) / 2 ||
+        section->address + section->length > 0x10000) {
+      return false;
+    }
+    if (section->kind == IMAGE_CODE) {
+      if (hasCode || section->address != 0) {
+        return false;
+      }
+      hasCode = true;
+    } else if (section->kind != IMAGE_DATA) {
+      return false;
+    }
+  }
+  for (int i = 0; i < image->numSymbols; i++) {
+    if (memchr(image->symbols[i].name, 0, IMAGE_SYMBOL_NAME) == NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool imageOpen(Image *image, const char *filename) {
+  memset(image, 0, sizeof(Image));
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  image->size = st.st_size;
+  if (image->size > 0) {
+    void *map = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    image->map = map;
+  }
+  close(fd);
+
+  if (image->size >= sizeof(ImageHeader) &&
+      memcmp(image->map, IMAGE_MAGIC, 8) == 0) {
+    if (!imageCheck(image)) {
+      imageClose(image);
+      return false;
+    }
+    return true;
+  }
+
+  // a raw ROM, which could also be an empty program
+  size_t words = image->size / 2;
+  image->raw[0] = (ImageSection){
+      .kind = IMAGE_CODE,
+      .length = words < IMAGE_RAW_CODE_SIZE ? words : IMAGE_RAW_CODE_SIZE,
+  };
+  image->numSections = 1;
+  if (words > IMAGE_RAW_CODE_SIZE) {
+    words -= IMAGE_RAW_CODE_SIZE;
+    image->raw[1] = (ImageSection){
+        .kind = IMAGE_DATA,
+        .length = words < 0x10000 ? words : 0x10000,
+        .offset = IMAGE_RAW_CODE_SIZE * 2,
+    };
+    image->numSections = 2;
+  }
+  image->sections = image->raw;
+  return true;
+}
+
+bool imageVerify(const Image *image) {
+  if (image->sections == image->raw) {
+    return true;
+  }
+  const ImageHeader *header = (const ImageHeader *)image->map;
+  return fnv1a(FNV_OFFSET, image->map + sizeof(ImageHeader),
+               image->size - sizeof(ImageHeader)) == header->checksum;
+}
+
+void imageClose(Image *image) {
+  if (image->map != NULL) {
+    munmap((void *)image->map, image->size);
+  }
+  memset(image, 0, sizeof(Image));
+}
+
+const ImageSymbol *imageFindSymbol(const Image *image, const char *name) {
+  for (int i = 0; i < image->numSymbols; i++) {
+    if (strcmp(image->symbols[i].name, name) == 0) {
+      return &image->symbols[i];
+    }
+  }
+  return NULL;
+}
+
+// writeHashed writes the bytes to the file, adding them to the hash.
+static bool writeHashed(FILE *f, uint32_t *hash, const void *data,
+                        size_t length) {
+  if (length == 0) {
+    return true;
+  }
+  *hash = fnv1a(*hash, data, length);
+  return fwrite(data, 1, length, f) == length;
+}
+
+bool imageWrite(const char *filename, uint16_t entry, ImageSection *sections,
+                const uint16_t *const *contents, int numSections,
+                const ImageSymbol *symbols, int numSymbols) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    return false;
+  }
+
+  size_t offset = sizeof(ImageHeader) + numSections * sizeof(ImageSection) +
+                  numSymbols * sizeof(ImageSymbol);
+  size_t tables = offset;
+  for (int i = 0; i < numSections; i++) {
+    offset = (offset + 7) & ~(size_t)7;
+    sections[i].offset = offset;
+    offset += sections[i].length * sizeof(uint16_t);
+  }
+
+  // the header is written again at the end, once the checksum is known
+  ImageHeader header = {
+      .entry = entry,
+      .numSections = numSections,
+      .numSymbols = numSymbols,
+  };
+  memcpy(header.magic, IMAGE_MAGIC, 8);
+  uint32_t hash = FNV_OFFSET;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            writeHashed(f, &hash, sections,
+                        numSections * sizeof(ImageSection)) &&
+            writeHashed(f, &hash, symbols, numSymbols * sizeof(ImageSymbol));
+
+  static const uint8_t padding[8] = {0};
+  offset = tables;
+  for (int i = 0; ok && i < numSections; i++) {
+    ok = writeHashed(f, &hash, padding, sections[i].offset - offset) &&
+         writeHashed(f, &hash, contents[i],
+                     sections[i].length * sizeof(uint16_t));
+    offset = sections[i].offset + sections[i].length * sizeof(uint16_t);
+  }
+
+  header.checksum = hash;
+  ok = ok && fseek(f, 0, SEEK_SET) == 0 &&
+       fwrite(&header, sizeof(header), 1, f) == 1;
+  return fclose(f) == 0 && ok;
+}
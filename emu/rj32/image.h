@@ -0,0 +1,122 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An image is a ROM file with a header, made to be mapped into memory and
+// used where it is instead of being read into a buffer, so a large data image
+// loads straight away, and every process running it shares the one copy in
+// the page cache. The file is:
+//
+//   - an ImageHeader
+//   - numSections ImageSections, saying where each section's words are in the
+//     file and where they're loaded
+//   - numSymbols ImageSymbols
+//   - the sections' words, each section starting on an 8 byte boundary
+//
+// All of it is little endian, and the structs are used in place, so images
+// can only be loaded on little endian hosts, like the snapshot files.
+#define IMAGE_MAGIC "rj32img1"
+
+// the kinds of section. There can be at most one code section, which is the
+// program memory from address 0, and any number of data sections.
+enum {
+  IMAGE_CODE = 1,
+  IMAGE_DATA = 2,
+};
+
+// a raw ROM, which is what the assembler writes, is the program memory,
+// optionally followed by data memory after this many words
+#define IMAGE_RAW_CODE_SIZE 0x10000
+
+// the address the data bank starts at in the cpudef, where gosie -o loads the
+// data after the program memory in an assembled ROM. A raw ROM is still
+// loaded the way emurj always has, with its data at address 0, the same as
+// runRj32Emu's dataMem, emurj2c and the lockstep engine, so the two layouts
+// differ: a program whose data is in the cpudef's data bank needs an image,
+// and one that expects its data at 0 has to stay a raw ROM.
+#define IMAGE_DATA_ADDRESS 0x8000
+
+typedef struct ImageHeader {
+  char magic[8];
+  // FNV-1a hash of everything in the file after the header
+  uint32_t checksum;
+  // the address the CPU starts running at
+  uint16_t entry;
+  uint16_t numSections;
+  uint32_t numSymbols;
+  uint32_t reserved;
+} ImageHeader;
+
+typedef struct ImageSection {
+  uint16_t kind;
+  // word address the section is loaded at
+  uint16_t address;
+  // length in words
+  uint32_t length;
+  // byte offset of the words in the file
+  uint32_t offset;
+} ImageSection;
+
+// the longest a symbol's name can be, including the terminating 0
+#define IMAGE_SYMBOL_NAME 28
+
+typedef struct ImageSymbol {
+  // the section kind the address is in, so code and data labels can be told
+  // apart
+  uint16_t kind;
+  uint16_t address;
+  char name[IMAGE_SYMBOL_NAME];
+} ImageSymbol;
+
+// Image is a mapped image file. A raw ROM can be opened as well, in which
+// case its sections are made up from the old layout: the code is the first
+// IMAGE_RAW_CODE_SIZE words and the data is the rest, loaded at address 0
+// rather than IMAGE_DATA_ADDRESS.
+typedef struct Image {
+  // the file's mapping
+  const uint8_t *map;
+  size_t size;
+
+  uint16_t entry;
+  const ImageSection *sections;
+  int numSections;
+  const ImageSymbol *symbols;
+  int numSymbols;
+
+  // the sections of a raw ROM
+  ImageSection raw[2];
+} Image;
+
+// imageOpen maps an image or raw ROM file. An image's header, sections and
+// symbols are checked, but not its checksum, which would mean reading the
+// whole file. Returns false if the file can't be mapped or is a malformed
+// image.
+bool imageOpen(Image *image, const char *filename);
+
+// imageVerify checks an open image's checksum against everything in the
+// file. A raw ROM has no checksum, so it always passes.
+bool imageVerify(const Image *image);
+
+// imageClose unmaps the file.
+void imageClose(Image *image);
+
+// imageWords returns the words of a section.
+static inline const uint16_t *imageWords(const Image *image,
+                                         const ImageSection *section) {
+  return (const uint16_t *)(image->map + section->offset);
+}
+
+// imageFindSymbol looks up a symbol by name. Returns NULL if there isn't one.
+const ImageSymbol *imageFindSymbol(const Image *image, const char *name);
+
+// imageWrite writes an image file with the given sections, where contents
+// holds each section's words, and the offsets of the sections are filled in.
+// symbols can be NULL if there aren't any. Returns false on error.
+bool imageWrite(const char *filename, uint16_t entry, ImageSection *sections,
+                const uint16_t *const *contents, int numSections,
+                const ImageSymbol *symbols, int numSymbols);
+
+#endif
@@ -1,5 +1,7 @@
 #include "inst.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 const char *OPCODE_NAMES[] = {
@@ -45,53 +47,194 @@ Inst decode(RawInst inst) {
     return (Inst){
         .fmt = fmt,
         .op = inst.rr.op,
+        .len = 1,
         .rd = inst.rr.rd,
         .rs = inst.rr.rs,
+        .skip = 1,
         .imm = 0,
     };
   case FMT_LS:
     return (Inst){
         .fmt = fmt,
         .op = inst.ls.op | 0b01100,
+        .len = 1,
         .rd = inst.ls.rd,
         .rs = inst.ls.rs,
+        .skip = 1,
         .imm = inst.ls.imm,
     };
   case FMT_RI6:
     return (Inst){
         .fmt = fmt,
         .op = inst.ri6.op | 0b10000,
+        .len = 1,
         .rd = inst.ri6.rd,
         .rs = 0,
+        .skip = 1,
         .imm = signExtend(inst.ri6.imm, 6),
     };
   case FMT_RI8:
     return (Inst){
         .fmt = fmt,
         .op = inst.ri8.op | 0b00110,
+        .len = 1,
         .rd = inst.ri8.rd,
         .rs = 0,
+        .skip = 1,
         .imm = signExtend(inst.ri8.imm, 8),
     };
   case FMT_I11:
     return (Inst){
         .fmt = fmt,
         .op = inst.i11.op | 0b01000,
+        .len = 1,
         .rd = 0,
         .rs = 0,
+        .skip = 1,
         .imm = signExtend(inst.i11.imm, 11),
     };
   case FMT_I12:
     return (Inst){
         .fmt = fmt,
         .op = IMM,
+        .len = 1,
         .rd = 0,
         .rs = 0,
+        .skip = 1,
         .imm = signExtend(inst.i12.imm, 12),
     };
   }
   // unreachable
-  return (Inst){.fmt = fmt, .op = 0, .rd = 0, .rs = 0, .imm = 0};
+  return (Inst){.fmt = fmt, .op = 0, .len = 1, .skip = 1};
+}
+
+Inst instPrefix(Inst ir, uint16_t prefix) {
+  if (ir.len > 1) {
+    // the low bits of the folded imm instruction are in bits 4-7
+    uint16_t inner = prefix | ((ir.imm >> 4) & 0b1111);
+    ir.imm = (uint16_t)(inner << 4) | (ir.imm & 0b1111);
+  } else {
+    ir.imm = prefix | (ir.imm & 0b1111);
+  }
+  ir.idle = 0;
+  return ir;
+}
+
+// the longest loop body, in words, that's checked for being idle
+#define IDLE_LOOP_WORDS 16
+
+// the carry flag's bit in the register sets of idleLoop
+#define IDLE_CARRY (1u << 16)
+
+// idleLoop returns whether the jump at i closes an idle loop. Its body, from
+// the jump's target up to the jump, has to run straight through, with only
+// moves, loads and ALU ops, and at most one if.*, right before the jump, to
+// leave the loop. None of the registers it reads before writing can be
+// written by it, so after the first time around, each time around does the
+// same thing again. Without stores, only a device event can change what it
+// loads, and events only happen between runs, so the run loop can skip
+// straight to the end of the run, unless one of the loads went to a device,
+// which the run loop checks for.
+static bool idleLoop(const Inst *prog, int i) {
+  int target = (uint16_t)(i + prog[i].len + prog[i].imm);
+  if (target > i || i - target > IDLE_LOOP_WORDS) {
+    return false;
+  }
+  uint32_t inputs = 0;
+  uint32_t written = 0;
+  int pc = target;
+  while (pc < i) {
+    const Inst *ir = &prog[pc];
+    uint32_t rd = 1u << ir->rd;
+    uint32_t rs = ir->fmt == FMT_RR || ir->fmt == FMT_LS ? 1u << ir->rs : 0;
+    uint32_t reads = 0;
+    uint32_t writes = 0;
+    switch (ir->op) {
+    case NOP:
+      break;
+    case MOVE:
+    case LOADC:
+    case LOAD:
+    case LOADB:
+      reads = rs;
+      writes = rd;
+      break;
+    case ADD:
+    case SUB:
+      reads = rd | rs;
+      writes = rd | IDLE_CARRY;
+      break;
+    case ADDC:
+    case SUBC:
+      reads = rd | rs | IDLE_CARRY;
+      writes = rd | IDLE_CARRY;
+      break;
+    case XOR:
+    case AND:
+    case OR:
+    case SHL:
+    case SHR:
+    case ASR:
+      reads = rd | rs;
+      writes = rd;
+      break;
+    case IFEQ:
+    case IFNE:
+    case IFLT:
+    case IFGE:
+    case IFULT:
+    case IFUGE:
+      if (pc + ir->len != i) {
+        return false;
+      }
+      reads = rd | rs;
+      break;
+    default:
+      return false;
+    }
+    inputs |= reads & ~written;
+    written |= writes;
+    pc += ir->len;
+  }
+  return pc == i && (inputs & written) == 0;
+}
+
+void decodeProgram(Inst *prog, const uint16_t *words, int length) {
+  const Inst *table = decodeTable();
+#define WORD(i) ((((i)&0xffff) < length) ? words[(i)&0xffff] : 0)
+  for (int i = 0; i < length; i++) {
+    Inst ir = table[words[i]];
+    Inst next = table[WORD(i + 1)];
+    if (ir.op == IMM && next.op != IMM) {
+      ir = instPrefix(next, (uint16_t)(ir.imm << 4));
+      ir.len = 2;
+    }
+    if (ir.op >= IFEQ) {
+      // a failed if skips the next instruction along with its imm prefix
+      ir.skip = table[WORD(i + ir.len)].op == IMM ? 2 : 1;
+    }
+    prog[i] = ir;
+  }
+#undef WORD
+  for (int i = 0; i < length; i++) {
+    if (prog[i].op == JUMP && prog[i].fmt != FMT_RR) {
+      prog[i].idle = idleLoop(prog, i);
+    }
+  }
+}
+
+static Inst DECODE_TABLE[65536];
+static pthread_once_t decodeTableOnce = PTHREAD_ONCE_INIT;
+
+static void decodeTableInit(void) {
+  for (int i = 0; i < 65536; i++) {
+    DECODE_TABLE[i] = decode((RawInst){.raw = i});
+  }
+}
+
+const Inst *decodeTable(void) {
+  pthread_once(&decodeTableOnce, decodeTableInit);
+  return DECODE_TABLE;
 }
 
 uint16_t signExtend(uint16_t imm, uint8_t bits) {
@@ -99,8 +242,9 @@ uint16_t signExtend(uint16_t imm, uint8_t bits) {
   return (imm ^ m) - m;
 }
 
+// the ABI names of the registers, the same as the cpudef
 const char *REG_NAMES[] = {"ra", "a0", "a1", "a2", "s0", "s1", "s2", "s3",
-                           "t0", "t1", "t2", "t3", "gp", "bp", "sp"};
+                           "t0", "t1", "t2", "t3", "t4", "t5", "gp", "sp"};
 
 const char *regString(int reg) { return REG_NAMES[reg]; }
 
@@ -117,25 +261,22 @@ char *instString(char *buf, int sz, Inst ir) {
 
   case FMT_I11: // fallthrough
   case FMT_I12:
-    snprintf(buf, sz, "%-5s %d", OpcodeString(ir.op),
-             (int16_t)signExtend(ir.imm, 13));
+    snprintf(buf, sz, "%-5s %d", OpcodeString(ir.op), (int16_t)ir.imm);
     break;
 
   case FMT_RI6:
   case FMT_RI8:
     snprintf(buf, sz, "%-5s %s, %d", OpcodeString(ir.op), regString(ir.rd),
-             (int16_t)signExtend(ir.imm, 13));
+             (int16_t)ir.imm);
     break;
 
   case FMT_LS:
     if (ir.op == LOAD || ir.op == LOADB) {
       snprintf(buf, sz, "%-5s %s, [%s, %d]", OpcodeString(ir.op),
-               regString(ir.rd), regString(ir.rs),
-               (int16_t)signExtend(ir.imm, 13));
+               regString(ir.rd), regString(ir.rs), (int16_t)ir.imm);
     } else { // STORE
       snprintf(buf, sz, "%-5s [%s, %d], %s", OpcodeString(ir.op),
-               regString(ir.rs), (int16_t)signExtend(ir.imm, 13),
-               regString(ir.rd));
+               regString(ir.rs), (int16_t)ir.imm, regString(ir.rd));
     }
     break;
   }
@@ -98,13 +98,24 @@ typedef struct RawInst {
   };
 } RawInst;
 
-// Inst is a decoded instruction.
+// Inst is a decoded instruction. The immediate is fully decoded into the
+// 16 bit value the instruction operates on. An imm prefix can be folded into
+// the instruction following it, in which case len is 2 and imm includes the
+// prefix.
 typedef struct Inst {
-  uint16_t fmt : 4;
-  uint16_t op : 5;
-  uint16_t rd : 4;
-  uint16_t rs : 4;
-  uint16_t imm : 13;
+  uint8_t op;
+  // number of instruction words, including any folded imm prefix
+  uint8_t len : 4;
+  // for direct jumps, set by decodeProgram if the jump closes an idle loop:
+  // one that does the same thing each time around until a device event
+  // changes memory, so the run loop can skip ahead to the next event
+  uint8_t idle : 1;
+  uint8_t rd : 4;
+  uint8_t rs : 4;
+  uint8_t fmt : 4;
+  // for if.* instructions, the number of words to skip if the condition fails
+  uint8_t skip : 4;
+  uint16_t imm;
 } Inst;
 
 // signExtend returns the sign-extended value by copying the value of the
@@ -114,6 +125,27 @@ uint16_t signExtend(uint16_t imm, uint8_t bits);
 // decode returns the decoded instruction.
 Inst decode(RawInst inst);
 
+// instPrefix returns the instruction with an imm prefix folded into its
+// immediate, where prefix is the value of the imm instruction already shifted
+// left by 4. If the instruction already has a prefix folded in, the new prefix
+// applies to that one instead, the same as a chain of imm instructions. The
+// length of the instruction is left alone, and since the immediate changes,
+// a jump is no longer marked idle.
+Inst instPrefix(Inst ir, uint16_t prefix);
+
+// decodeProgram decodes the first `length` words of program memory into prog.
+// Every imm instruction followed by a non-imm instruction is folded into it,
+// producing a single instruction of length 2 with the wide immediate, while
+// the following word is still decoded on its own in case something jumps to
+// it. Words past the end of the program are treated as zero (nop). Jumps
+// closing idle loops are marked last, once every instruction is decoded.
+void decodeProgram(Inst *prog, const uint16_t *words, int length);
+
+// decodeTable returns a table of every possible 16 bit instruction word,
+// pre-decoded and indexed by the raw instruction. It's computed on first use
+// and is safe to call from multiple threads.
+const Inst *decodeTable(void);
+
 // regString returns the string name of the given register.
 const char *regString(int reg);
 
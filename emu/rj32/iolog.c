@@ -0,0 +1,306 @@
+#include "iolog.h"
+#include "bus.h"
+#include "cpu.h"
+#include "event.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IOLOG_MAGIC "rj32iol1"
+
+// the kinds of entry, in the low bits of the varint each one starts with
+enum {
+  IOLOG_READ,
+  IOLOG_WRITE,
+  IOLOG_EVENTS,
+};
+
+// IOLogEntry is a decoded entry.
+typedef struct IOLogEntry {
+  int kind;
+  uint64_t cycle;
+  uint16_t address;
+  uint16_t value;
+} IOLogEntry;
+
+void ioLogInit(IOLog *log) { memset(log, 0, sizeof(IOLog)); }
+
+void ioLogDestroy(IOLog *log) {
+  ioLogStop(log);
+  free(log->data);
+  memset(log, 0, sizeof(IOLog));
+}
+
+// ioLogPut appends bytes to the log, growing it as needed.
+static void ioLogPut(IOLog *log, const uint8_t *bytes, size_t length) {
+  if (log->length + length > log->cap) {
+    size_t cap = log->cap ? log->cap * 2 : 4096;
+    uint8_t *data = realloc(log->data, cap);
+    if (data == NULL) {
+      log->failed = true;
+      return;
+    }
+    log->data = data;
+    log->cap = cap;
+  }
+  memcpy(log->data + log->length, bytes, length);
+  log->length += length;
+}
+
+// ioLogAppend appends an entry at cpu->cycles.
+static void ioLogAppend(IOLog *log, int kind, uint16_t address,
+                        uint16_t value) {
+  uint8_t bytes[16];
+  int n = 0;
+  uint64_t header = (log->cpu->cycles - log->last) << 2 | kind;
+  log->last = log->cpu->cycles;
+  do {
+    bytes[n++] = (header & 0x7f) | (header > 0x7f ? 0x80 : 0);
+    header >>= 7;
+  } while (header != 0);
+  if (kind == IOLOG_EVENTS) {
+    bytes[n++] = value;
+  } else {
+    bytes[n++] = address;
+    bytes[n++] = address >> 8;
+    bytes[n++] = value;
+    bytes[n++] = value >> 8;
+  }
+  ioLogPut(log, bytes, n);
+}
+
+// ioLogNext decodes the next entry of the given kind at or after *pos, where
+// the entry before *pos is at *cycle, and moves them past it. Events are
+// found along with the writes they made. Returns false at the end of the
+// log, or if the entry is cut off.
+static bool ioLogNext(const IOLog *log, size_t *pos, uint64_t *cycle,
+                      bool events, IOLogEntry *entry) {
+  size_t p = *pos;
+  uint64_t c = *cycle;
+  while (p < log->length) {
+    uint64_t header = 0;
+    for (int shift = 0; p < log->length && shift < 64; shift += 7) {
+      uint8_t byte = log->data[p++];
+      header |= (uint64_t)(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    entry->kind = header & 3;
+    entry->cycle = c += header >> 2;
+    if (entry->kind == IOLOG_EVENTS) {
+      if (p + 1 > log->length) {
+        return false;
+      }
+      entry->address = 0;
+      entry->value = log->data[p++];
+    } else {
+      if (p + 4 > log->length) {
+        return false;
+      }
+      entry->address = log->data[p] | log->data[p + 1] << 8;
+      entry->value = log->data[p + 2] | log->data[p + 3] << 8;
+      p += 4;
+    }
+    if ((entry->kind != IOLOG_READ) == events) {
+      *pos = p;
+      *cycle = c;
+      return true;
+    }
+  }
+  return false;
+}
+
+// ioLogRead is the IO bus's read hook, for a read as of cpu->cycles that
+// would go through the device handlers. When recording, it runs the bus
+// transaction and records the value, and when replaying, it returns the
+// recorded value without calling the device handlers.
+static uint16_t ioLogRead(void *context, IOBus *ioBus, uint16_t address) {
+  IOLog *log = context;
+  if (!log->replaying) {
+    ioBusTransaction(ioBus, address, 0, false);
+    if (!log->inEvents) {
+      ioLogAppend(log, IOLOG_READ, address, ioBus->bus.data);
+    }
+    return ioBus->bus.data;
+  }
+
+  IOLogEntry entry;
+  if (!ioLogNext(log, &log->readPos, &log->readCycle, false, &entry)) {
+    log->diverged = true;
+    return 0;
+  }
+  if (entry.address != address || entry.cycle != log->cpu->cycles) {
+    log->diverged = true;
+  }
+  return entry.value;
+}
+
+// ioLogWrite is the IO bus's write hook, which records the writes made by
+// events.
+static void ioLogWrite(void *context, uint16_t address, uint16_t data) {
+  IOLog *log = context;
+  if (log->inEvents) {
+    ioLogAppend(log, IOLOG_WRITE, address, data);
+  }
+}
+
+// ioLogAttach attaches the log to the CPU and its IO bus.
+static void ioLogAttach(IOLog *log, CPU *cpu, bool replaying) {
+  ioLogStop(log);
+  log->cpu = cpu;
+  log->replaying = replaying;
+  cpu->ioLog = log;
+  cpu->bus.readHook = ioLogRead;
+  cpu->bus.writeHook = ioLogWrite;
+  cpu->bus.hookContext = log;
+}
+
+void ioLogRecord(IOLog *log, CPU *cpu) {
+  ioLogAttach(log, cpu, false);
+  log->start = cpu->cycles;
+  log->last = cpu->cycles;
+  log->length = 0;
+  log->inEvents = false;
+  log->failed = false;
+}
+
+// ioLogSeek moves the cursor past the entries of the given kind before the
+// cycle count.
+static void ioLogSeek(const IOLog *log, size_t *pos, uint64_t *cycle,
+                      bool events, uint64_t before) {
+  size_t p = *pos;
+  uint64_t c = *cycle;
+  IOLogEntry entry;
+  while (ioLogNext(log, &p, &c, events, &entry) && entry.cycle < before) {
+    *pos = p;
+    *cycle = c;
+  }
+}
+
+bool ioLogReplay(IOLog *log, CPU *cpu) {
+  if (cpu->cycles < log->start) {
+    return false;
+  }
+  ioLogAttach(log, cpu, true);
+  log->readPos = 0;
+  log->readCycle = log->start;
+  log->eventPos = 0;
+  log->eventCycle = log->start;
+  log->diverged = false;
+
+  // a read is logged as of the end of its load, so the ones at the current
+  // cycle count have already happened, but events at it haven't run yet
+  ioLogSeek(log, &log->readPos, &log->readCycle, false, cpu->cycles + 1);
+  ioLogSeek(log, &log->eventPos, &log->eventCycle, true, cpu->cycles);
+  return true;
+}
+
+void ioLogStop(IOLog *log) {
+  CPU *cpu = log->cpu;
+  if (cpu != NULL && cpu->ioLog == log) {
+    cpu->ioLog = NULL;
+    cpu->bus.readHook = NULL;
+    cpu->bus.writeHook = NULL;
+    cpu->bus.hookContext = NULL;
+  }
+  log->cpu = NULL;
+}
+
+bool ioLogSave(const IOLog *log, const char *filename) {
+  if (log->failed) {
+    return false;
+  }
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    return false;
+  }
+  uint64_t length = log->length;
+  bool ok = fwrite(IOLOG_MAGIC, 8, 1, f) == 1 &&
+            fwrite(&log->start, sizeof(log->start), 1, f) == 1 &&
+            fwrite(&length, sizeof(length), 1, f) == 1 &&
+            (length == 0 || fwrite(log->data, length, 1, f) == 1);
+  return fclose(f) == 0 && ok;
+}
+
+bool ioLogLoad(IOLog *log, const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  char magic[8];
+  uint64_t start;
+  uint64_t length;
+  bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+            memcmp(magic, IOLOG_MAGIC, 8) == 0 &&
+            fread(&start, sizeof(start), 1, f) == 1 &&
+            fread(&length, sizeof(length), 1, f) == 1;
+  uint8_t *data = NULL;
+  if (ok && length > 0) {
+    data = malloc(length);
+    ok = data != NULL && fread(data, length, 1, f) == 1;
+  }
+  fclose(f);
+  if (!ok) {
+    free(data);
+    return false;
+  }
+
+  ioLogStop(log);
+  free(log->data);
+  ioLogInit(log);
+  log->start = start;
+  log->data = data;
+  log->length = length;
+  log->cap = length;
+  return true;
+}
+
+uint64_t ioLogService(IOLog *log) {
+  CPU *cpu = log->cpu;
+  if (!log->replaying) {
+    EventQueue *events = cpu->events;
+    if (events == NULL) {
+      return UINT64_MAX;
+    }
+    if (eventNext(events) <= cpu->cycles) {
+      // unmap every page for writes while the events run, so all their
+      // writes go through ioBusWriteSlow, which records them
+      uint16_t *writePages[IOBUS_NUM_PAGES];
+      memcpy(writePages, cpu->bus.writePages, sizeof(writePages));
+      memset(cpu->bus.writePages, 0, sizeof(writePages));
+      log->inEvents = true;
+      eventRunDue(events, cpu->cycles);
+      log->inEvents = false;
+      memcpy(cpu->bus.writePages, writePages, sizeof(writePages));
+      ioLogAppend(log, IOLOG_EVENTS, 0, cpu->irq);
+    }
+    return eventNext(events);
+  }
+
+  // replay the writes of each batch of events that's due, then whether it
+  // left an interrupt pending
+  size_t pos = log->eventPos;
+  uint64_t cycle = log->eventCycle;
+  IOLogEntry entry;
+  while (ioLogNext(log, &pos, &cycle, true, &entry) &&
+         entry.cycle <= cpu->cycles) {
+    if (entry.cycle != cpu->cycles) {
+      log->diverged = true;
+    }
+    if (entry.kind == IOLOG_WRITE) {
+      ioBusWrite(&cpu->bus, entry.address, entry.value);
+    } else {
+      cpu->irq = entry.value != 0;
+    }
+    log->eventPos = pos;
+    log->eventCycle = cycle;
+  }
+  pos = log->eventPos;
+  cycle = log->eventCycle;
+  return ioLogNext(log, &pos, &cycle, true, &entry) ? entry.cycle
+                                                     : UINT64_MAX;
+}
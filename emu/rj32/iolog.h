@@ -0,0 +1,105 @@
+#ifndef IOLOG_H
+#define IOLOG_H
+
+#include "bus.h"
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// IOLog is a record of everything that comes into a CPU from its devices, so
+// a run can be played back exactly without them. The CPU is deterministic
+// apart from what it reads from the device handlers and what device events
+// do, so those are all it has to record:
+//
+//   - the value of every read that goes through a device handler, rather
+//     than straight to memory
+//   - every batch of device events, with the writes the events made to the
+//     IO bus, and whether they left an interrupt pending
+//
+// Each entry has the cycle count it happened at. Entries are written one
+// after another, each starting with a varint of the number of cycles since
+// the last entry, shifted left by 2, with the kind of entry in the low bits.
+// Reads and writes follow it with their address and value, and events with
+// whether an interrupt is pending, so a busy device costs a few bytes per
+// access.
+//
+// A log can start at any cycle count, so a long run can be snapshotted part
+// way through, and recorded from there. Replaying restores the snapshot and
+// plays the log back from the same point, or restores any later snapshot of
+// the recorded run and picks up the log from there.
+//
+// The log hooks into the CPU's IO bus to see the reads and writes, which
+// need cpu->cycles to be up to date, so the JIT hands off to cpuRun while
+// there's a log.
+typedef struct IOLog {
+  CPU *cpu;
+  bool replaying;
+
+  // the cycle count the log starts at
+  uint64_t start;
+
+  // the encoded entries
+  uint8_t *data;
+  size_t length;
+  size_t cap;
+
+  // when recording, the cycle count of the last entry, whether the events
+  // are running, and whether an entry didn't fit in memory
+  uint64_t last;
+  bool inEvents;
+  bool failed;
+
+  // when replaying, where the next read and the next batch of events are,
+  // and the cycle count of the entry before each one
+  size_t readPos;
+  uint64_t readCycle;
+  size_t eventPos;
+  uint64_t eventCycle;
+
+  // set if the replay didn't match the log, because the CPU read from a
+  // different address or at a different cycle count than it was recorded,
+  // or ran past the end of the log
+  bool diverged;
+} IOLog;
+
+// ioLogInit initializes an empty log.
+void ioLogInit(IOLog *log);
+
+// ioLogDestroy stops the log if it's recording or replaying, and frees it.
+void ioLogDestroy(IOLog *log);
+
+// ioLogRecord clears the log and starts recording the CPU's device reads and
+// events from its current cycle count. The CPU needs an event queue for its
+// events to be recorded.
+void ioLogRecord(IOLog *log, CPU *cpu);
+
+// ioLogReplay starts playing the log back into the CPU, which has to have the
+// state it had at its current cycle count while the log was being recorded,
+// restored from a snapshot for example. The entries before then are skipped.
+// From then on, reads from device handlers return the values in the log, the
+// CPU's event queue isn't run, and the events' writes and interrupts are
+// replayed from the log instead. Writes to devices still go to them, so
+// output is the same as when recording. Returns false if the CPU is at a
+// cycle count before the log starts.
+bool ioLogReplay(IOLog *log, CPU *cpu);
+
+// ioLogStop stops recording or replaying, and detaches the log from the CPU.
+void ioLogStop(IOLog *log);
+
+// ioLogSave writes the log to a file. Returns false on error, or if the log
+// ran out of memory while recording.
+bool ioLogSave(const IOLog *log, const char *filename);
+
+// ioLogLoad reads a log written by ioLogSave, replacing what's in the log.
+// Returns false if the file can't be read or isn't a log.
+bool ioLogLoad(IOLog *log, const char *filename);
+
+// ioLogService is called by cpuService in place of running the CPU's events.
+// When recording, it runs the events that are due, recording what they do,
+// and when replaying, it replays the recorded events that are due. Returns
+// the cycle count of the next event, like eventRunDue.
+uint64_t ioLogService(IOLog *log);
+
+#endif
@@ -0,0 +1,724 @@
+// needed for MAP_ANONYMOUS when compiling with -std=c11
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include "cpu.h"
+#include "inst.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// size of the buffer for compiled code. When it fills up, all the compiled
+// code is thrown away and compiling starts over. It's never writable and
+// executable at the same time: it's executable except while a block is
+// being written, and only the pages the block goes in are made writable.
+#define JIT_CODE_SIZE (16 << 20)
+
+// the most instructions compiled into one block, and the most bytes of native
+// code one instruction can compile to
+#define JIT_MAX_BLOCK 64
+#define JIT_MAX_INST_BYTES 64
+
+// x86 registers used by the compiled code. rbx holds the CPU pointer, r12 the
+// remaining cycle budget, and r13 the table of compiled blocks.
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+
+// offset of an rj32 register in the CPU struct
+#define REG(r) ((int32_t)(offsetof(CPU, reg) + 2 * (r)))
+
+// JitEnter is the entry point into the compiled code. It runs blocks starting
+// from cpu->pc until it runs out of cycles, reaches a block that hasn't been
+// compiled yet, or the CPU halts. It updates cpu->pc, and returns what's left
+// of the cycle budget.
+typedef uint64_t (*JitEnter)(CPU *cpu, uint64_t budget, void *const *blocks);
+
+struct Jit {
+  // executable code buffer, and the number of bytes of it in use
+  uint8_t *code;
+  size_t used;
+  size_t pageSize;
+
+  // set if the system refused to change the protection of the code buffer,
+  // after which everything is run by the interpreter
+  bool failed;
+
+  // the entry, dispatch and exit stubs at the start of the code buffer, which
+  // are kept when the rest of the code is thrown away
+  size_t stubs;
+  JitEnter enter;
+  uint8_t *dispatch;
+  uint8_t *exit;
+
+  // native code of the block starting at each address, or NULL
+  void *blocks[65536];
+
+  // cycles needed to run the block starting at each address. It's 0 if the
+  // block hasn't been compiled yet, or -1 if its first instruction can't be
+  // compiled and has to be run by the interpreter.
+  int32_t need[65536];
+};
+
+static void emit8(Jit *jit, uint8_t b) { jit->code[jit->used++] = b; }
+
+static void emit16(Jit *jit, uint16_t v) {
+  emit8(jit, v);
+  emit8(jit, v >> 8);
+}
+
+static void emit32(Jit *jit, uint32_t v) {
+  emit16(jit, v);
+  emit16(jit, v >> 16);
+}
+
+static void emit64(Jit *jit, uint64_t v) {
+  emit32(jit, v);
+  emit32(jit, v >> 32);
+}
+
+// emitMem emits a ModRM byte addressing [rbx + disp] with the given reg field,
+// which is either a register or an opcode extension.
+static void emitMem(Jit *jit, int reg, int32_t disp) {
+  emit8(jit, 0x83 | (reg << 3));
+  emit32(jit, disp);
+}
+
+// emitLoadReg emits `movzx x86, word [rbx + REG(r)]`.
+static void emitLoadReg(Jit *jit, int x86, int r) {
+  emit8(jit, 0x0f);
+  emit8(jit, 0xb7);
+  emitMem(jit, x86, REG(r));
+}
+
+// emitStoreReg emits `mov word [rbx + REG(r)], x86`.
+static void emitStoreReg(Jit *jit, int x86, int r) {
+  emit8(jit, 0x66);
+  emit8(jit, 0x89);
+  emitMem(jit, x86, REG(r));
+}
+
+// emitRel32 emits a 32 bit offset from the end of the offset to target.
+static void emitRel32(Jit *jit, const uint8_t *target) {
+  emit32(jit, (uint32_t)(target - (jit->code + jit->used + 4)));
+}
+
+static void emitJmp(Jit *jit, const uint8_t *target) {
+  emit8(jit, 0xe9);
+  emitRel32(jit, target);
+}
+
+// emitCall emits a call to a C function.
+static void emitCall(Jit *jit, void *fn) {
+  // mov rax, fn
+  emit8(jit, 0x48);
+  emit8(jit, 0xb8);
+  emit64(jit, (uint64_t)(uintptr_t)fn);
+  // call rax
+  emit8(jit, 0xff);
+  emit8(jit, 0xd0);
+}
+
+// emitJumpTo ends a block by continuing at a known address. If the target is
+// already compiled, it's jumped to directly, otherwise it goes through the
+// dispatcher.
+static void emitJumpTo(Jit *jit, uint16_t target) {
+  if (jit->blocks[target] != NULL) {
+    emitJmp(jit, jit->blocks[target]);
+    return;
+  }
+  // mov eax, target
+  emit8(jit, 0xb8);
+  emit32(jit, target);
+  emitJmp(jit, jit->dispatch);
+}
+
+// emitJumpReg ends a block by continuing at the address in rj32 register r,
+// plus one.
+static void emitJumpReg(Jit *jit, int r) {
+  emitLoadReg(jit, RAX, r);
+  // inc eax; movzx eax, ax
+  emit8(jit, 0xff);
+  emit8(jit, 0xc0);
+  emit8(jit, 0x0f);
+  emit8(jit, 0xb7);
+  emit8(jit, 0xc0);
+  emitJmp(jit, jit->dispatch);
+}
+
+// emitAddress emits code to put the address of a load or store into esi.
+static void emitAddress(Jit *jit, const Inst *ir) {
+  emitLoadReg(jit, RSI, ir->rs);
+  if (ir->imm != 0) {
+    // add esi, imm; movzx esi, si
+    emit8(jit, 0x81);
+    emit8(jit, 0xc6);
+    emit32(jit, ir->imm);
+    emit8(jit, 0x0f);
+    emit8(jit, 0xb7);
+    emit8(jit, 0xf6);
+  }
+}
+
+// emitPageLookup emits code to look up the page of the address in esi in one
+// of the IO bus page tables, leaving the page pointer in rax, and a jz to the
+// slow path for when the page isn't mapped. Returns the offset of the jz's
+// displacement to be patched.
+static size_t emitPageLookup(Jit *jit, size_t pages) {
+  // mov eax, esi; shr eax, 8
+  emit8(jit, 0x89);
+  emit8(jit, 0xf0);
+  emit8(jit, 0xc1);
+  emit8(jit, 0xe8);
+  emit8(jit, IOBUS_PAGE_BITS);
+  // mov rax, [rbx + rax * 8 + pages]
+  emit8(jit, 0x48);
+  emit8(jit, 0x8b);
+  emit8(jit, 0x84);
+  emit8(jit, 0xc3);
+  emit32(jit, offsetof(CPU, bus) + pages);
+  // test rax, rax; jz slow
+  emit8(jit, 0x48);
+  emit8(jit, 0x85);
+  emit8(jit, 0xc0);
+  emit8(jit, 0x74);
+  emit8(jit, 0);
+  // and esi, page mask
+  emit8(jit, 0x81);
+  emit8(jit, 0xe6);
+  emit32(jit, IOBUS_PAGE_SIZE - 1);
+  return jit->used - 7;
+}
+
+// emitPatch8 patches an 8 bit jump displacement to jump to the current
+// position.
+static void emitPatch8(Jit *jit, size_t patch) {
+  jit->code[patch] = jit->used - (patch + 1);
+}
+
+static uint16_t jitLoad(CPU *cpu, uint16_t address) {
+  ioBusTransaction(&cpu->bus, address, 0, false);
+  return cpu->bus.bus.data;
+}
+
+static void jitStore(CPU *cpu, uint16_t address, uint16_t data) {
+  ioBusWriteSlow(&cpu->bus, address, data);
+}
+
+// emitLoad emits a load from memory if the page is mapped, otherwise a call
+// to jitLoad, with the result in eax.
+static void emitLoad(Jit *jit, const Inst *ir) {
+  emitAddress(jit, ir);
+  size_t slow = emitPageLookup(jit, offsetof(IOBus, readPages));
+  // movzx eax, word [rax + rsi * 2]; jmp done
+  emit8(jit, 0x0f);
+  emit8(jit, 0xb7);
+  emit8(jit, 0x04);
+  emit8(jit, 0x70);
+  emit8(jit, 0xeb);
+  size_t done = jit->used;
+  emit8(jit, 0);
+
+  emitPatch8(jit, slow);
+  // mov rdi, rbx
+  emit8(jit, 0x48);
+  emit8(jit, 0x89);
+  emit8(jit, 0xdf);
+  emitCall(jit, (void *)jitLoad);
+  emitPatch8(jit, done);
+}
+
+// emitStore emits a store to memory if the page is mapped, otherwise a call
+// to jitStore, with the data in edx.
+static void emitStore(Jit *jit, const Inst *ir) {
+  emitAddress(jit, ir);
+  emitLoadReg(jit, RDX, ir->rd);
+  size_t slow = emitPageLookup(jit, offsetof(IOBus, writePages));
+  // mov [rax + rsi * 2], dx; jmp done
+  emit8(jit, 0x66);
+  emit8(jit, 0x89);
+  emit8(jit, 0x14);
+  emit8(jit, 0x70);
+  emit8(jit, 0xeb);
+  size_t done = jit->used;
+  emit8(jit, 0);
+
+  emitPatch8(jit, slow);
+  // mov rdi, rbx
+  emit8(jit, 0x48);
+  emit8(jit, 0x89);
+  emit8(jit, 0xdf);
+  emitCall(jit, (void *)jitStore);
+  emitPatch8(jit, done);
+}
+
+// emitStubs emits the entry, dispatch and exit stubs at the start of the code
+// buffer.
+static void emitStubs(Jit *jit) {
+  jit->used = 0;
+  jit->enter = (JitEnter)(uintptr_t)jit->code;
+
+  // push rbx; push r12; push r13, which also aligns the stack for calls
+  emit8(jit, 0x53);
+  emit8(jit, 0x41);
+  emit8(jit, 0x54);
+  emit8(jit, 0x41);
+  emit8(jit, 0x55);
+  // mov rbx, rdi; mov r12, rsi; mov r13, rdx
+  emit8(jit, 0x48);
+  emit8(jit, 0x89);
+  emit8(jit, 0xfb);
+  emit8(jit, 0x49);
+  emit8(jit, 0x89);
+  emit8(jit, 0xf4);
+  emit8(jit, 0x49);
+  emit8(jit, 0x89);
+  emit8(jit, 0xd5);
+  // movzx eax, word [rbx + pc]
+  emit8(jit, 0x0f);
+  emit8(jit, 0xb7);
+  emitMem(jit, RAX, offsetof(CPU, pc));
+
+  // the dispatcher jumps to the block at the address in eax, if it's compiled
+  jit->dispatch = jit->code + jit->used;
+  // mov rcx, [r13 + rax * 8]
+  emit8(jit, 0x49);
+  emit8(jit, 0x8b);
+  emit8(jit, 0x4c);
+  emit8(jit, 0xc5);
+  emit8(jit, 0x00);
+  // test rcx, rcx; jz exit; jmp rcx
+  emit8(jit, 0x48);
+  emit8(jit, 0x85);
+  emit8(jit, 0xc9);
+  emit8(jit, 0x74);
+  emit8(jit, 0x02);
+  emit8(jit, 0xff);
+  emit8(jit, 0xe1);
+
+  // the exit stub saves the address in eax to the pc and returns the budget
+  jit->exit = jit->code + jit->used;
+  // mov word [rbx + pc], ax
+  emit8(jit, 0x66);
+  emit8(jit, 0x89);
+  emitMem(jit, RAX, offsetof(CPU, pc));
+  // mov rax, r12
+  emit8(jit, 0x4c);
+  emit8(jit, 0x89);
+  emit8(jit, 0xe0);
+  // pop r13; pop r12; pop rbx; ret
+  emit8(jit, 0x41);
+  emit8(jit, 0x5d);
+  emit8(jit, 0x41);
+  emit8(jit, 0x5c);
+  emit8(jit, 0x5b);
+  emit8(jit, 0xc3);
+
+  jit->stubs = jit->used;
+}
+
+// jitCanCompile returns whether the instruction can be compiled. Anything else
+// is left to the interpreter, including imm instructions that couldn't be
+// folded into the instruction after them.
+static bool jitCanCompile(const Inst *ir) {
+  switch (ir->op) {
+  case NOP:
+  case ERROR:
+  case HALT:
+  case RCSR:
+  case MOVE:
+  case JUMP:
+  case CALL:
+  case LOAD:
+  case STORE:
+  case ADD:
+  case SUB:
+  case ADDC:
+  case SUBC:
+  case XOR:
+  case AND:
+  case OR:
+  case SHL:
+  case SHR:
+  case ASR:
+  case IFEQ:
+  case IFNE:
+  case IFLT:
+  case IFGE:
+  case IFULT:
+  case IFUGE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// jitEndsBlock returns whether the instruction ends a block.
+static bool jitEndsBlock(const Inst *ir) {
+  return ir->op == ERROR || ir->op == HALT || ir->op == RCSR ||
+         ir->op == JUMP || ir->op == CALL || ir->op >= IFEQ;
+}
+
+// x86 opcodes for the ALU instructions, as {r/m16 op r16, /n for imm16}
+static const uint8_t aluOps[][2] = {
+    [ADD - ADD] = {0x01, 0},  [SUB - ADD] = {0x29, 5},
+    [ADDC - ADD] = {0x11, 2}, [SUBC - ADD] = {0x19, 3},
+    [XOR - ADD] = {0x31, 6},  [AND - ADD] = {0x21, 4},
+    [OR - ADD] = {0x09, 1},
+};
+
+// x86 /n opcode extensions for the shifts
+static const uint8_t shiftOps[] = {
+    [SHL - SHL] = 4,
+    [SHR - SHL] = 5,
+    [ASR - SHL] = 7,
+};
+
+// x86 condition codes for when each if.* instruction skips
+static const uint8_t skipConds[] = {
+    [IFEQ - IFEQ] = 0x5,  // ne
+    [IFNE - IFEQ] = 0x4,  // e
+    [IFLT - IFEQ] = 0xd,  // ge
+    [IFGE - IFEQ] = 0xc,  // l
+    [IFULT - IFEQ] = 0x3, // ae
+    [IFUGE - IFEQ] = 0x2, // b
+};
+
+// jitCompileInst compiles the instruction at pc.
+static void jitCompileInst(Jit *jit, const Inst *ir, uint16_t pc) {
+  uint16_t next = pc + ir->len;
+
+  switch (ir->op) {
+  case NOP:
+    break;
+
+  case HALT:
+  case ERROR:
+    // mov byte [rbx + halt/error], 1
+    emit8(jit, 0xc6);
+    emitMem(jit, 0,
+            ir->op == HALT ? offsetof(CPU, halt) : offsetof(CPU, error));
+    emit8(jit, 1);
+    // mov eax, pc
+    emit8(jit, 0xb8);
+    emit32(jit, pc);
+    emitJmp(jit, jit->exit);
+    break;
+
+  case RCSR:
+    // temporary jump instruction
+    emitJumpReg(jit, ir->rd);
+    break;
+
+  case MOVE:
+    if (ir->fmt == FMT_RR) {
+      emitLoadReg(jit, RCX, ir->rs);
+      emitStoreReg(jit, RCX, ir->rd);
+    } else {
+      // mov word [rbx + rd], imm
+      emit8(jit, 0x66);
+      emit8(jit, 0xc7);
+      emitMem(jit, 0, REG(ir->rd));
+      emit16(jit, ir->imm);
+    }
+    break;
+
+  case CALL:
+    // mov word [rbx + ra], return address
+    emit8(jit, 0x66);
+    emit8(jit, 0xc7);
+    emitMem(jit, 0, REG(0));
+    emit16(jit, next - 1);
+    // fall through
+
+  case JUMP:
+    if (ir->fmt == FMT_RR) {
+      emitJumpReg(jit, ir->rs);
+    } else {
+      emitJumpTo(jit, next + ir->imm);
+    }
+    break;
+
+  case LOAD:
+    emitLoad(jit, ir);
+    emitStoreReg(jit, RAX, ir->rd);
+    break;
+
+  case STORE:
+    emitStore(jit, ir);
+    break;
+
+  case ADD:
+  case SUB:
+  case ADDC:
+  case SUBC:
+  case XOR:
+  case AND:
+  case OR:
+    if (ir->fmt == FMT_RR) {
+      emitLoadReg(jit, RCX, ir->rs);
+    }
+    if (ir->op == ADDC || ir->op == SUBC) {
+      // shr byte [rbx + carry], 1 moves the carry into x86's carry flag for
+      // adc and sbb
+      emit8(jit, 0xd0);
+      emitMem(jit, 5, offsetof(CPU, carry));
+    }
+    if (ir->fmt == FMT_RR) {
+      // op word [rbx + rd], cx
+      emit8(jit, 0x66);
+      emit8(jit, aluOps[ir->op - ADD][0]);
+      emitMem(jit, RCX, REG(ir->rd));
+    } else {
+      // op word [rbx + rd], imm
+      emit8(jit, 0x66);
+      emit8(jit, 0x81);
+      emitMem(jit, aluOps[ir->op - ADD][1], REG(ir->rd));
+      emit16(jit, ir->imm);
+    }
+    if (ir->op <= SUBC) {
+      // setc byte [rbx + carry], since x86 sets the carry the same way,
+      // including as a borrow for subtraction
+      emit8(jit, 0x0f);
+      emit8(jit, 0x92);
+      emitMem(jit, 0, offsetof(CPU, carry));
+    }
+    break;
+
+  case SHL:
+  case SHR:
+  case ASR:
+    if (ir->fmt == FMT_RR) {
+      // and ecx, 15; shift word [rbx + rd], cl
+      emitLoadReg(jit, RCX, ir->rs);
+      emit8(jit, 0x83);
+      emit8(jit, 0xe1);
+      emit8(jit, 0x0f);
+      emit8(jit, 0x66);
+      emit8(jit, 0xd3);
+      emitMem(jit, shiftOps[ir->op - SHL], REG(ir->rd));
+    } else if (ir->imm & 0xf) {
+      // shift word [rbx + rd], imm
+      emit8(jit, 0x66);
+      emit8(jit, 0xc1);
+      emitMem(jit, shiftOps[ir->op - SHL], REG(ir->rd));
+      emit8(jit, ir->imm & 0xf);
+    }
+    break;
+
+  case IFEQ:
+  case IFNE:
+  case IFLT:
+  case IFGE:
+  case IFULT:
+  case IFUGE: {
+    if (ir->fmt == FMT_RR) {
+      // cmp word [rbx + rd], cx
+      emitLoadReg(jit, RCX, ir->rs);
+      emit8(jit, 0x66);
+      emit8(jit, 0x39);
+      emitMem(jit, RCX, REG(ir->rd));
+    } else {
+      // cmp word [rbx + rd], imm
+      emit8(jit, 0x66);
+      emit8(jit, 0x81);
+      emitMem(jit, 7, REG(ir->rd));
+      emit16(jit, ir->imm);
+    }
+
+    // jcc skip, patched below
+    emit8(jit, 0x0f);
+    emit8(jit, 0x80 | skipConds[ir->op - IFEQ]);
+    size_t patch = jit->used;
+    emit32(jit, 0);
+
+    emitJumpTo(jit, next);
+    uint32_t rel = jit->used - (patch + 4);
+    memcpy(jit->code + patch, &rel, sizeof(rel));
+    emitJumpTo(jit, next + ir->skip);
+  } break;
+  }
+}
+
+// jitProtect sets the protection of the pages of the code buffer holding the
+// bytes from start up to end.
+static bool jitProtect(Jit *jit, size_t start, size_t end, int prot) {
+  size_t first = start / jit->pageSize * jit->pageSize;
+  if (mprotect(jit->code + first, end - first, prot) != 0) {
+    jit->failed = true;
+    return false;
+  }
+  return true;
+}
+
+// jitCompile compiles the block starting at the address start.
+static void jitCompile(Jit *jit, const CPU *cpu, uint16_t start) {
+  if (jit->used + (JIT_MAX_BLOCK + 1) * JIT_MAX_INST_BYTES > JIT_CODE_SIZE) {
+    jitInvalidate(jit);
+  }
+
+  // find the end of the block and add up its cycles, with halt and error
+  // needing a cycle to run but not using it up, same as the interpreter
+  const Inst *prog = cpu->prog->inst;
+  int count = 0;
+  int need = 0;
+  int cycles = 0;
+  uint16_t pc = start;
+  while (count < JIT_MAX_BLOCK && jitCanCompile(&prog[pc])) {
+    const Inst *ir = &prog[pc];
+    count++;
+    need += ir->len;
+    cycles += ir->op == HALT || ir->op == ERROR ? ir->len - 1 : ir->len;
+    pc += ir->len;
+    if (jitEndsBlock(ir)) {
+      break;
+    }
+  }
+  if (count == 0) {
+    jit->need[start] = -1;
+    return;
+  }
+
+  // there's always room for the biggest block, checked above
+  size_t begin = jit->used;
+  size_t end = begin + (JIT_MAX_BLOCK + 1) * JIT_MAX_INST_BYTES;
+  if (!jitProtect(jit, begin, end, PROT_READ | PROT_WRITE)) {
+    return;
+  }
+  uint8_t *entry = jit->code + jit->used;
+
+  // cmp r12, need; jae body
+  emit8(jit, 0x49);
+  emit8(jit, 0x81);
+  emit8(jit, 0xfc);
+  emit32(jit, need);
+  emit8(jit, 0x73);
+  emit8(jit, 0x0a);
+  // mov eax, start; jmp exit
+  emit8(jit, 0xb8);
+  emit32(jit, start);
+  emitJmp(jit, jit->exit);
+  // body: sub r12, cycles
+  emit8(jit, 0x49);
+  emit8(jit, 0x81);
+  emit8(jit, 0xec);
+  emit32(jit, cycles);
+
+  pc = start;
+  const Inst *ir = NULL;
+  for (int i = 0; i < count; i++) {
+    ir = &prog[pc];
+    jitCompileInst(jit, ir, pc);
+    pc += ir->len;
+  }
+  if (!jitEndsBlock(ir)) {
+    // the block was cut short, so carry on with the next one
+    emitJumpTo(jit, pc);
+  }
+  if (!jitProtect(jit, begin, end, PROT_READ | PROT_EXEC)) {
+    return;
+  }
+
+  jit->blocks[start] = entry;
+  jit->need[start] = need;
+}
+
+Jit *jitCreate(void) {
+  Jit *jit = calloc(1, sizeof(Jit));
+  if (jit == NULL) {
+    return NULL;
+  }
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED) {
+    free(jit);
+    return NULL;
+  }
+  jit->pageSize = sysconf(_SC_PAGESIZE);
+  emitStubs(jit);
+  if (!jitProtect(jit, 0, JIT_CODE_SIZE, PROT_READ | PROT_EXEC)) {
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+    return NULL;
+  }
+  return jit;
+}
+
+void jitInvalidate(Jit *jit) {
+  jit->used = jit->stubs;
+  memset(jit->blocks, 0, sizeof(jit->blocks));
+  memset(jit->need, 0, sizeof(jit->need));
+}
+
+void jitRun(Jit *jit, CPU *cpu, uint64_t cycles) {
+  if (jit->failed || cpu->trace || cpu->record != NULL ||
+      cpu->profile != NULL || cpu->breakpoints != NULL ||
+      cpu->bus.watch != NULL || cpu->ioLog != NULL) {
+    cpuRun(cpu, cycles);
+    return;
+  }
+
+  uint64_t endCycle =
+      cycles < UINT64_MAX - cpu->cycles ? cpu->cycles + cycles : UINT64_MAX;
+  while (!cpu->halt && !cpu->error && cpu->cycles < endCycle) {
+    // stop at the next device event, the same as cpuRun
+    uint64_t next = cpuService(cpu);
+    uint64_t end = next < endCycle ? next : endCycle;
+    uint64_t budget = end - cpu->cycles;
+
+    if (cpu->immValid) {
+      // the last run stopped between an imm prefix and its instruction
+      cpuRun(cpu, 1);
+      continue;
+    }
+
+    if (jit->need[cpu->pc] == 0) {
+      jitCompile(jit, cpu, cpu->pc);
+      if (jit->failed) {
+        // the block couldn't be written, or the code buffer can't be run,
+        // so the interpreter takes over from here
+        cpuRun(cpu, endCycle - cpu->cycles);
+        return;
+      }
+    }
+    int32_t need = jit->need[cpu->pc];
+    if (need < 0) {
+      cpuRun(cpu, 1);
+    } else if ((uint64_t)need > budget) {
+      // not enough cycles left to run the whole block
+      cpuRun(cpu, budget);
+    } else {
+      budget = jit->enter(cpu, budget, jit->blocks);
+      cpu->cycles = end - budget;
+    }
+  }
+}
+
+void jitDestroy(Jit *jit) {
+  if (jit == NULL) {
+    return;
+  }
+  munmap(jit->code, JIT_CODE_SIZE);
+  free(jit);
+}
+
+#else
+
+Jit *jitCreate(void) { return NULL; }
+
+void jitInvalidate(Jit *jit) {}
+
+void jitRun(Jit *jit, CPU *cpu, uint64_t cycles) { cpuRun(cpu, cycles); }
+
+void jitDestroy(Jit *jit) {}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "cpu.h"
+
+// Jit is a just-in-time compiler that translates the CPU's decoded program
+// into native x86-64 code, one basic block at a time. Blocks end at jumps,
+// calls and if.* instructions, and are compiled the first time they're run.
+// It's only supported on x86-64, everywhere else jitCreate returns NULL and
+// cpuRun should be used instead.
+typedef struct Jit Jit;
+
+// jitCreate allocates a new JIT with an empty code buffer. Returns NULL if the
+// JIT isn't supported on this platform, or if executable memory couldn't be
+// allocated. The code buffer is only made writable while a block is being
+// compiled, and if the system won't allow that, jitRun hands everything to
+// cpuRun from then on.
+Jit *jitCreate(void);
+
+// jitInvalidate throws away all the compiled code. It must be called whenever
+// the program memory of the CPU it's run with changes.
+void jitInvalidate(Jit *jit);
+
+// jitRun runs the CPU for the specified number of cycles, the same as cpuRun,
+// with the same exact cycle counting and halt / error signals. Compiled code
+// is only valid for the program it was compiled from, so a Jit should only be
+// used with one CPU at a time. Tracing, and any instructions the JIT can't
+// compile, are handed off to cpuRun.
+void jitRun(Jit *jit, CPU *cpu, uint64_t cycles);
+
+// jitDestroy frees the JIT and its code buffer.
+void jitDestroy(Jit *jit);
+
+#endif
@@ -0,0 +1,597 @@
+#include "lockstep.h"
+#include "bus.h"
+#include "cpu.h"
+#include "emurj.h"
+#include "inst.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LANES LOCKSTEP_LANES
+
+// FOR_LANES loops over every lane. The loops are kept simple so the compiler
+// can vectorize them.
+#define FOR_LANES(l) for (int l = 0; l < LANES; l++)
+
+// BLEND picks new where the mask is set and old everywhere else.
+#define BLEND(old, new, mask) (((old) & ~(mask)) | ((new) & (mask)))
+
+// Lane is the memory and IO devices of one instance.
+typedef struct Lane {
+  // a CPU used to run instructions for just this lane, for the rare cases
+  // that aren't worth vectorizing. Its IO bus is the lane's memory and
+  // devices, and its registers are only up to date while it's running.
+  CPU cpu;
+  Device devices[2];
+  Console console;
+  uint16_t *ram;
+
+  // which instance is running in the lane
+  int instance;
+} Lane;
+
+// Group is the state of a group of instances stepped together. The registers
+// are stored as a structure of arrays, with one vector per register.
+typedef struct Group {
+  uint16_t reg[16][LANES];
+  uint16_t pc[LANES];
+  uint64_t cycles[LANES];
+
+  // the carry flag of each lane, 0 or 1
+  uint16_t carry[LANES];
+
+  // 0xffff for each lane that's still running, 0 otherwise
+  uint16_t running[LANES];
+
+  Lane lanes[LANES];
+
+  // whether each page is plain memory, mapped for reads and writes, in every
+  // lane, so loads and stores can go straight to the lanes' memory
+  bool ramPages[IOBUS_NUM_PAGES];
+
+  Program *prog;
+  uint64_t maxCycles;
+  int *results;
+  uint64_t *resultCycles;
+} Group;
+
+static void laneToCpu(Group *g, int l) {
+  CPU *cpu = &g->lanes[l].cpu;
+  for (int r = 0; r < 16; r++) {
+    cpu->reg[r] = g->reg[r][l];
+  }
+  cpu->pc = g->pc[l];
+  cpu->cycles = g->cycles[l];
+  cpu->carry = g->carry[l];
+}
+
+static void cpuToLane(Group *g, int l) {
+  CPU *cpu = &g->lanes[l].cpu;
+  for (int r = 0; r < 16; r++) {
+    g->reg[r][l] = cpu->reg[r];
+  }
+  g->pc[l] = cpu->pc;
+  g->cycles[l] = cpu->cycles;
+  g->carry[l] = cpu->carry;
+}
+
+// finishLane stops the lane and records its result, the same way as emuRun.
+static void finishLane(Group *g, int l, bool halt, bool error) {
+  int instance = g->lanes[l].instance;
+  if (error) {
+    g->results[instance] = g->reg[1][l];
+  } else if (halt) {
+    g->results[instance] = 0;
+  } else {
+    fprintf(stderr, "Program failed to terminate\n");
+    g->results[instance] = 1;
+  }
+  consoleFlush(&g->lanes[l].console);
+  if (g->resultCycles != NULL) {
+    g->resultCycles[instance] = g->cycles[l];
+  }
+  g->running[l] = 0;
+}
+
+// stepScalar runs the instruction at the lane's pc on the lane's CPU. An imm
+// chain is run through to the instruction at the end of it, since the pending
+// prefix can't be kept in the lane.
+static void stepScalar(Group *g, int l) {
+  CPU *cpu = &g->lanes[l].cpu;
+  laneToCpu(g, l);
+  do {
+    cpuRun(cpu, 1);
+  } while (cpu->immValid && !cpu->halt && !cpu->error &&
+           cpu->cycles < g->maxCycles);
+  cpuToLane(g, l);
+
+  if (cpu->halt || cpu->error) {
+    finishLane(g, l, cpu->halt, cpu->error);
+  } else if (cpu->immValid) {
+    // ran out of cycles in the middle of the chain
+    finishLane(g, l, false, false);
+  }
+}
+
+// finishScalar runs the lane to the cycle limit on the lane's CPU, for when
+// the next instruction doesn't fit in the cycles that are left, so the lane
+// stops in exactly the same way.
+static void finishScalar(Group *g, int l) {
+  CPU *cpu = &g->lanes[l].cpu;
+  laneToCpu(g, l);
+  cpuRun(cpu, g->maxCycles - cpu->cycles);
+  cpuToLane(g, l);
+  finishLane(g, l, cpu->halt, cpu->error);
+}
+
+// canVectorize returns whether the instruction is run for all the lanes
+// together.
+static bool canVectorize(const Inst *ir) {
+  switch (ir->op) {
+  case NOP:
+  case ERROR:
+  case HALT:
+  case RCSR:
+  case MOVE:
+  case JUMP:
+  case CALL:
+  case LOAD:
+  case STORE:
+  case ADD:
+  case SUB:
+  case ADDC:
+  case SUBC:
+  case XOR:
+  case AND:
+  case OR:
+  case SHL:
+  case SHR:
+  case ASR:
+  case IFEQ:
+  case IFNE:
+  case IFLT:
+  case IFGE:
+  case IFULT:
+  case IFUGE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// addCycles adds the cycles to the lanes in the mask.
+static void addCycles(Group *g, const uint16_t *m, uint64_t cycles) {
+  FOR_LANES(l) { g->cycles[l] += m[l] ? cycles : 0; }
+}
+
+// stepVector runs the instruction at pc for the lanes in the mask, which are
+// all at pc and have already had its cycles counted. Returns true if they
+// all carry on to the next instruction, leaving their pcs for the caller to
+// update. Otherwise their pcs are updated here, or they've stopped.
+static bool stepVector(Group *g, uint16_t pc, const uint16_t *mask) {
+  const Inst *ir = &g->prog->inst[pc];
+  // a copy of the mask, which the compiler can see doesn't overlap the
+  // registers, so it doesn't have to check before vectorizing
+  uint16_t m[LANES];
+  memcpy(m, mask, sizeof(m));
+  uint16_t rsval[LANES];
+  if (ir->fmt == FMT_RR) {
+    FOR_LANES(l) { rsval[l] = g->reg[ir->rs][l]; }
+  } else {
+    FOR_LANES(l) { rsval[l] = ir->imm; }
+  }
+
+  uint16_t *rd = g->reg[ir->rd];
+  uint16_t next = pc + ir->len;
+  switch (ir->op) {
+  case NOP:
+    break;
+
+  case HALT:
+  case ERROR:
+    FOR_LANES(l) {
+      if (m[l]) {
+        // the halt itself doesn't take a cycle
+        g->pc[l] = pc;
+        g->cycles[l]--;
+        finishLane(g, l, ir->op == HALT, ir->op == ERROR);
+      }
+    }
+    return false;
+
+  case RCSR:
+    // temporary jump instruction
+    FOR_LANES(l) { g->pc[l] = BLEND(g->pc[l], rd[l] + 1, m[l]); }
+    return false;
+
+  case MOVE:
+    FOR_LANES(l) { rd[l] = BLEND(rd[l], rsval[l], m[l]); }
+    break;
+
+  case CALL:
+    FOR_LANES(l) { g->reg[0][l] = BLEND(g->reg[0][l], next - 1, m[l]); }
+    // fall through
+
+  case JUMP:
+    if (ir->fmt == FMT_RR) {
+      const uint16_t *rs = g->reg[ir->rs];
+      FOR_LANES(l) { g->pc[l] = BLEND(g->pc[l], rs[l] + 1, m[l]); }
+    } else {
+      uint16_t target = next + ir->imm;
+      FOR_LANES(l) { g->pc[l] = BLEND(g->pc[l], target, m[l]); }
+    }
+    return false;
+
+  case LOAD:
+  case STORE: {
+    // straight to the lanes' memory if they're all on plain memory pages,
+    // otherwise through each lane's IO bus
+    const uint16_t *rs = g->reg[ir->rs];
+    uint16_t address[LANES];
+    FOR_LANES(l) { address[l] = rs[l] + ir->imm; }
+    bool ram = true;
+    FOR_LANES(l) {
+      ram = ram && (!m[l] || g->ramPages[address[l] >> IOBUS_PAGE_BITS]);
+    }
+    if (ram && ir->op == LOAD) {
+      FOR_LANES(l) {
+        rd[l] = BLEND(rd[l], g->lanes[l].ram[address[l]], m[l]);
+      }
+    } else if (ram) {
+      FOR_LANES(l) {
+        if (m[l]) {
+          g->lanes[l].ram[address[l]] = rd[l];
+        }
+      }
+    } else {
+      FOR_LANES(l) {
+        if (m[l] && ir->op == LOAD) {
+          rd[l] = ioBusRead(&g->lanes[l].cpu.bus, address[l]);
+        } else if (m[l]) {
+          ioBusWrite(&g->lanes[l].cpu.bus, address[l], rd[l]);
+        }
+      }
+    }
+  } break;
+
+  case ADD:
+  case ADDC: {
+    // the carry in is masked off for add. The results go through locals so
+    // the compiler can see the carry and the register don't overlap.
+    uint16_t cin = ir->op == ADDC ? 1 : 0;
+    uint16_t result[LANES], carry[LANES];
+    FOR_LANES(l) {
+      uint32_t sum = (uint32_t)rd[l] + rsval[l] + (g->carry[l] & cin);
+      carry[l] = BLEND(g->carry[l], sum >> 16, m[l]);
+      result[l] = BLEND(rd[l], sum, m[l]);
+    }
+    memcpy(g->carry, carry, sizeof(carry));
+    memcpy(rd, result, sizeof(result));
+  } break;
+
+  case SUB:
+  case SUBC: {
+    uint16_t cin = ir->op == SUBC ? 1 : 0;
+    uint16_t result[LANES], carry[LANES];
+    FOR_LANES(l) {
+      uint32_t b = (uint32_t)rsval[l] + (g->carry[l] & cin);
+      carry[l] = BLEND(g->carry[l], rd[l] < b, m[l]);
+      result[l] = BLEND(rd[l], rd[l] - b, m[l]);
+    }
+    memcpy(g->carry, carry, sizeof(carry));
+    memcpy(rd, result, sizeof(result));
+  } break;
+
+  case XOR:
+    FOR_LANES(l) { rd[l] = BLEND(rd[l], rd[l] ^ rsval[l], m[l]); }
+    break;
+
+  case AND:
+    FOR_LANES(l) { rd[l] = BLEND(rd[l], rd[l] & rsval[l], m[l]); }
+    break;
+
+  case OR:
+    FOR_LANES(l) { rd[l] = BLEND(rd[l], rd[l] | rsval[l], m[l]); }
+    break;
+
+  case SHL:
+    FOR_LANES(l) {
+      rd[l] = BLEND(rd[l], (uint16_t)(rd[l] << (rsval[l] & 0xf)), m[l]);
+    }
+    break;
+
+  case SHR:
+    FOR_LANES(l) { rd[l] = BLEND(rd[l], rd[l] >> (rsval[l] & 0xf), m[l]); }
+    break;
+
+  case ASR:
+    FOR_LANES(l) {
+      uint16_t v = (uint16_t)((int16_t)rd[l] >> (rsval[l] & 0xf));
+      rd[l] = BLEND(rd[l], v, m[l]);
+    }
+    break;
+
+  case IFEQ:
+  case IFNE:
+  case IFLT:
+  case IFGE:
+  case IFULT:
+  case IFUGE: {
+    // a failed if skips the next instruction
+    uint16_t skip[LANES];
+    switch (ir->op) {
+    case IFEQ:
+      FOR_LANES(l) { skip[l] = rd[l] != rsval[l]; }
+      break;
+    case IFNE:
+      FOR_LANES(l) { skip[l] = rd[l] == rsval[l]; }
+      break;
+    case IFLT:
+      FOR_LANES(l) { skip[l] = (int16_t)rd[l] >= (int16_t)rsval[l]; }
+      break;
+    case IFGE:
+      FOR_LANES(l) { skip[l] = (int16_t)rd[l] < (int16_t)rsval[l]; }
+      break;
+    case IFULT:
+      FOR_LANES(l) { skip[l] = rd[l] >= rsval[l]; }
+      break;
+    default:
+      FOR_LANES(l) { skip[l] = rd[l] < rsval[l]; }
+      break;
+    }
+    FOR_LANES(l) {
+      uint16_t target = next + (skip[l] ? ir->skip : 0);
+      g->pc[l] = BLEND(g->pc[l], target, m[l]);
+    }
+    return false;
+  }
+  }
+  return true;
+}
+
+// runGroup runs the group until every lane has stopped. Each time round, it
+// picks the running lanes at the lowest pc, which lets lanes that branched
+// ahead wait for the others to catch up so they can run together again. It
+// keeps running those lanes with the same mask, counting their cycles once
+// at the end, until they stop, branch different ways, or get to where other
+// lanes are waiting, which is when picking again could change anything.
+static void runGroup(Group *g) {
+  for (;;) {
+    bool any = false;
+    uint16_t pc = 0xffff;
+    FOR_LANES(l) {
+      if (g->running[l] && g->pc[l] <= pc) {
+        pc = g->pc[l];
+        any = true;
+      }
+    }
+    if (!any) {
+      return;
+    }
+
+    // the lanes at pc, one of them, the most cycles any of them have run,
+    // and the lowest pc any of the others are waiting at
+    uint16_t m[LANES];
+    int first = 0;
+    uint64_t most = 0;
+    uint32_t waiting = 0x10000;
+    FOR_LANES(l) {
+      m[l] = g->running[l] & (g->pc[l] == pc ? 0xffff : 0);
+      if (m[l]) {
+        first = l;
+      }
+      if (m[l] && g->cycles[l] > most) {
+        most = g->cycles[l];
+      }
+      if (g->running[l] && g->pc[l] != pc && g->pc[l] < waiting) {
+        waiting = g->pc[l];
+      }
+    }
+
+    uint64_t ran = 0;
+    for (;;) {
+      const Inst *ir = &g->prog->inst[pc];
+      if (!canVectorize(ir)) {
+        addCycles(g, m, ran);
+        FOR_LANES(l) {
+          if (m[l]) {
+            g->pc[l] = pc;
+            stepScalar(g, l);
+          }
+        }
+        break;
+      }
+      if (most + ran + ir->len > g->maxCycles) {
+        // hand the lanes that would go over the limit to their own CPUs to
+        // stop them, and pick the others up again next time round
+        addCycles(g, m, ran);
+        FOR_LANES(l) {
+          if (m[l]) {
+            g->pc[l] = pc;
+            if (g->cycles[l] + ir->len > g->maxCycles) {
+              finishScalar(g, l);
+            }
+          }
+        }
+        break;
+      }
+
+      ran += ir->len;
+      if (ir->op == HALT || ir->op == ERROR) {
+        // the lanes stop with their cycles up to date
+        addCycles(g, m, ran);
+        stepVector(g, pc, m);
+        break;
+      }
+      uint16_t next = pc + ir->len;
+      uint16_t diverged = 0;
+      if (!stepVector(g, pc, m)) {
+        // they branched, and only carry on together if they all went the
+        // same way
+        next = g->pc[first];
+        FOR_LANES(l) { diverged |= m[l] & (g->pc[l] != next); }
+      }
+      if (diverged || next >= waiting) {
+        addCycles(g, m, ran);
+        if (!diverged) {
+          FOR_LANES(l) { g->pc[l] = BLEND(g->pc[l], next, m[l]); }
+        }
+        break;
+      }
+      pc = next;
+    }
+  }
+}
+
+// groupInit sets up the group to run the instances from first up to count.
+static void groupInit(Group *g, int first, int count,
+                      const uint16_t *const *dataMems,
+                      const int *dataLengths) {
+  memset(g->reg, 0, sizeof(g->reg));
+  memset(g->pc, 0, sizeof(g->pc));
+  memset(g->cycles, 0, sizeof(g->cycles));
+  memset(g->carry, 0, sizeof(g->carry));
+  memset(g->ramPages, true, sizeof(g->ramPages));
+  FOR_LANES(l) {
+    Lane *lane = &g->lanes[l];
+    g->running[l] = first + l < count ? 0xffff : 0;
+    lane->instance = first + l;
+    if (!g->running[l]) {
+      continue;
+    }
+
+    memset(lane->ram, 0, 0x10000 * sizeof(uint16_t));
+    lane->devices[0] = (Device){
+        .address = 0xFF00,
+        .size = 1,
+        .handler = consoleHandler,
+        .context = &lane->console,
+    };
+    lane->devices[1] = (Device){
+        .address = 0,
+        .size = 0xffff,
+        .handler = memoryHandler,
+        .context = lane->ram,
+        .memory = lane->ram,
+    };
+    cpuReset(&lane->cpu);
+    cpuInitBusDevices(&lane->cpu, lane->devices, 2);
+    if (dataMems != NULL) {
+      cpuWriteDataMem(&lane->cpu, dataMems[lane->instance],
+                      dataLengths[lane->instance]);
+    }
+
+    const IOBus *bus = &lane->cpu.bus;
+    for (int p = 0; p < IOBUS_NUM_PAGES; p++) {
+      uint16_t *page = lane->ram + p * IOBUS_PAGE_SIZE;
+      g->ramPages[p] = g->ramPages[p] && bus->readPages[p] == page &&
+                       bus->writePages[p] == page;
+    }
+  }
+}
+
+// usesInterrupts returns whether the program has any wcsr or rets. Those need
+// the timer, which runs on an event queue, and lanes don't have one.
+static bool usesInterrupts(const Program *prog) {
+  for (int pc = 0; pc < prog->length; pc++) {
+    if (prog->inst[pc].op == WCSR || prog->inst[pc].op == RETS) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// runScalar runs each instance on its own emulator instead, sharing the
+// decoded program. Returns the number of instances that didn't exit with 0.
+static int runScalar(uint64_t maxCycles, Program *prog,
+                     const uint16_t *const *dataMems, const int *dataLengths,
+                     int count, int *results, uint64_t *cycles) {
+  Emu *emu = emuCreate();
+  if (emu == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return count;
+  }
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    emuLoadProgram(emu, prog, dataMems != NULL ? dataMems[i] : NULL,
+                   dataMems != NULL ? dataLengths[i] : 0);
+    results[i] = emuRun(emu, maxCycles, false);
+    if (cycles != NULL) {
+      cycles[i] = emuCycles(emu);
+    }
+    if (results[i] != 0) {
+      failed++;
+    }
+  }
+  emuDestroy(emu);
+  return failed;
+}
+
+int runRj32Lockstep(uint64_t maxCycles, const uint16_t *progMem,
+                    int progLength, const uint16_t *const *dataMems,
+                    const int *dataLengths, int count, int *results,
+                    uint64_t *cycles) {
+  Program *prog = programCreate(progMem, progLength);
+  if (prog == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return count;
+  }
+  if (usesInterrupts(prog)) {
+    int failed = runScalar(maxCycles, prog, dataMems, dataLengths, count,
+                           results, cycles);
+    programRelease(prog);
+    return failed;
+  }
+
+  Group *g = calloc(1, sizeof(Group));
+  if (g == NULL) {
+    programRelease(prog);
+    fprintf(stderr, "Out of memory\n");
+    return count;
+  }
+  for (int l = 0; l < LANES; l++) {
+    consoleInit(&g->lanes[l].console, consoleFileSink, NULL);
+    cpuInit(&g->lanes[l].cpu, false);
+    cpuSetProgram(&g->lanes[l].cpu, prog);
+    g->lanes[l].ram = calloc(0x10000, sizeof(uint16_t));
+    if (g->lanes[l].ram == NULL) {
+      for (int i = 0; i <= l; i++) {
+        cpuDestroy(&g->lanes[i].cpu);
+        free(g->lanes[i].ram);
+      }
+      free(g);
+      programRelease(prog);
+      fprintf(stderr, "Out of memory\n");
+      return count;
+    }
+  }
+
+  g->prog = prog;
+  g->maxCycles = maxCycles;
+  g->results = results;
+  g->resultCycles = cycles;
+
+  for (int first = 0; first < count; first += LANES) {
+    groupInit(g, first, count, dataMems, dataLengths);
+    runGroup(g);
+  }
+
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    if (results[i] != 0) {
+      failed++;
+    }
+  }
+
+  for (int l = 0; l < LANES; l++) {
+    consoleDestroy(&g->lanes[l].console);
+    cpuDestroy(&g->lanes[l].cpu);
+    free(g->lanes[l].ram);
+  }
+  programRelease(prog);
+  free(g);
+  return failed;
+}
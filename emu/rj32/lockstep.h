@@ -0,0 +1,27 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+
+// LOCKSTEP_LANES is the number of instances that are stepped together, with
+// each of their registers kept in one lane of a vector.
+#define LOCKSTEP_LANES 16
+
+// runRj32Lockstep runs the same program against many different data memory
+// images. Instances are stepped together, LOCKSTEP_LANES at a time, running
+// each instruction for every instance that's at the same pc, so the compiler
+// can vectorize across them. Instances that branch differently are split up
+// and run separately until they meet again at the same pc. Each instance has
+// the same IO devices as runRj32Emu, and the error code of each one is written
+// to results, along with the number of cycles it ran if cycles isn't NULL.
+// dataMems can be NULL if none of the instances have any data memory.
+// These are identical to running each instance on its own with runRj32Emu.
+// Lanes have no event queue, so programs with any wcsr or rets, which need
+// the timer, are run an instance at a time on the interpreter instead.
+// Returns the number of instances that didn't exit with 0.
+int runRj32Lockstep(uint64_t maxCycles, const uint16_t *progMem,
+                    int progLength, const uint16_t *const *dataMems,
+                    const int *dataLengths, int count, int *results,
+                    uint64_t *cycles);
+
+#endif
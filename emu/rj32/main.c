@@ -1,33 +1,199 @@
+#include "batch.h"
+#include "debug.h"
 #include "emurj.h"
+#include "image.h"
+#include "profile.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-int main(int argc, const char *argv[]) {
-  if (argc != 2) {
-    printf("Usage: %s <file>\n", argv[0]);
+// runProfiled runs the program like runRj32Emu, but with profiling instead
+// of tracing, and writes the profile's report and collapsed stacks.
+static int runProfiled(const char *report, const Image *image) {
+  char stacksName[4096];
+  snprintf(stacksName, sizeof(stacksName), "%s.folded", report);
+  FILE *out = fopen(report, "w");
+  FILE *stacks = fopen(stacksName, "w");
+  if (out == NULL || stacks == NULL) {
+    perror(out == NULL ? report : stacksName);
+    exit(1);
+  }
+  Emu *emu = emuCreate();
+  Profile *profile = profileCreate();
+  if (emu == NULL || profile == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  emuSetProfile(emu, profile);
+  emuLoadImage(emu, image);
+  int ret = emuRun(emu, 1000000, false);
+  emuProfileReport(emu, profile, out, stacks);
+
+  fclose(out);
+  fclose(stacks);
+  profileDestroy(profile);
+  emuDestroy(emu);
+  return ret;
+}
+
+// runTraced runs the program like runRj32Emu, with tracing limited by the
+// trigger, and if filename isn't NULL, records a binary trace to it instead
+// of printing the text trace.
+static int runTraced(const char *filename, TraceTrigger *trigger,
+                     const Image *image) {
+  Trace *trace = NULL;
+  if (filename != NULL) {
+    trace = traceOpen(filename);
+    if (trace == NULL) {
+      perror(filename);
+      exit(1);
+    }
+  }
+  Emu *emu = emuCreate();
+  if (emu == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  emuSetRecord(emu, trace);
+  emuSetTraceTrigger(emu, trigger);
+  emuLoadImage(emu, image);
+  int ret = emuRun(emu, 1000000, trace == NULL);
+
+  emuDestroy(emu);
+  if (!traceClose(trace)) {
+    perror(filename);
+    exit(1);
+  }
+  return ret;
+}
+
+// runDebugged runs the program under the debugger, with commands from the
+// script, or typed in if the script is "-".
+static int runDebugged(const char *script, const Image *image) {
+  bool interactive = strcmp(script, "-") == 0;
+  FILE *in = interactive ? stdin : fopen(script, "r");
+  if (in == NULL) {
+    perror(script);
     exit(1);
   }
+  Emu *emu = emuCreate();
+  Debugger *dbg = malloc(sizeof(Debugger));
+  if (emu == NULL || dbg == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  emuLoadImage(emu, image);
+  debuggerInit(dbg, emuCpu(emu), 1000000);
+  int ret = debuggerRun(dbg, in, stdout, interactive);
+
+  if (!interactive) {
+    fclose(in);
+  }
+  free(dbg);
+  emuDestroy(emu);
+  return ret;
+}
 
-  FILE *f = fopen(argv[1], "rb");
-  fseek(f, 0, SEEK_END);
-  long fsize = ftell(f);
-  fseek(f, 0, SEEK_SET); /* same as rewind(f); */
+int main(int argc, const char *argv[]) {
+  if (argc >= 3 && argc <= 4 && strcmp(argv[1], "-batch") == 0) {
+    return runBatch(argv[2], argc == 4 ? atoi(argv[3]) : 0);
+  }
+  if (argc >= 3 && argc <= 4 && strcmp(argv[1], "-guests") == 0) {
+    // a slice of 0 would never get anywhere, so it gets the usage message,
+    // and so does one that isn't a number
+    char *end = NULL;
+    uint64_t slice = argc == 4 ? strtoull(argv[3], &end, 10) : 10000;
+    if (slice > 0 && (end == NULL || (*end == '\0' && argv[3][0] != '-'))) {
+      return runGuests(argv[2], slice);
+    }
+  }
 
-  uint16_t *rom = malloc(fsize + 1);
-  fread(rom, fsize, 1, f);
-  fclose(f);
+  // -profile writes a report to the given file, and the collapsed call
+  // stacks next to it with .folded on the end. -debug runs the program under
+  // the debugger with commands from a script, or from stdin if it's -.
+  // -record writes a binary trace to the given file instead of the text
+  // trace. -from, -pc and -store limit the trace to after a cycle count, to
+  // pcs in a range, given in hex and repeatable, and to after the first store
+  // to an address in hex. -verify, which has to come first, checks an image's
+  // checksum before running it, which means reading the whole file.
+  const char *name = argv[0];
+  bool verify = argc >= 2 && strcmp(argv[1], "-verify") == 0;
+  if (verify) {
+    argv++;
+    argc--;
+  }
+  const char *report = NULL;
+  const char *record = NULL;
+  const char *script = NULL;
+  TraceTrigger trigger;
+  traceTriggerInit(&trigger);
+  bool triggered = false;
+  while (argc >= 4 && argv[1][0] == '-') {
+    unsigned start, end;
+    if (strcmp(argv[1], "-profile") == 0) {
+      report = argv[2];
+    } else if (strcmp(argv[1], "-debug") == 0) {
+      script = argv[2];
+    } else if (strcmp(argv[1], "-record") == 0) {
+      record = argv[2];
+    } else if (strcmp(argv[1], "-from") == 0) {
+      trigger.startCycle = strtoull(argv[2], NULL, 10);
+      triggered = true;
+    } else if (strcmp(argv[1], "-pc") == 0 &&
+               sscanf(argv[2], "%x-%x", &start, &end) == 2 && start <= end &&
+               end <= 0xffff) {
+      traceTriggerAddRange(&trigger, start, end);
+      triggered = true;
+    } else if (strcmp(argv[1], "-store") == 0) {
+      trigger.storeTrigger = true;
+      trigger.storeAddress = strtoul(argv[2], NULL, 16);
+      triggered = true;
+    } else {
+      break;
+    }
+    argv += 2;
+    argc -= 2;
+  }
 
-  int romsize = fsize / 2;
-  uint16_t *data = NULL;
-  int datasize = 0;
+  int modes =
+      (report != NULL) + (script != NULL) + (record != NULL || triggered);
+  if (argc != 2 || modes > 1) {
+    printf("Usage: %s [-verify] [-profile <report file>] <file>\n", name);
+    printf("       %s [-verify] -debug <script file or -> <file>\n", name);
+    printf("       %s [-verify] [-record <trace file>] [-from <cycle>] "
+           "[-pc <start>-<end>]... [-store <address>] <file>\n",
+           name);
+    printf("       %s -batch <manifest> [threads]\n", name);
+    printf("       %s -guests <manifest> [slice]\n", name);
+    exit(1);
+  }
 
-  if (romsize > 0x10000) {
-    data = rom + 0x10000;
-    datasize = romsize - 0x10000;
-    romsize = 0x10000;
+  // the file is either an image or a raw ROM, see image.h
+  Image image;
+  if (!imageOpen(&image, argv[1])) {
+    fprintf(stderr, "Unable to read %s\n", argv[1]);
+    exit(1);
+  }
+  if (verify && !imageVerify(&image)) {
+    fprintf(stderr, "%s is corrupt, its checksum doesn't match\n", argv[1]);
+    imageClose(&image);
+    exit(1);
   }
 
-  int ret = runRj32Emu(1000000, rom, romsize, data, datasize, true);
+  int ret;
+  if (report != NULL) {
+    ret = runProfiled(report, &image);
+  } else if (script != NULL) {
+    ret = runDebugged(script, &image);
+  } else {
+    // without a trigger or a binary trace, this prints the whole text trace
+    ret = runTraced(record, triggered ? &trigger : NULL, &image);
+  }
+  imageClose(&image);
   if (ret) {
     exit(ret);
   }
@@ -0,0 +1,245 @@
+#include "profile.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the call tree stops growing at this many nodes, after which calls to new
+// functions are counted in the caller
+#define PROFILE_MAX_NODES 65536
+
+// the number of instructions listed in the report
+#define PROFILE_HOT_PCS 20
+
+Profile *profileCreate(void) {
+  Profile *profile = calloc(1, sizeof(Profile));
+  if (profile == NULL) {
+    return NULL;
+  }
+  profile->capNodes = 64;
+  profile->nodes = malloc(profile->capNodes * sizeof(ProfileNode));
+  if (profile->nodes == NULL) {
+    free(profile);
+    return NULL;
+  }
+  profileClear(profile);
+  return profile;
+}
+
+void profileClear(Profile *profile) {
+  memset(profile->counts, 0, sizeof(profile->counts));
+  memset(profile->skips, 0, sizeof(profile->skips));
+  memset(profile->loads, 0, sizeof(profile->loads));
+  memset(profile->stores, 0, sizeof(profile->stores));
+  profile->nodes[0] = (ProfileNode){.parent = -1, .child = -1, .sibling = -1};
+  profile->numNodes = 1;
+  profile->node = 0;
+  profile->lastCycles = 0;
+}
+
+void profileDestroy(Profile *profile) {
+  if (profile == NULL) {
+    return;
+  }
+  free(profile->nodes);
+  free(profile);
+}
+
+void profileFlush(Profile *profile, uint64_t cycles) {
+  profile->nodes[profile->node].cycles += cycles - profile->lastCycles;
+  profile->lastCycles = cycles;
+}
+
+// profileChild finds or adds the child of the current node for a call to
+// func. Returns -1 if the tree is full.
+static int profileChild(Profile *profile, uint16_t func) {
+  ProfileNode *nodes = profile->nodes;
+  int n;
+  for (n = nodes[profile->node].child; n >= 0; n = nodes[n].sibling) {
+    if (nodes[n].func == func) {
+      return n;
+    }
+  }
+
+  if (profile->numNodes == PROFILE_MAX_NODES) {
+    return -1;
+  }
+  if (profile->numNodes == profile->capNodes) {
+    int cap = profile->capNodes * 2;
+    nodes = realloc(profile->nodes, cap * sizeof(ProfileNode));
+    if (nodes == NULL) {
+      return -1;
+    }
+    profile->nodes = nodes;
+    profile->capNodes = cap;
+  }
+  n = profile->numNodes++;
+  nodes[n] = (ProfileNode){
+      .func = func,
+      .parent = profile->node,
+      .child = -1,
+      .sibling = nodes[profile->node].child,
+  };
+  nodes[profile->node].child = n;
+  return n;
+}
+
+void profileCall(Profile *profile, uint16_t target, uint16_t ret,
+                 uint64_t cycles) {
+  profileFlush(profile, cycles);
+  int n = profileChild(profile, target);
+  if (n >= 0) {
+    profile->node = n;
+    profile->nodes[n].ret = ret;
+  }
+}
+
+void profileJump(Profile *profile, uint16_t target, uint64_t cycles) {
+  const ProfileNode *node = &profile->nodes[profile->node];
+  if (profile->node != 0 && node->ret == target) {
+    profileFlush(profile, cycles);
+    profile->node = node->parent;
+  }
+}
+
+typedef struct Count {
+  int key;
+  uint64_t count;
+} Count;
+
+static int compareCounts(const void *a, const void *b) {
+  const Count *x = a;
+  const Count *y = b;
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return x->key - y->key;
+}
+
+static double percent(uint64_t count, uint64_t total) {
+  return total ? 100.0 * count / total : 0.0;
+}
+
+void profileReport(FILE *out, const Profile *profile, const Inst *prog,
+                   const IOBus *bus) {
+  Count *pcs = malloc(65536 * sizeof(Count));
+  if (pcs == NULL) {
+    return;
+  }
+  int numPcs = 0;
+  uint64_t total = 0;
+  uint64_t imms = 0;
+  uint64_t skips = 0;
+  Count ops[32];
+  for (int op = 0; op < 32; op++) {
+    ops[op] = (Count){.key = op};
+  }
+  for (int pc = 0; pc < 65536; pc++) {
+    uint64_t count = profile->counts[pc];
+    if (count == 0) {
+      continue;
+    }
+    pcs[numPcs++] = (Count){.key = pc, .count = count};
+    total += count;
+    skips += profile->skips[pc];
+    ops[prog[pc].op].count += count;
+    if (prog[pc].len == 2) {
+      imms += count;
+    }
+  }
+  imms += ops[IMM].count + ops[IMM2].count;
+
+  fprintf(out, "%llu instructions, %llu imm prefixes, %llu skips taken\n",
+          (unsigned long long)total, (unsigned long long)imms,
+          (unsigned long long)skips);
+
+  qsort(pcs, numPcs, sizeof(Count), compareCounts);
+  fprintf(out, "\nhot instructions:\n");
+  fprintf(out, "%14s %7s %6s %12s  %s\n", "count", "%", "pc", "skips",
+          "instruction");
+  for (int i = 0; i < numPcs && i < PROFILE_HOT_PCS; i++) {
+    char buf[64];
+    int pc = pcs[i].key;
+    fprintf(out, "%14llu %6.2f%%   %04x %12llu  %s\n",
+            (unsigned long long)pcs[i].count, percent(pcs[i].count, total),
+            pc, (unsigned long long)profile->skips[pc],
+            instString(buf, sizeof(buf), prog[pc]));
+  }
+  free(pcs);
+
+  qsort(ops, 32, sizeof(Count), compareCounts);
+  fprintf(out, "\nopcode mix:\n");
+  for (int i = 0; i < 32 && ops[i].count > 0; i++) {
+    fprintf(out, "%14llu %6.2f%%  %s\n", (unsigned long long)ops[i].count,
+            percent(ops[i].count, total), OpcodeString(ops[i].key));
+  }
+
+  // each address is counted against the first device it falls in, with one
+  // extra slot for addresses no device responds to
+  uint64_t *loads = calloc(bus->numDevices + 1, sizeof(uint64_t));
+  uint64_t *stores = calloc(bus->numDevices + 1, sizeof(uint64_t));
+  if (loads == NULL || stores == NULL) {
+    free(loads);
+    free(stores);
+    return;
+  }
+  for (int address = 0; address < 65536; address++) {
+    if (profile->loads[address] == 0 && profile->stores[address] == 0) {
+      continue;
+    }
+    int d;
+    for (d = 0; d < bus->numDevices; d++) {
+      const Device *device = &bus->busDevices[d];
+      if (address >= device->address &&
+          address < device->address + device->size) {
+        break;
+      }
+    }
+    loads[d] += profile->loads[address];
+    stores[d] += profile->stores[address];
+  }
+
+  fprintf(out, "\nmemory accesses:\n");
+  fprintf(out, "%14s %14s  %s\n", "loads", "stores", "device");
+  for (int d = 0; d <= bus->numDevices; d++) {
+    if (loads[d] == 0 && stores[d] == 0) {
+      continue;
+    }
+    fprintf(out, "%14llu %14llu  ", (unsigned long long)loads[d],
+            (unsigned long long)stores[d]);
+    if (d == bus->numDevices) {
+      fprintf(out, "unmapped\n");
+    } else {
+      const Device *device = &bus->busDevices[d];
+      fprintf(out, "%d at %04x-%04x\n", d, device->address,
+              device->address + device->size - 1);
+    }
+  }
+  free(loads);
+  free(stores);
+}
+
+void profileWriteStacks(FILE *out, const Profile *profile) {
+  const ProfileNode *nodes = profile->nodes;
+  int *path = malloc(profile->numNodes * sizeof(int));
+  if (path == NULL) {
+    return;
+  }
+  for (int n = 0; n < profile->numNodes; n++) {
+    if (nodes[n].cycles == 0) {
+      continue;
+    }
+    int depth = 0;
+    for (int p = n; p >= 0; p = nodes[p].parent) {
+      path[depth++] = p;
+    }
+    fprintf(out, "start");
+    for (int i = depth - 2; i >= 0; i--) {
+      fprintf(out, ";fn_%04x", nodes[path[i]].func);
+    }
+    fprintf(out, " %llu\n", (unsigned long long)nodes[n].cycles);
+  }
+  free(path);
+}
@@ -0,0 +1,79 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "bus.h"
+#include "inst.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// ProfileNode is one function in the call tree, identified by its address
+// and the path of calls that led to it.
+typedef struct ProfileNode {
+  uint16_t func;
+  // address the function returns to
+  uint16_t ret;
+  int parent;
+  int child;
+  int sibling;
+  // cycles spent in the function itself, not counting its callees
+  uint64_t cycles;
+} ProfileNode;
+
+// Profile counts where a program spends its time. When a CPU has a profile
+// attached, cpuRun switches to a variant of the run loop that fills it in,
+// which leaves the regular loop without any profiling code at all. Only the
+// counts that can't be worked out afterwards are kept while running: how
+// often each instruction ran, how often each if.* skipped, the loads and
+// stores to each address, and the call tree. The opcode mix and imm prefixes
+// are worked out from the instruction counts and the program.
+typedef struct Profile {
+  uint64_t counts[65536];
+  uint64_t skips[65536];
+  uint64_t loads[65536];
+  uint64_t stores[65536];
+
+  // the call tree, with node 0 being the program's entry point, and the
+  // node of the function currently running
+  ProfileNode *nodes;
+  int numNodes;
+  int capNodes;
+  int node;
+
+  // the cycle count the time spent in the current node is counted from
+  uint64_t lastCycles;
+} Profile;
+
+// profileCreate allocates an empty profile. Returns NULL if out of memory.
+Profile *profileCreate(void);
+
+// profileClear resets all the counts in the profile.
+void profileClear(Profile *profile);
+
+// profileDestroy frees the profile. profile can be NULL.
+void profileDestroy(Profile *profile);
+
+// profileCall records a call to target, which returns to ret, at the given
+// cycle count.
+void profileCall(Profile *profile, uint16_t target, uint16_t ret,
+                 uint64_t cycles);
+
+// profileJump records an indirect jump to target, which returns from the
+// current function if it's the function's return address.
+void profileJump(Profile *profile, uint16_t target, uint64_t cycles);
+
+// profileFlush counts the time spent in the current function up to the given
+// cycle count.
+void profileFlush(Profile *profile, uint64_t cycles);
+
+// profileReport writes a human readable report: the hottest instructions
+// with their disassembly, the opcode mix, and the loads and stores to each of
+// the devices on the bus.
+void profileReport(FILE *out, const Profile *profile, const Inst *prog,
+                   const IOBus *bus);
+
+// profileWriteStacks writes the call tree in the collapsed stack format used
+// by flamegraph tools, one line per call stack with its cycles.
+void profileWriteStacks(FILE *out, const Profile *profile);
+
+#endif
@@ -1,7 +1,20 @@
+#include "cpu.h"
+#include "debug.h"
 #include "emurj.h"
+#include "image.h"
+#include "iolog.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "profile.h"
+#include "trace.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef TEST_CC
+#include <sys/wait.h>
+#endif
 
 typedef struct testcase {
   const char *name;
@@ -9,6 +22,224 @@ typedef struct testcase {
   const uint16_t *prog;
 } testcase;
 
+// runStepped runs the program `step` cycles at a time, which with a step of 1
+// exercises stopping and resuming at every point, including between an imm
+// prefix and the instruction it was folded into. If jit isn't NULL, it's used
+// to run the program, and if trace isn't NULL, a binary trace is recorded in
+// it. Returns the error code, and the cycle count in *cycles.
+static int runStepped(const testcase *tc, Jit *jit, Trace *trace, int step,
+                      uint64_t *cycles) {
+  static CPU cpu;
+  uint16_t *ram = calloc(0x10000, sizeof(uint16_t));
+  Device devices[] = {
+      {.address = 0,
+       .size = 0xffff,
+       .handler = memoryHandler,
+       .context = ram,
+       .memory = ram},
+  };
+
+  cpuInit(&cpu, false);
+  cpuWriteProgMem(&cpu, tc->prog, tc->len);
+  cpuInitBusDevices(&cpu, devices, 1);
+  cpu.record = trace;
+  if (jit != NULL) {
+    jitInvalidate(jit);
+  }
+  for (int i = 0; i < 1000000 && !cpu.halt && !cpu.error; i += step) {
+    if (jit != NULL) {
+      jitRun(jit, &cpu, step);
+    } else {
+      cpuRun(&cpu, step);
+    }
+  }
+  free(ram);
+  cpuDestroy(&cpu);
+
+  *cycles = cpu.cycles;
+  if (cpu.error) {
+    return cpu.reg[1];
+  }
+  return cpu.halt ? 0 : 1;
+}
+
+// Ticker is a periodic event used to test the event queue, which checks
+// it's run at exactly the cycle it was scheduled for.
+typedef struct Ticker {
+  Emu *emu;
+  uint64_t period;
+  int ticks;
+  int late;
+} Ticker;
+
+static void tick(void *context, uint64_t cycle) {
+  Ticker *ticker = context;
+  ticker->ticks++;
+  if (emuCycles(ticker->emu) != cycle) {
+    ticker->late++;
+  }
+  eventSchedule(emuEvents(ticker->emu), cycle + ticker->period, tick, ticker);
+}
+
+// setFlag is an event that writes 1 to address 0x10 on the CPU's bus, which
+// the idle loop tests wait for.
+static void setFlag(void *context, uint64_t cycle) {
+  (void)cycle;
+  CPU *cpu = context;
+  ioBusWrite(&cpu->bus, 0x10, 1);
+}
+
+// inputHandler is a device that reads as a different pseudo-random number
+// each time, from the state in context.
+static bool inputHandler(void *context, Bus *bus, uint16_t address) {
+  (void)address;
+  uint32_t *state = context;
+  if (bus->WE) {
+    return false;
+  }
+  *state = *state * 1103515245 + 12345;
+  bus->data = *state >> 16;
+  return true;
+}
+
+// countHandler is a device that reads as 0, counting its reads in context.
+static bool countHandler(void *context, Bus *bus, uint16_t address) {
+  (void)address;
+  if (bus->WE) {
+    return false;
+  }
+  (*(int *)context)++;
+  bus->data = 0;
+  return true;
+}
+
+// runTriggered runs the program with a binary trace limited by the trigger,
+// and reads it back, checking every instruction in it passes the trigger's
+// pc filter and started on or after its start cycle. Returns the number of
+// instructions traced, or -1 if the run or the check fails.
+static int runTriggered(const uint16_t *prog, int len, const uint16_t *data,
+                        int dataLength, TraceTrigger *trigger) {
+  Emu *emu = emuCreate();
+  Trace *trace = traceCreate(1);
+  emuSetRecord(emu, trace);
+  emuSetTraceTrigger(emu, trigger);
+  emuLoad(emu, prog, len, data, dataLength);
+  int count = emuRun(emu, 1000000, false) == 0 ? 0 : -1;
+  emuDestroy(emu);
+
+  TraceReader *reader = malloc(sizeof(TraceReader));
+  if (!traceSave(trace, "test.trace") ||
+      !traceReaderOpen(reader, "test.trace")) {
+    count = -1;
+  }
+  traceClose(trace);
+  remove("test.trace");
+
+  Program *program = programCreate(prog, len);
+  TraceRecord record;
+  while (count >= 0 && traceRead(reader, &record)) {
+    if (record.flags & TRACE_KEY) {
+      traceApply(reader, NULL, &record);
+      continue;
+    }
+    Inst ir = traceInst(reader, program->inst, &record);
+    if (!traceTriggerHas(trigger, record.pc) ||
+        reader->state.cycles < trigger->startCycle) {
+      count = -1;
+    } else {
+      traceApply(reader, &ir, &record);
+      count++;
+    }
+  }
+  traceReaderClose(reader);
+  free(reader);
+  programRelease(program);
+  return count;
+}
+
+#ifdef TEST_CC
+// readAll appends the contents of the file name to out, which holds size
+// bytes including the terminating nul, and removes the file.
+static void readAll(const char *name, char *out, size_t size) {
+  FILE *f = fopen(name, "rb");
+  if (f != NULL) {
+    size_t length = strlen(out);
+    out[length + fread(out + length, 1, size - length - 1, f)] = '\0';
+    fclose(f);
+  }
+  remove(name);
+}
+
+// runTranslated translates the program to C with emurj2c, which has to be
+// built already, compiles it with TEST_CC, the compiler and flags the tests
+// were built with, and runs it. The C has the cycle limit built in. Returns
+// the exit code, with what the program printed to stdout followed by what it
+// printed to stderr in out, or -1 if it couldn't be translated, compiled or
+// run.
+static int runTranslated(const uint16_t *prog, int len, uint64_t maxCycles,
+                         char *out, size_t size) {
+  out[0] = '\0';
+  FILE *f = fopen("test2c.rom", "wb");
+  if (f == NULL) {
+    return -1;
+  }
+  bool ok = fwrite(prog, sizeof(uint16_t), len, f) == (size_t)len;
+  fclose(f);
+
+  char cmd[1024];
+  snprintf(cmd, sizeof(cmd),
+           "./emurj2c test2c.rom test2c.c %llu && " TEST_CC
+           " -I. -o test2c test2c.c bus.c",
+           (unsigned long long)maxCycles);
+  ok = ok && system(cmd) == 0;
+  // with a limit on CPU time, so one that never stops fails instead of
+  // hanging the tests
+  int status =
+      ok ? system("ulimit -t 10 && ./test2c > test2c.out 2> test2c.err") : -1;
+  readAll("test2c.out", out, size);
+  readAll("test2c.err", out, size);
+  remove("test2c.rom");
+  remove("test2c.c");
+  remove("test2c");
+  if (status == -1 || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+// checkTranslated runs the program with emurj2c and with the interpreter, for
+// at most maxCycles, and checks the exit codes and output are the same. The
+// interpreter's output includes the message when it runs out of cycles, the
+// same as the translated program's stderr.
+static bool checkTranslated(const uint16_t *prog, int len,
+                            uint64_t maxCycles) {
+  char want[256] = {0};
+  char got[256];
+  Emu *emu = emuCreate();
+  FILE *out = tmpfile();
+  int wantRet = -1;
+  if (out != NULL) {
+    emuSetOutput(emu, out);
+    emuLoad(emu, prog, len, NULL, 0);
+    wantRet = emuRun(emu, maxCycles, false) & 0xff;
+    emuSetOutput(emu, NULL);
+    rewind(out);
+    want[fread(want, 1, sizeof(want) - 1, out)] = '\0';
+    fclose(out);
+  }
+  emuDestroy(emu);
+
+  int ret = runTranslated(prog, len, maxCycles, got, sizeof(got));
+  if (ret != wantRet || strcmp(got, want) != 0) {
+    fprintf(stderr, "FAIL: %llu cycles: exit code %d, output \"%s\", "
+                    "instead of %d, \"%s\"\n",
+            (unsigned long long)maxCycles, ret, got, wantRet, want);
+    return false;
+  }
+  return true;
+}
+#endif
+
 int main() {
   // these tests came from using customasm on the rj32 tests
   const testcase tests[] = {
@@ -61,6 +292,10 @@ int main() {
                     0x4042, 0x3032, 0x106f, 0x0008, 0x20af, 0x0008, 0x30ef,
                     0x0008, 0x412f, 0x0008, 0x516f, 0x0008, 0x61af, 0x0008,
                     0x3032, 0x0025, 0x0008, 0x3036, 0x0025, 0x0008, 0x000c}},
+      {"imm chain", 7,
+       (uint16_t[]){0x000d, 0x123d, 0x1451, 0x003d, 0x116f, 0x0008, 0x000c}},
+      {"imm jump in", 6,
+       (uint16_t[]){0x0025, 0x07fd, 0x1051, 0x116f, 0x0008, 0x000c}},
       {"jump", 15,
        (uint16_t[]){0x0105, 0x0008, 0x0140, 0x0240, 0x00e5, 0x0008, 0x2021,
                     0xff45, 0x0008, 0x1031, 0xff65, 0x0008, 0x016f, 0x0008,
@@ -90,12 +325,72 @@ int main() {
        (uint16_t[]){0x1001, 0x2ff1, 0x127c, 0x0008, 0x1fff, 0x0008, 0x217c,
                     0x0025, 0x0008, 0x227c, 0x0025, 0x0008, 0x2fff, 0x0025,
                     0x0008, 0x103f, 0x0025, 0x0008, 0x000c}},
+      // 32 bit add and subtract with the carry, and byte and program memory
+      // loads and stores
+      {"addc", 19,
+       (uint16_t[]){0x1ff1, 0x2011, 0x3011, 0x4001, 0x1340, 0x2448, 0x102f,
+                    0x0008, 0x20af, 0x0008, 0x214b, 0x21ef, 0x0008, 0x1fcb,
+                    0x104b, 0x100b, 0x106f, 0x0008, 0x000c}},
+      {"subc", 18,
+       (uint16_t[]){0x1001, 0x2021, 0x3011, 0x1344, 0x200f, 0x1fef, 0x0008,
+                    0x206f, 0x0008, 0x204f, 0x204f, 0x2fef, 0x0008, 0x4051,
+                    0x434c, 0x40ef, 0x0008, 0x000c}},
+      {"loadb", 21,
+       (uint16_t[]){0x123d, 0x1341, 0x010d, 0x2001, 0x1206, 0x020d, 0x3001,
+                    0x430a, 0x003d, 0x4d2f, 0x0008, 0x431a, 0x44af, 0x0008,
+                    0x1801, 0x1216, 0x432a, 0x008d, 0x402f, 0x0008, 0x000c}},
+      {"storeb", 19,
+       (uint16_t[]){0x010d, 0x2001, 0x020d, 0x3001, 0x1121, 0x131e, 0x1341,
+                    0x130e, 0x4202, 0x123d, 0x4d2f, 0x0008, 0x1ff1, 0x130e,
+                    0x4202, 0x12fd, 0x4fef, 0x0008, 0x000c}},
+      {"loadc", 11,
+       (uint16_t[]){0x20a1, 0x121c, 0x123d, 0x1d2f, 0x0008, 0x2641, 0x121c,
+                    0x102f, 0x0008, 0x000c, 0x1234}},
   };
   int failed = 0;
   for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
     const testcase *tc = &tests[i];
     fprintf(stderr, "\n%2d: %s\n", i, tc->name);
-    int retval = runRj32Emu(1000000, tc->prog, tc->len, NULL, 0, true);
+    int retval = runRj32Emu(1000000, tc->prog, tc->len, NULL, 0, true,
+                            ENGINE_INTERPRETER);
+    if (retval) {
+      fprintf(stderr, "FAIL: %d\n", retval);
+      failed++;
+    } else {
+      fprintf(stderr, "PASS\n");
+    }
+  }
+
+  // run the tests again one cycle at a time, checking they take the same
+  // number of cycles as running them in one go
+  Emu *emu = emuCreate();
+  for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+    const testcase *tc = &tests[i];
+    fprintf(stderr, "\n%2d: %s (stepped)\n", i, tc->name);
+    emuLoad(emu, tc->prog, tc->len, NULL, 0);
+    emuRun(emu, 1000000, false);
+    uint64_t cycles;
+    int retval = runStepped(tc, NULL, NULL, 1, &cycles);
+    if (retval) {
+      fprintf(stderr, "FAIL: %d\n", retval);
+      failed++;
+    } else if (cycles != emuCycles(emu)) {
+      fprintf(stderr, "FAIL: took %llu cycles instead of %llu\n",
+              (unsigned long long)cycles,
+              (unsigned long long)emuCycles(emu));
+      failed++;
+    } else {
+      fprintf(stderr, "PASS\n");
+    }
+  }
+
+  // run the tests again in reverse through one reused emulator context, so
+  // each program is loaded over the leftovers of a longer one
+  for (int i = (int)(sizeof(tests) / sizeof(tests[0])) - 1; i >= 0; i--) {
+    const testcase *tc = &tests[i];
+    fprintf(stderr, "\n%2d: %s (reused context)\n", i, tc->name);
+    emuLoad(emu, tc->prog, tc->len, NULL, 0);
+    int retval = emuRun(emu, 1000000, false);
     if (retval) {
       fprintf(stderr, "FAIL: %d\n", retval);
       failed++;
@@ -103,6 +398,1113 @@ int main() {
       fprintf(stderr, "PASS\n");
     }
   }
+
+  // run the tests with the JIT, both in one go and a few cycles at a time so
+  // the cycle limit lands in the middle of blocks, checking they take the
+  // same number of cycles as the interpreter
+  Jit *jit = jitCreate();
+  Emu *jitEmu = emuCreate();
+  emuSetEngine(jitEmu, ENGINE_JIT);
+  for (int i = 0; jit != NULL && i < (int)(sizeof(tests) / sizeof(tests[0]));
+       i++) {
+    const testcase *tc = &tests[i];
+    fprintf(stderr, "\n%2d: %s (jit)\n", i, tc->name);
+    emuLoad(emu, tc->prog, tc->len, NULL, 0);
+    emuRun(emu, 1000000, false);
+    emuLoad(jitEmu, tc->prog, tc->len, NULL, 0);
+    int retval = emuRun(jitEmu, 1000000, false);
+    uint64_t cycles;
+    if (retval == 0) {
+      retval = runStepped(tc, jit, NULL, 3, &cycles);
+    }
+    if (retval) {
+      fprintf(stderr, "FAIL: %d\n", retval);
+      failed++;
+    } else if (emuCycles(jitEmu) != emuCycles(emu) ||
+               cycles != emuCycles(emu)) {
+      fprintf(stderr, "FAIL: took %llu and %llu cycles instead of %llu\n",
+              (unsigned long long)emuCycles(jitEmu),
+              (unsigned long long)cycles,
+              (unsigned long long)emuCycles(emu));
+      failed++;
+    } else {
+      fprintf(stderr, "PASS\n");
+    }
+  }
+  jitDestroy(jit);
+  emuDestroy(jitEmu);
+
+  // run the tests in lockstep, with a few copies of each so there's more than
+  // one lane running
+  for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+    const testcase *tc = &tests[i];
+    fprintf(stderr, "\n%2d: %s (lockstep)\n", i, tc->name);
+    emuLoad(emu, tc->prog, tc->len, NULL, 0);
+    emuRun(emu, 1000000, false);
+    int results[3];
+    uint64_t cycles[3];
+    int retval = runRj32Lockstep(1000000, tc->prog, tc->len, NULL, NULL, 3,
+                                 results, cycles);
+    if (retval) {
+      fprintf(stderr, "FAIL: %d\n", results[0]);
+      failed++;
+    } else if (cycles[0] != emuCycles(emu) || cycles[2] != emuCycles(emu)) {
+      fprintf(stderr, "FAIL: took %llu cycles instead of %llu\n",
+              (unsigned long long)cycles[0],
+              (unsigned long long)emuCycles(emu));
+      failed++;
+    } else {
+      fprintf(stderr, "PASS\n");
+    }
+  }
+
+  // run the tests with profiling, checking the time spent in each function
+  // adds up to the same number of cycles as running without it
+  Profile *profile = profileCreate();
+  for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+    const testcase *tc = &tests[i];
+    fprintf(stderr, "\n%2d: %s (profile)\n", i, tc->name);
+    emuLoad(emu, tc->prog, tc->len, NULL, 0);
+    emuRun(emu, 1000000, false);
+    uint64_t cycles = emuCycles(emu);
+
+    profileClear(profile);
+    emuSetProfile(emu, profile);
+    emuLoad(emu, tc->prog, tc->len, NULL, 0);
+    int retval = emuRun(emu, 1000000, false);
+    emuSetProfile(emu, NULL);
+    uint64_t profiled = 0;
+    for (int n = 0; n < profile->numNodes; n++) {
+      profiled += profile->nodes[n].cycles;
+    }
+    if (retval) {
+      fprintf(stderr, "FAIL: %d\n", retval);
+      failed++;
+    } else if (profiled != cycles || emuCycles(emu) != cycles) {
+      fprintf(stderr, "FAIL: profiled %llu cycles instead of %llu\n",
+              (unsigned long long)profiled, (unsigned long long)cycles);
+      failed++;
+    } else {
+      fprintf(stderr, "PASS\n");
+    }
+  }
+  profileDestroy(profile);
+
+  // record a binary trace of the tests, both in one go and one cycle at a
+  // time, and check replaying it ends at the halt with the same cycle count
+  TraceReader *reader = malloc(sizeof(TraceReader));
+  for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+    const testcase *tc = &tests[i];
+    fprintf(stderr, "\n%2d: %s (trace)\n", i, tc->name);
+    Program *prog = programCreate(tc->prog, tc->len);
+    const int steps[] = {1, 1000000};
+    int retval = 0;
+    for (int j = 0; retval == 0 && j < 2; j++) {
+      Trace *trace = traceCreate(1);
+      uint64_t cycles;
+      retval = runStepped(tc, NULL, trace, steps[j], &cycles);
+      if (!traceSave(trace, "test.trace") ||
+          !traceReaderOpen(reader, "test.trace")) {
+        retval = -1;
+      }
+      traceClose(trace);
+      remove("test.trace");
+
+      TraceRecord record;
+      Inst ir = {0};
+      while (retval == 0 && traceRead(reader, &record)) {
+        if (record.flags & TRACE_KEY) {
+          traceApply(reader, NULL, &record);
+        } else {
+          ir = traceInst(reader, prog->inst, &record);
+          traceApply(reader, &ir, &record);
+        }
+      }
+      traceReaderClose(reader);
+      if (retval == 0 && (ir.op != HALT || reader->state.cycles != cycles)) {
+        fprintf(stderr, "FAIL: replayed %llu cycles instead of %llu\n",
+                (unsigned long long)reader->state.cycles,
+                (unsigned long long)cycles);
+        retval = -1;
+      }
+    }
+    programRelease(prog);
+    if (retval) {
+      fprintf(stderr, "FAIL: %d\n", retval);
+      failed++;
+    } else {
+      fprintf(stderr, "PASS\n");
+    }
+  }
+  free(reader);
+
+#ifdef TEST_CC
+  // translate the tests to C with emurj2c, and check they exit the same way
+  for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+    const testcase *tc = &tests[i];
+    fprintf(stderr, "\n%2d: %s (emurj2c)\n", i, tc->name);
+    if (checkTranslated(tc->prog, tc->len, 1000000)) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      failed++;
+    }
+  }
+#endif
+
+  // sum 1..n with a different n for each instance, so the lanes diverge, and
+  // check the sum against the expected one, which is wrong for some of them.
+  // The ones with a large n run out of cycles.
+  fprintf(stderr, "\n   divergent (lockstep)\n");
+  {
+    // load a0, [ra, 0]; load a2, [ra, 1]; move a1, 0
+    // loop: if.eq a0, 0; jump done; add a1, a0; sub a0, 1; jump loop
+    // done: if.eq a1, a2; halt; move a0, 1; error
+    const uint16_t prog[] = {0x1002, 0x3012, 0x2001, 0x102b, 0x0065, 0x2140,
+                             0x1047, 0xff65, 0x2368, 0x000c, 0x1011, 0x0008};
+    enum { COUNT = 2 * LOCKSTEP_LANES + 3 };
+    uint16_t data[COUNT][2];
+    const uint16_t *dataMems[COUNT];
+    int dataLengths[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+      data[i][0] = i * 29;
+      data[i][1] = data[i][0] * (data[i][0] + 1) / 2 + (i % 5 == 0);
+      dataMems[i] = data[i];
+      dataLengths[i] = 2;
+    }
+    int results[COUNT];
+    uint64_t cycles[COUNT];
+    runRj32Lockstep(3000, prog, sizeof(prog) / sizeof(prog[0]), dataMems,
+                    dataLengths, COUNT, results, cycles);
+    int mismatched = 0;
+    for (int i = 0; i < COUNT; i++) {
+      emuLoad(emu, prog, sizeof(prog) / sizeof(prog[0]), data[i], 2);
+      int retval = emuRun(emu, 3000, false);
+      if (retval != results[i] || emuCycles(emu) != cycles[i]) {
+        fprintf(stderr, "FAIL: instance %d returned %d after %llu cycles "
+                        "instead of %d after %llu\n",
+                i, results[i], (unsigned long long)cycles[i], retval,
+                (unsigned long long)emuCycles(emu));
+        mismatched++;
+      }
+    }
+    if (mismatched) {
+      failed++;
+    } else {
+      fprintf(stderr, "PASS\n");
+    }
+
+    // run a few of the same instances on emulators that all share one copy
+    // of the program, which outlives the reference used to load them
+    fprintf(stderr, "\n   shared program\n");
+    Program *shared = programCreate(prog, sizeof(prog) / sizeof(prog[0]));
+    Emu *emus[4];
+    for (int i = 0; i < 4; i++) {
+      emus[i] = emuCreate();
+      emuLoadProgram(emus[i], shared, data[i], 2);
+    }
+    programRelease(shared);
+    mismatched = 0;
+    for (int i = 0; i < 4; i++) {
+      int retval = emuRun(emus[i], 3000, false);
+      if (retval != results[i] || emuCycles(emus[i]) != cycles[i]) {
+        fprintf(stderr, "FAIL: instance %d returned %d instead of %d\n", i,
+                retval, results[i]);
+        mismatched++;
+      }
+      emuDestroy(emus[i]);
+    }
+    if (mismatched) {
+      failed++;
+    } else {
+      fprintf(stderr, "PASS\n");
+    }
+  }
+  emuDestroy(emu);
+
+  // reset after a snapshot clears everything written since the program was
+  // loaded, and restoring the snapshot afterwards brings it all back
+  fprintf(stderr, "\n   reset after snapshot\n");
+  {
+    // move a0, 0x56; store [ra, 0], a0; halt
+    const uint16_t prog[] = {0x1561, 0x1006, 0x000c};
+    const uint16_t data[] = {0x1234};
+    Emu *emu = emuCreate();
+    CPU *cpu = emuCpu(emu);
+    emuLoad(emu, prog, 3, data, 1);
+    uint16_t *memory = cpu->bus.memoryPages[0];
+    Snapshot *snap = cpuSnapshot(cpu);
+    emuReset(emu);
+    bool ok = memory[0] == 0;
+
+    ok = ok && emuRun(emu, 100, false) == 0 && memory[0] == 0x56;
+    emuReset(emu);
+    cpuRestore(cpu, snap);
+    ok = ok && memory[0] == 0x1234;
+    emuReset(emu);
+    ok = ok && memory[0] == 0;
+
+    snapshotRelease(snap);
+    emuDestroy(emu);
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // increment a word on two different pages from a snapshot, then restore and
+  // fork it, and check only the right memory changes each time
+  fprintf(stderr, "\n   snapshots\n");
+  {
+    // load a0, [ra, 0]; add a0, 1; store [ra, 0], a0; move a1, 0x300
+    // store [a1, 0], a0; halt
+    const uint16_t prog[] = {0x1002, 0x1043, 0x1006, 0x030d,
+                             0x201b, 0x1206, 0x000c};
+    const uint16_t data[] = {5};
+    CPU *cpus[2];
+    uint16_t *rams[2];
+    Device devices[2];
+    for (int i = 0; i < 2; i++) {
+      cpus[i] = malloc(sizeof(CPU));
+      rams[i] = calloc(0x10000, sizeof(uint16_t));
+      devices[i] = (Device){.address = 0,
+                            .size = 0xffff,
+                            .handler = memoryHandler,
+                            .context = rams[i],
+                            .memory = rams[i]};
+      cpuInit(cpus[i], false);
+      cpuWriteProgMem(cpus[i], prog, sizeof(prog) / sizeof(prog[0]));
+      cpuInitBusDevices(cpus[i], &devices[i], 1);
+    }
+    CPU *parent = cpus[0];
+    CPU *child = cpus[1];
+    uint16_t *mem = rams[0];
+    uint16_t *childMem = rams[1];
+
+    cpuWriteDataMem(parent, data, 1);
+    Snapshot *snap = cpuSnapshot(parent);
+    cpuRun(parent, 100);
+    uint64_t cycles = parent->cycles;
+    bool ok = parent->halt && mem[0] == 6 && mem[0x300] == 6;
+
+    cpuRestore(parent, snap);
+    ok = ok && !parent->halt && parent->cycles == 0 && mem[0] == 5 &&
+         mem[0x300] == 0;
+
+    ok = ok && cpuFork(child, parent);
+    cpuRun(child, 100);
+    ok = ok && child->halt && child->cycles == cycles && childMem[0] == 6 &&
+         childMem[0x300] == 6 && mem[0] == 5 && mem[0x300] == 0;
+
+    cpuRun(parent, 100);
+    ok = ok && parent->halt && mem[0] == 6 && mem[0x300] == 6;
+
+    ok = ok && snapshotSave(snap, "test.snapshot");
+    Snapshot *loaded = snapshotLoad("test.snapshot");
+    remove("test.snapshot");
+    ok = ok && loaded != NULL;
+    if (loaded != NULL) {
+      cpuRestore(child, loaded);
+      cpuRun(child, 100);
+      ok = ok && child->halt && child->cycles == cycles &&
+           childMem[0] == 6 && childMem[0x300] == 6;
+      cpuRestore(child, loaded);
+      ok = ok && childMem[0] == 5 && childMem[0x300] == 0;
+    }
+    snapshotRelease(loaded);
+    snapshotRelease(snap);
+
+    for (int i = 0; i < 2; i++) {
+      cpuDestroy(cpus[i]);
+      free(cpus[i]);
+      free(rams[i]);
+    }
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // trace only part of a run with a trigger, and check only the part of it
+  // that meets the trigger's conditions is traced
+  fprintf(stderr, "\n   trace triggers\n");
+  {
+    // the sum loop from the divergent test, traced only in the loop from
+    // cycle 20, which is 10 iterations of 4 cycles starting at cycle 3, and
+    // then an if.eq and jump out of it, so 25 instructions
+    const uint16_t sum[] = {0x1002, 0x3012, 0x2001, 0x102b, 0x0065, 0x2140,
+                            0x1047, 0xff65, 0x2368, 0x000c, 0x1011, 0x0008};
+    const uint16_t sumData[] = {10, 55};
+    TraceTrigger *trigger = malloc(sizeof(TraceTrigger));
+    traceTriggerInit(trigger);
+    trigger->startCycle = 20;
+    traceTriggerAddRange(trigger, 3, 7);
+    int loop = runTriggered(sum, 12, sumData, 2, trigger);
+
+    // the snapshot test's program, traced from its first store, which is
+    // followed by a move with an imm prefix, a store and the halt
+    const uint16_t stores[] = {0x1002, 0x1043, 0x1006, 0x030d,
+                               0x201b, 0x1206, 0x000c};
+    const uint16_t storesData[] = {5};
+    traceTriggerInit(trigger);
+    trigger->storeTrigger = true;
+    trigger->storeAddress = 0;
+    int stored = runTriggered(stores, 7, storesData, 1, trigger);
+    free(trigger);
+
+    if (loop == 25 && stored == 3) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL: traced %d and %d instructions\n", loop, stored);
+      failed++;
+    }
+  }
+
+  // print to the console device into memory, checking \r is translated and
+  // nothing is written until the newline or the halt
+  fprintf(stderr, "\n   console\n");
+  {
+    // move a1, 0xff00; move a0, 'h'; store [a1, 0], a0; move a0, '\r'
+    // store [a1, 0], a0; move a0, '\n'; store [a1, 0], a0; move a0, 'i'
+    // store [a1, 0], a0; halt
+    const uint16_t prog[] = {0xff0d, 0x2001, 0x1681, 0x1206, 0x10d1, 0x1206,
+                             0x10a1, 0x1206, 0x1691, 0x1206, 0x000c};
+    Emu *emu = emuCreate();
+    ConsoleMemory memory = {0};
+    consoleSetSink(emuConsole(emu), consoleMemorySink, &memory);
+    emuLoad(emu, prog, sizeof(prog) / sizeof(prog[0]), NULL, 0);
+    emuRun(emu, 6, false);
+    bool ok = memory.length == 0;
+    emuRun(emu, 2, false);
+    ok = ok && memory.length == 4 && memcmp(memory.data, "h\033D\n", 4) == 0;
+    int retval = emuRun(emu, 100, false);
+    ok = ok && retval == 0 && memory.length == 5 && memory.data[4] == 'i';
+
+    consoleSetSink(emuConsole(emu), consoleDiscardSink, NULL);
+    emuLoad(emu, prog, sizeof(prog) / sizeof(prog[0]), NULL, 0);
+    ok = ok && emuRun(emu, 100, false) == 0 && memory.length == 5;
+    emuDestroy(emu);
+    free(memory.data);
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // run a loop with a couple of periodic events, which split the run into
+  // many short ones, with both engines, checking each event runs on time and
+  // the program takes the same number of cycles as without them
+  fprintf(stderr, "\n   events\n");
+  {
+    // the sum loop from the divergent test, summing 1..100
+    const uint16_t prog[] = {0x1002, 0x3012, 0x2001, 0x102b, 0x0065, 0x2140,
+                             0x1047, 0xff65, 0x2368, 0x000c, 0x1011, 0x0008};
+    const uint16_t data[] = {100, 5050};
+    const int len = sizeof(prog) / sizeof(prog[0]);
+    Emu *emu = emuCreate();
+    emuLoad(emu, prog, len, data, 2);
+    bool ok = emuRun(emu, 1000000, false) == 0;
+    uint64_t cycles = emuCycles(emu);
+
+    for (int engine = 0; engine < 2; engine++) {
+      emuSetEngine(emu, engine ? ENGINE_JIT : ENGINE_INTERPRETER);
+      Ticker tickers[2] = {{emu, 7}, {emu, 30}};
+      emuLoad(emu, prog, len, data, 2);
+      for (int i = 0; i < 2; i++) {
+        eventSchedule(emuEvents(emu), tickers[i].period, tick, &tickers[i]);
+      }
+      // cancelling an event that was never scheduled does nothing
+      eventCancel(emuEvents(emu), tick, NULL);
+      int retval = emuRun(emu, 1000000, false);
+      ok = ok && retval == 0 && emuCycles(emu) == cycles;
+      // the events at the last cycle run before the halt
+      for (int i = 0; i < 2; i++) {
+        ok = ok && tickers[i].late == 0 &&
+             tickers[i].ticks == (int)(cycles / tickers[i].period);
+      }
+    }
+    emuDestroy(emu);
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // count timer interrupts in a handler until there have been 5, with both
+  // engines, stepping a cycle at a time and in lockstep, checking they're all
+  // taken at the same points
+  fprintf(stderr, "\n   interrupts\n");
+  {
+    // move a0, handler; wcsr vector, a0; move a0, 50; wcsr timer, a0
+    // move a0, 1; wcsr status, a0; move a1, 0
+    // loop: if.ult a1, 5; jump loop; halt
+    // handler: add a1, 1; rets
+    const uint16_t prog[] = {0x10a1, 0x1114, 0x1321, 0x3114, 0x1011, 0x0114,
+                             0x2001, 0x217b, 0xffc5, 0x000c, 0x2043, 0x0004};
+    const int len = sizeof(prog) / sizeof(prog[0]);
+    uint64_t cycles[6];
+    bool ok = true;
+
+    Emu *emu = emuCreate();
+    for (int engine = 0; engine < 2; engine++) {
+      emuSetEngine(emu, engine ? ENGINE_JIT : ENGINE_INTERPRETER);
+      emuLoad(emu, prog, len, NULL, 0);
+      ok = ok && emuRun(emu, 1000000, false) == 0;
+      cycles[engine] = emuCycles(emu);
+    }
+    emuDestroy(emu);
+
+    CPU *cpu = malloc(sizeof(CPU));
+    uint16_t *ram = calloc(0x10000, sizeof(uint16_t));
+    Device device = {.address = 0,
+                     .size = 0xffff,
+                     .handler = memoryHandler,
+                     .context = ram,
+                     .memory = ram};
+    EventQueue events;
+    eventQueueInit(&events);
+    for (int i = 0; i < 2; i++) {
+      int step = i ? 7 : 1;
+      cpuInit(cpu, false);
+      cpu->events = &events;
+      cpuWriteProgMem(cpu, prog, len);
+      cpuInitBusDevices(cpu, &device, 1);
+      for (int j = 0; j < 1000000 && !cpu->halt && !cpu->error; j += step) {
+        cpuRun(cpu, step);
+      }
+      ok = ok && cpu->halt && cpu->reg[2] == 5 &&
+           cpu->csr[CSR_STATUS] == CSR_STATUS_IE;
+      cycles[2 + i] = cpu->cycles;
+      cpuReset(cpu);
+      cpuDestroy(cpu);
+      ok = ok && events.count == 0;
+    }
+    eventQueueDestroy(&events);
+    free(ram);
+    free(cpu);
+
+    int results[2];
+    ok = ok && runRj32Lockstep(1000000, prog, len, NULL, NULL, 2, results,
+                               cycles + 4) == 0;
+
+    // the timer starts at cycle 4, so the fifth interrupt comes at cycle 254,
+    // and then the handler returns to the if.ult, which skips to the halt
+    ok = ok && cycles[0] == 258;
+    for (int i = 1; i < 6; i++) {
+      ok = ok && cycles[i] == cycles[0];
+    }
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL: took %llu, %llu, %llu, %llu, %llu and %llu "
+                      "cycles\n",
+              (unsigned long long)cycles[0], (unsigned long long)cycles[1],
+              (unsigned long long)cycles[2], (unsigned long long)cycles[3],
+              (unsigned long long)cycles[4], (unsigned long long)cycles[5]);
+      failed++;
+    }
+  }
+
+  // write an image with its data in the data bank and an entry point past an
+  // error, run it, and check a corrupted image and a raw ROM are handled, and
+  // that the raw ROM's data is loaded at 0 instead of the data bank
+  fprintf(stderr, "\n   images\n");
+  {
+    // error; start: move a1, 0x8000; load a0, [a1, 1]; if.ne a0, 42; error
+    // halt
+    const uint16_t prog[] = {0x0008, 0x800d, 0x2001, 0x1212,
+                             0x002d, 0x1aaf, 0x0008, 0x000c};
+    const uint16_t data[] = {7, 42};
+    ImageSection sections[] = {
+        {.kind = IMAGE_CODE, .length = sizeof(prog) / sizeof(prog[0])},
+        {.kind = IMAGE_DATA, .address = IMAGE_DATA_ADDRESS, .length = 2},
+    };
+    const uint16_t *contents[] = {prog, data};
+    ImageSymbol symbols[] = {{.kind = IMAGE_CODE, .address = 1}};
+    strcpy(symbols[0].name, "start");
+    bool ok = imageWrite("test.img", 1, sections, contents, 2, symbols, 1);
+
+    Image image;
+    Emu *emu = emuCreate();
+    ok = ok && imageOpen(&image, "test.img");
+    if (ok) {
+      const ImageSymbol *start = imageFindSymbol(&image, "start");
+      ok = start != NULL && start->address == image.entry &&
+           imageFindSymbol(&image, "end") == NULL;
+      // starting at 0 would run the error instead, which takes no cycles
+      ok = ok && emuLoadImage(emu, &image) && emuRun(emu, 100, false) == 0 &&
+           emuCycles(emu) > 0;
+      ok = ok && ioBusRead(&emuCpu(emu)->bus, IMAGE_DATA_ADDRESS + 1) == 42 &&
+           ioBusRead(&emuCpu(emu)->bus, 1) == 0;
+      imageClose(&image);
+    }
+
+    // flip a bit in the data, which the checksum has to catch
+    FILE *f = fopen("test.img", "r+b");
+    ok = ok && f != NULL && fseek(f, -1, SEEK_END) == 0 &&
+         fputc(42 ^ 1, f) != EOF;
+    if (f != NULL) {
+      fclose(f);
+    }
+    ok = ok && imageOpen(&image, "test.img");
+    if (ok) {
+      ok = !imageVerify(&image);
+      imageClose(&image);
+    }
+    remove("test.img");
+
+    // a raw ROM with data after the program memory loads it at 0
+    uint16_t *rom = calloc(0x10002, sizeof(uint16_t));
+    memcpy(rom, prog, sizeof(prog));
+    rom[0x10000] = 3;
+    f = fopen("test.rom", "wb");
+    ok = ok && f != NULL &&
+         fwrite(rom, sizeof(uint16_t), 0x10002, f) == 0x10002;
+    if (f != NULL) {
+      fclose(f);
+    }
+    ok = ok && imageOpen(&image, "test.rom");
+    remove("test.rom");
+    if (ok) {
+      ok = image.numSections == 2 && image.entry == 0 &&
+           image.sections[0].length == 0x10000 &&
+           image.sections[1].address == 0 &&
+           image.sections[1].length == 2 &&
+           imageWords(&image, &image.sections[1])[0] == 3;
+      // there's no entry point, so the error at 0 is run straight away
+      ok = ok && emuLoadImage(emu, &image) && emuRun(emu, 100, false) == 0 &&
+           emuCycles(emu) == 0;
+      ok = ok && ioBusRead(&emuCpu(emu)->bus, 0) == 3 &&
+           ioBusRead(&emuCpu(emu)->bus, IMAGE_DATA_ADDRESS) == 0;
+      imageClose(&image);
+    }
+    free(rom);
+    emuDestroy(emu);
+
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // load an image whose data covers two whole pages and part of a third, and
+  // check the whole pages are read from the image until they're written
+  fprintf(stderr, "\n   image pages\n");
+  {
+    // move a1, 0x8000; move a0, 5; store [a1, 1], a0; halt
+    const uint16_t prog[] = {0x800d, 0x2001, 0x1051, 0x1216, 0x000c};
+    uint16_t *data = malloc(0x280 * sizeof(uint16_t));
+    for (int i = 0; i < 0x280; i++) {
+      data[i] = i + 1;
+    }
+    ImageSection sections[] = {
+        {.kind = IMAGE_CODE, .length = sizeof(prog) / sizeof(prog[0])},
+        {.kind = IMAGE_DATA, .address = IMAGE_DATA_ADDRESS, .length = 0x280},
+    };
+    const uint16_t *contents[] = {prog, data};
+    bool ok = imageWrite("test.img", 0, sections, contents, 2, NULL, 0);
+
+    Image image;
+    Emu *emu = emuCreate();
+    IOBus *bus = &emuCpu(emu)->bus;
+    ok = ok && imageOpen(&image, "test.img") && imageVerify(&image);
+    remove("test.img");
+    if (ok) {
+      const uint16_t *words = imageWords(&image, &image.sections[1]);
+      ok = emuLoadImage(emu, &image) && bus->sharedPages[0x80] == words &&
+           bus->sharedPages[0x81] == words + 0x100 &&
+           bus->sharedPages[0x82] == NULL && ioBusRead(bus, 0x8000) == 1 &&
+           ioBusRead(bus, 0x8200) == 0x201;
+
+      // the store copies its page, and leaves the image as it is
+      Snapshot *snap = cpuSnapshot(emuCpu(emu));
+      ok = ok && emuRun(emu, 100, false) == 0 &&
+           bus->sharedPages[0x80] == NULL && bus->sharedPages[0x81] != NULL &&
+           ioBusRead(bus, 0x8001) == 5 && ioBusRead(bus, 0x8002) == 3 &&
+           words[1] == 2;
+
+      // a snapshot taken before then has the page as it was in the image
+      cpuRestore(emuCpu(emu), snap);
+      ok = ok && ioBusRead(bus, 0x8001) == 2 && ioBusRead(bus, 0x8101) == 0x102;
+      snapshotRelease(snap);
+
+      emuReset(emu);
+      ok = ok && bus->sharedPages[0x81] == NULL &&
+           ioBusRead(bus, 0x8001) == 0 && ioBusRead(bus, 0x8100) == 0;
+      imageClose(&image);
+    }
+    emuDestroy(emu);
+    free(data);
+
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // stop at a breakpoint in a loop each time around it, step over an
+  // instruction with an imm prefix, and check the program still takes the
+  // same number of cycles, then do the same with a script
+  fprintf(stderr, "\n   debugger\n");
+  {
+    // move a0, 0; loop: add a0, 1; if.ult a0, 5; jump loop
+    // move a1, 0x1234; halt
+    const uint16_t prog[] = {0x1001, 0x1043, 0x117b, 0xffa5,
+                             0x123d, 0x2041, 0x000c};
+    const int len = sizeof(prog) / sizeof(prog[0]);
+    Emu *emu = emuCreate();
+    emuLoad(emu, prog, len, NULL, 0);
+    bool ok = emuRun(emu, 1000, false) == 0;
+    uint64_t cycles = emuCycles(emu);
+
+    Debugger *dbg = malloc(sizeof(Debugger));
+    CPU *cpu = emuCpu(emu);
+    emuLoad(emu, prog, len, NULL, 0);
+    debuggerInit(dbg, cpu, 1000);
+    debuggerSetBreakpoint(dbg, 1, true);
+    for (int i = 0; i < 3; i++) {
+      debuggerContinue(dbg);
+      ok = ok && cpu->breakHit && cpu->pc == 1 && cpu->reg[1] == i;
+    }
+    debuggerSetBreakpoint(dbg, 1, false);
+    debuggerSetBreakpoint(dbg, 4, true);
+    debuggerContinue(dbg);
+    ok = ok && cpu->breakHit && cpu->pc == 4 && cpu->reg[1] == 5;
+    debuggerStep(dbg);
+    ok = ok && cpu->pc == 6 && cpu->reg[2] == 0x1234 && !cpu->immValid;
+    debuggerContinue(dbg);
+    ok = ok && cpu->halt && cpu->cycles == cycles;
+
+    FILE *in = tmpfile();
+    FILE *out = tmpfile();
+    char text[256] = {0};
+    if (in != NULL && out != NULL) {
+      emuLoad(emu, prog, len, NULL, 0);
+      debuggerInit(dbg, cpu, 1000);
+      // the console's page is shown as a device from 0xff00
+      fputs("b 4\nc\nx fefe 4\nq\n", in);
+      rewind(in);
+      ok = ok && debuggerRun(dbg, in, out, false) == 1;
+      rewind(out);
+      fread(text, 1, sizeof(text) - 1, out);
+    }
+    ok = ok && strstr(text, "breakpoint at 0004") != NULL &&
+         strstr(text, "fefe: 0000 0000 ---- ----\n") != NULL &&
+         cpu->reg[1] == 5;
+    if (in != NULL) {
+      fclose(in);
+    }
+    if (out != NULL) {
+      fclose(out);
+    }
+    free(dbg);
+    emuDestroy(emu);
+
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // stop after a write and a read of watched addresses, and check the
+  // watched page is the only one left unmapped
+  fprintf(stderr, "\n   watchpoints\n");
+  {
+    // move a1, 0x10; move a0, 7; store [a1, 0], a0; store [a1, 1], a0
+    // load a2, [a1, 2]; move s0, 0x300; store [s0, 0], a0; halt
+    const uint16_t prog[] = {0x2101, 0x1071, 0x1206, 0x1216, 0x3222,
+                             0x030d, 0x4001, 0x1406, 0x000c};
+    const int len = sizeof(prog) / sizeof(prog[0]);
+    Emu *emu = emuCreate();
+    emuLoad(emu, prog, len, NULL, 0);
+    bool ok = emuRun(emu, 1000, false) == 0;
+    uint64_t cycles = emuCycles(emu);
+
+    Debugger *dbg = malloc(sizeof(Debugger));
+    CPU *cpu = emuCpu(emu);
+    IOBus *bus = &cpu->bus;
+    emuLoad(emu, prog, len, NULL, 0);
+    debuggerInit(dbg, cpu, 1000);
+    debuggerSetWatchpoint(dbg, 0x11, false, true);
+    debuggerSetWatchpoint(dbg, 0x12, true, false);
+    ok = ok && dbg->numWatchpoints == 2 && bus->readPages[0] == NULL;
+
+    debuggerContinue(dbg);
+    ok = ok && cpu->breakHit && bus->watchHit && bus->watchWrite &&
+         bus->watchAddress == 0x11 && cpu->pc == 4 &&
+         ioBusRead(bus, 0x11) == 7;
+    debuggerContinue(dbg);
+    ok = ok && cpu->breakHit && bus->watchHit && !bus->watchWrite &&
+         bus->watchAddress == 0x12 && cpu->pc == 5;
+    debuggerContinue(dbg);
+    ok = ok && cpu->halt && cpu->cycles == cycles && !bus->watchHit &&
+         bus->writePages[0] == NULL && bus->writePages[3] != NULL;
+
+    debuggerSetWatchpoint(dbg, 0x11, false, false);
+    debuggerSetWatchpoint(dbg, 0x12, false, false);
+    ok = ok && dbg->numWatchpoints == 0 && bus->watch == NULL &&
+         bus->readPages[0] != NULL;
+    free(dbg);
+    emuDestroy(emu);
+
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // wait in an idle loop for an event to set a flag, which is skipped over
+  // in the interpreter but not by the JIT or when stepping, checking they
+  // all finish at the same cycle
+  fprintf(stderr, "\n   idle loops\n");
+  {
+    // move a1, 0x10; loop: load a0, [a1, 0]; if.eq a0, 0; jump loop; halt
+    const uint16_t prog[] = {0x2101, 0x1202, 0x102b, 0xffa5, 0x000c};
+    // loop: add a0, 1; jump loop; jump self
+    const uint16_t busy[] = {0x1043, 0xffc5, 0xffe5};
+    const int len = sizeof(prog) / sizeof(prog[0]);
+    Inst decoded[5];
+    decodeProgram(decoded, prog, len);
+    bool ok = decoded[3].idle && !decoded[4].idle;
+    decodeProgram(decoded, busy, 3);
+    ok = ok && !decoded[1].idle && decoded[2].idle;
+
+    // the event comes as the load is about to run, so it sees the flag
+    const uint64_t events[] = {1000, 1000000000};
+    Emu *emu = emuCreate();
+    for (int i = 0; i < 2; i++) {
+      for (int mode = 0; mode < 3; mode++) {
+        // without skipping, the longer wait would take too long
+        if (i > 0 && mode > 0) {
+          break;
+        }
+        emuSetEngine(emu, mode == 1 ? ENGINE_JIT : ENGINE_INTERPRETER);
+        emuLoad(emu, prog, len, NULL, 0);
+        eventSchedule(emuEvents(emu), events[i], setFlag, emuCpu(emu));
+        if (mode < 2) {
+          ok = ok && emuRun(emu, 2000000000, false) == 0;
+        }
+        CPU *cpu = emuCpu(emu);
+        while (!cpu->halt && !cpu->error && cpu->cycles < events[i] * 2) {
+          cpuRun(cpu, 7);
+        }
+        ok = ok && cpu->halt && emuCycles(emu) == events[i] + 2;
+      }
+    }
+    emuSetEngine(emu, ENGINE_INTERPRETER);
+
+    // a loop that never finishes runs to exactly the cycle limit
+    emuLoad(emu, busy + 2, 1, NULL, 0);
+    cpuRun(emuCpu(emu), 1234567);
+    ok = ok && emuCycles(emu) == 1234567;
+    emuDestroy(emu);
+
+    // polling a device isn't skipped, since each read can be different
+    // move a1, 0xfe00; loop: load a0, [a1, 0]; if.eq a0, 0; jump loop; halt
+    const uint16_t poll[] = {0xfe0d, 0x2001, 0x1202, 0x102b, 0xffa5, 0x000c};
+    CPU *cpu = malloc(sizeof(CPU));
+    uint16_t *ram = calloc(0x10000, sizeof(uint16_t));
+    int reads = 0;
+    Device devices[] = {
+        {.address = 0xfe00,
+         .size = 1,
+         .handler = countHandler,
+         .context = &reads},
+        {.address = 0,
+         .size = 0xffff,
+         .handler = memoryHandler,
+         .context = ram,
+         .memory = ram},
+    };
+    cpuInit(cpu, false);
+    cpuWriteProgMem(cpu, poll, sizeof(poll) / sizeof(poll[0]));
+    cpuInitBusDevices(cpu, devices, 2);
+    ok = ok && cpu->prog->inst[4].idle;
+    cpuRun(cpu, 3002);
+    ok = ok && reads == 1000 && cpu->cycles == 3002 && !cpu->idle;
+    cpuDestroy(cpu);
+    free(ram);
+    free(cpu);
+
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // step through programs in slices with both engines, checking they finish
+  // at the same cycle as running them in one go, and that a program waiting
+  // for an event says so
+  fprintf(stderr, "\n   time slices\n");
+  {
+    // the sum of 1 to 100 from the events test
+    const uint16_t prog[] = {0x1002, 0x3012, 0x2001, 0x102b, 0x0065, 0x2140,
+                             0x1047, 0xff65, 0x2368, 0x000c, 0x1011, 0x0008};
+    const uint16_t data[] = {100, 5050};
+    const int len = sizeof(prog) / sizeof(prog[0]);
+    // move a1, 0x10; loop: load a0, [a1, 0]; if.eq a0, 0; jump loop; halt
+    const uint16_t wait[] = {0x2101, 0x1202, 0x102b, 0xffa5, 0x000c};
+    // jump self
+    const uint16_t spin[] = {0xffe5};
+    Emu *emu = emuCreate();
+    emuLoad(emu, prog, len, data, 2);
+    bool ok = emuRun(emu, 1000000, false) == 0;
+    uint64_t cycles = emuCycles(emu);
+
+    const uint64_t slices[] = {1, 7, 1000};
+    for (int engine = 0; engine < 2; engine++) {
+      emuSetEngine(emu, engine ? ENGINE_JIT : ENGINE_INTERPRETER);
+      for (int i = 0; i < 3; i++) {
+        emuLoad(emu, prog, len, data, 2);
+        EmuStatus status;
+        int steps = 0;
+        while ((status = emuStep(emu, slices[i])) == EMU_RUNNING) {
+          steps++;
+        }
+        ok = ok && status == EMU_HALTED && emuExitCode(emu) == 0 &&
+             emuCycles(emu) == cycles &&
+             steps == (int)(cycles / slices[i]);
+        // a finished program stays finished
+        ok = ok && emuStep(emu, 1000) == EMU_HALTED && emuCycles(emu) == cycles;
+      }
+    }
+    emuSetEngine(emu, ENGINE_INTERPRETER);
+
+    // the waiting program goes from running to waiting once it's been round
+    // the loop, and halts after the event
+    emuLoad(emu, wait, 5, NULL, 0);
+    eventSchedule(emuEvents(emu), 1000, setFlag, emuCpu(emu));
+    ok = ok && emuStep(emu, 0) == EMU_RUNNING && emuCycles(emu) == 0;
+    ok = ok && emuStep(emu, 3) == EMU_RUNNING;
+    ok = ok && emuStep(emu, 100) == EMU_WAITING && emuCycles(emu) == 103;
+    // a slice of 0 does nothing, whatever state it's in
+    ok = ok && emuStep(emu, 0) == EMU_WAITING && emuCycles(emu) == 103;
+    while (emuStep(emu, 100) == EMU_WAITING) {
+    }
+    ok = ok && emuExitCode(emu) == 0 && emuCycles(emu) == 1002;
+    ok = ok && emuStep(emu, 0) == EMU_HALTED && emuCycles(emu) == 1002;
+
+    // running for no cycles between an imm prefix and its instruction
+    // leaves the prefix pending. The program loops a few times, then ends
+    // with move a1, 0x1234; halt
+    const uint16_t prefixed[] = {0x1001, 0x1043, 0x117b, 0xffa5,
+                                 0x123d, 0x2041, 0x000c};
+    emuLoad(emu, prefixed, 7, NULL, 0);
+    CPU *cpu = emuCpu(emu);
+    while (!cpu->immValid && !cpu->halt) {
+      cpuRun(cpu, 1);
+    }
+    cpuRun(cpu, 0);
+    ok = ok && emuStep(emu, 0) == EMU_RUNNING && cpu->immValid;
+    ok = ok && emuStep(emu, 100) == EMU_HALTED && cpu->reg[2] == 0x1234;
+
+    // slices bigger than an int run all the way to the end
+    emuLoad(emu, spin, 1, NULL, 0);
+    ok = ok && emuStep(emu, 5000000000) == EMU_WAITING &&
+         emuCycles(emu) == 5000000000 && emuExitCode(emu) == 1;
+    emuDestroy(emu);
+
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // record a program summing an input device until an event sets a flag,
+  // with timer interrupts, from a snapshot part way through, then replay it
+  // from the snapshot without the device or the events, and check it does
+  // exactly the same thing
+  fprintf(stderr, "\n   io log\n");
+  {
+    // move a0, handler; wcsr vector, a0; move a0, 50; wcsr timer, a0
+    // move a0, 1; wcsr status, a0; move a2, 0; move s1, 0x10
+    // move a1, 0xfe00
+    // loop: load a0, [a1, 0]; add a2, a0; load s0, [s1, 0]; if.eq s0, 0
+    // jump loop; halt
+    // handler: add r6, 1; rets
+    const uint16_t prog[] = {0x1101, 0x1114, 0x1321, 0x3114, 0x1011, 0x0114,
+                             0x3001, 0x5101, 0xfe0d, 0x2001, 0x1202, 0x3140,
+                             0x4502, 0x402b, 0xff65, 0x000c, 0x6043, 0x0004};
+    const int len = sizeof(prog) / sizeof(prog[0]);
+    CPU *cpu = malloc(sizeof(CPU));
+    uint16_t *ram = calloc(0x10000, sizeof(uint16_t));
+    uint32_t input = 1;
+    Device devices[] = {
+        {.address = 0xfe00,
+         .size = 1,
+         .handler = inputHandler,
+         .context = &input},
+        {.address = 0,
+         .size = 0xffff,
+         .handler = memoryHandler,
+         .context = ram,
+         .memory = ram},
+    };
+    EventQueue events;
+    eventQueueInit(&events);
+    cpuInit(cpu, false);
+    cpu->events = &events;
+    cpuWriteProgMem(cpu, prog, len);
+    cpuInitBusDevices(cpu, devices, 2);
+
+    cpuRun(cpu, 100);
+    Snapshot *snap = cpuSnapshot(cpu);
+    IOLog log;
+    ioLogInit(&log);
+    ioLogRecord(&log, cpu);
+    eventSchedule(&events, 5000, setFlag, cpu);
+    // snapshots at every point in the loop, one of them right after a read
+    Snapshot *mids[6];
+    cpuRun(cpu, 2423);
+    for (int i = 0; i < 6; i++) {
+      mids[i] = cpuSnapshot(cpu);
+      cpuRun(cpu, 1);
+    }
+    cpuRun(cpu, 1000000);
+    uint64_t cycles = cpu->cycles;
+    uint16_t sum = cpu->reg[3];
+    uint16_t interrupts = cpu->reg[6];
+    bool ok = cpu->halt && interrupts > 50 && log.length > 0;
+    ioLogStop(&log);
+    ok = ok && ioLogSave(&log, "test.iolog");
+
+    IOLog replay;
+    ioLogInit(&replay);
+    ok = ok && ioLogLoad(&replay, "test.iolog") &&
+         replay.length == log.length;
+    remove("test.iolog");
+
+    // the device isn't read again, and the queue's timer event isn't run
+    cpuRestore(cpu, snap);
+    uint32_t before = input;
+    ok = ok && ioLogReplay(&replay, cpu);
+    cpuRun(cpu, 1000000);
+    ok = ok && cpu->halt && cpu->cycles == cycles && cpu->reg[3] == sum &&
+         cpu->reg[6] == interrupts && input == before && !replay.diverged;
+
+    // replaying from a snapshot part way through the log picks up from there
+    for (int i = 0; i < 6; i++) {
+      cpuRestore(cpu, mids[i]);
+      ok = ok && ioLogReplay(&replay, cpu);
+      cpuRun(cpu, 1000000);
+      ok = ok && cpu->halt && cpu->cycles == cycles && cpu->reg[3] == sum &&
+           cpu->reg[6] == interrupts && input == before && !replay.diverged;
+    }
+
+    // reading from somewhere else doesn't match the log
+    cpuRestore(cpu, snap);
+    ok = ok && ioLogReplay(&replay, cpu);
+    cpu->reg[2] = 0xfe01;
+    cpuRun(cpu, 1000000);
+    ok = ok && cpu->halt && replay.diverged;
+
+    // and replaying can't start before the log does
+    cpuReset(cpu);
+    ok = ok && !ioLogReplay(&replay, cpu);
+
+    ioLogDestroy(&replay);
+    ioLogDestroy(&log);
+    for (int i = 0; i < 6; i++) {
+      snapshotRelease(mids[i]);
+    }
+    snapshotRelease(snap);
+    cpuDestroy(cpu);
+    eventQueueDestroy(&events);
+    free(ram);
+    free(cpu);
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+
+  // a program that runs out of cycles says so in the output it was given,
+  // after what it printed, so a batch job's output has it
+  fprintf(stderr, "\n   failed to terminate\n");
+  {
+    // move a0, 0xff00; move a1, 0x41; store [a0, 0], a1; jump self
+    const uint16_t prog[] = {0xff0d, 0x1001, 0x2411, 0x2106, 0xffe5};
+    Emu *emu = emuCreate();
+    FILE *out = tmpfile();
+    char text[64] = {0};
+    bool ok = out != NULL;
+    if (ok) {
+      emuSetOutput(emu, out);
+      emuLoad(emu, prog, sizeof(prog) / sizeof(prog[0]), NULL, 0);
+      ok = emuRun(emu, 100, false) == 1;
+      emuSetOutput(emu, NULL);
+      rewind(out);
+      ok = ok && fread(text, 1, sizeof(text) - 1, out) > 0 &&
+           strcmp(text, "AProgram failed to terminate\n") == 0;
+      fclose(out);
+    }
+    emuDestroy(emu);
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL: %s\n", text);
+      failed++;
+    }
+  }
+
+#ifdef TEST_CC
+  // programs translated with emurj2c stop at the same point as the
+  // interpreter when they run out of cycles, with the same output, whether
+  // the limit falls just before or after a store to the console, the halt, or
+  // a jump through rcsr
+  fprintf(stderr, "\n   emurj2c cycle limit\n");
+  {
+    // move a0, 0xff00; move a1, 'A'; move a2, 8
+    // loop: store [a0, 0], a1; add a1, 1; sub a2, 1; if.ne a2, 0; jump loop
+    // halt
+    const uint16_t print[] = {0xff0d, 0x1001, 0x2411, 0x3081, 0x2106,
+                              0x2043, 0x3047, 0x302f, 0xff65, 0x000c};
+    // move a0, 0; self: rcsr a0
+    const uint16_t rcsr[] = {0x1001, 0x1010};
+    Emu *emu = emuCreate();
+    consoleSetSink(emuConsole(emu), consoleDiscardSink, NULL);
+    emuLoad(emu, print, 10, NULL, 0);
+    bool ok = emuRun(emu, 1000000, false) == 0;
+    uint64_t cycles = emuCycles(emu);
+    emuDestroy(emu);
+
+    // the first store is the fifth cycle, and the second one five later
+    const uint64_t limits[] = {4, 5, 9, 10, cycles - 1, cycles};
+    for (int i = 0; i < 6; i++) {
+      ok = checkTranslated(print, 10, limits[i]) && ok;
+    }
+    ok = checkTranslated(rcsr, 2, 1000) && ok;
+
+    if (ok) {
+      fprintf(stderr, "PASS\n");
+    } else {
+      fprintf(stderr, "FAIL\n");
+      failed++;
+    }
+  }
+#endif
+
   if (failed) {
     fprintf(stderr, "\nFAIL: %d tests\n", failed);
     return 1;
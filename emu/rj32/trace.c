@@ -0,0 +1,279 @@
+#include "trace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the size of a keyframe record, including its header
+#define TRACE_KEY_SIZE (1 + 8 + 16 * 2 + 2 + 2)
+
+Trace *traceCreate(int numChunks) {
+  if (numChunks < 1) {
+    numChunks = 1;
+  }
+  Trace *trace = calloc(1, sizeof(Trace));
+  if (trace == NULL) {
+    return NULL;
+  }
+  trace->chunks = malloc((size_t)numChunks * TRACE_CHUNK_SIZE);
+  trace->lengths = calloc(numChunks, sizeof(int));
+  if (trace->chunks == NULL || trace->lengths == NULL) {
+    free(trace->chunks);
+    free(trace->lengths);
+    free(trace);
+    return NULL;
+  }
+  trace->numChunks = numChunks;
+  traceSync(trace);
+  return trace;
+}
+
+// writeChunk writes a chunk to a trace file, prefixed with its length.
+static bool writeChunk(FILE *f, const uint8_t *chunk, int length) {
+  uint8_t header[4] = {length, length >> 8, length >> 16, length >> 24};
+  return fwrite(header, sizeof(header), 1, f) == 1 &&
+         fwrite(chunk, 1, length, f) == (size_t)length;
+}
+
+Trace *traceOpen(const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    return NULL;
+  }
+  Trace *trace = traceCreate(1);
+  if (trace == NULL || fwrite(TRACE_MAGIC, 8, 1, f) != 1) {
+    traceClose(trace);
+    fclose(f);
+    return NULL;
+  }
+  trace->file = f;
+  return trace;
+}
+
+bool traceSave(Trace *trace, const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fwrite(TRACE_MAGIC, 8, 1, f) == 1;
+  for (int i = trace->full; ok && i > 0; i--) {
+    int chunk = (trace->chunk - i + trace->numChunks) % trace->numChunks;
+    ok = writeChunk(f, trace->chunks + (size_t)chunk * TRACE_CHUNK_SIZE,
+                    trace->lengths[chunk]);
+  }
+  if (ok && trace->used > 0) {
+    ok = writeChunk(f, trace->chunks + (size_t)trace->chunk * TRACE_CHUNK_SIZE,
+                    trace->used);
+  }
+  if (fclose(f) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+bool traceClose(Trace *trace) {
+  if (trace == NULL) {
+    return true;
+  }
+  bool ok = !trace->failed;
+  if (trace->file != NULL) {
+    if (ok && trace->used > 0) {
+      ok = writeChunk(trace->file, trace->chunks, trace->used);
+    }
+    if (fclose(trace->file) != 0) {
+      ok = false;
+    }
+  }
+  free(trace->chunks);
+  free(trace->lengths);
+  free(trace);
+  return ok;
+}
+
+// traceNextChunk finishes the current chunk, either writing it to the file or
+// moving on to the next one in the ring, overwriting the oldest.
+static void traceNextChunk(Trace *trace) {
+  if (trace->file != NULL) {
+    if (!trace->failed &&
+        !writeChunk(trace->file, trace->chunks, trace->used)) {
+      trace->failed = true;
+    }
+  } else {
+    trace->lengths[trace->chunk] = trace->used;
+    trace->chunk = (trace->chunk + 1) % trace->numChunks;
+    if (trace->full < trace->numChunks - 1) {
+      trace->full++;
+    }
+  }
+  trace->used = 0;
+}
+
+void traceKey(Trace *trace, const TraceKey *key, bool immValid) {
+  if (trace->used > TRACE_CHUNK_SIZE - TRACE_MAX_RECORD) {
+    traceNextChunk(trace);
+  }
+
+  uint8_t *out = trace->chunks + (size_t)trace->chunk * TRACE_CHUNK_SIZE;
+  int pos = trace->used;
+  out[pos++] = TRACE_KEY | (immValid ? TRACE_IMM : 0);
+  for (int i = 0; i < 8; i++) {
+    out[pos++] = key->cycles >> (i * 8);
+  }
+  for (int r = 0; r < 16; r++) {
+    out[pos++] = key->reg[r];
+    out[pos++] = key->reg[r] >> 8;
+  }
+  out[pos++] = key->pc;
+  out[pos++] = key->pc >> 8;
+  out[pos++] = key->imm;
+  out[pos++] = key->imm >> 8;
+
+  trace->used = pos;
+  trace->limit = TRACE_CHUNK_SIZE - TRACE_MAX_RECORD;
+  trace->nextPc = key->pc;
+}
+
+void traceTriggerInit(TraceTrigger *trigger) {
+  memset(trigger, 0, sizeof(TraceTrigger));
+}
+
+void traceTriggerAddRange(TraceTrigger *trigger, uint16_t start,
+                          uint16_t end) {
+  for (int pc = start; pc <= end; pc++) {
+    trigger->pcs[pc / 64] |= (uint64_t)1 << (pc % 64);
+  }
+  trigger->pcFilter = true;
+}
+
+bool traceReaderOpen(TraceReader *reader, const char *filename) {
+  memset(reader, 0, sizeof(TraceReader));
+  reader->file = fopen(filename, "rb");
+  if (reader->file == NULL) {
+    return false;
+  }
+  char magic[8];
+  if (fread(magic, sizeof(magic), 1, reader->file) != 1 ||
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+    fclose(reader->file);
+    reader->file = NULL;
+    return false;
+  }
+  return true;
+}
+
+// readByte reads the next byte of the current chunk, or returns -1 past the
+// end of it.
+static int readByte(TraceReader *reader) {
+  if (reader->pos >= reader->length) {
+    return -1;
+  }
+  return reader->chunk[reader->pos++];
+}
+
+static bool readWord(TraceReader *reader, uint16_t *word) {
+  int lo = readByte(reader);
+  int hi = readByte(reader);
+  *word = lo | hi << 8;
+  return lo >= 0 && hi >= 0;
+}
+
+bool traceRead(TraceReader *reader, TraceRecord *record) {
+  if (reader->pos >= reader->length) {
+    uint8_t header[4];
+    if (fread(header, sizeof(header), 1, reader->file) != 1) {
+      return false;
+    }
+    reader->length = header[0] | header[1] << 8 | header[2] << 16 |
+                     (uint32_t)header[3] << 24;
+    reader->pos = 0;
+    if (reader->length <= 0 || reader->length > TRACE_CHUNK_SIZE ||
+        fread(reader->chunk, 1, reader->length, reader->file) !=
+            (size_t)reader->length) {
+      return false;
+    }
+  }
+
+  memset(record, 0, sizeof(TraceRecord));
+  record->flags = readByte(reader);
+  if (record->flags & TRACE_KEY) {
+    TraceKey *key = &record->key;
+    for (int i = 0; i < 8; i++) {
+      int b = readByte(reader);
+      if (b < 0) {
+        return false;
+      }
+      key->cycles |= (uint64_t)b << (i * 8);
+    }
+    bool ok = true;
+    for (int r = 0; r < 16; r++) {
+      ok = ok && readWord(reader, &key->reg[r]);
+    }
+    return ok && readWord(reader, &key->pc) && readWord(reader, &key->imm);
+  }
+
+  record->pc = reader->state.pc;
+  if (record->flags & TRACE_PC) {
+    uint16_t zigzag = 0;
+    for (int shift = 0;; shift += 7) {
+      int b = readByte(reader);
+      if (b < 0 || shift > 14) {
+        return false;
+      }
+      zigzag |= (b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        break;
+      }
+    }
+    int16_t delta = (int16_t)((zigzag >> 1) ^ -(zigzag & 1));
+    record->pc += delta;
+  }
+  if (record->flags & TRACE_VALUE) {
+    return readWord(reader, &record->value);
+  }
+  return true;
+}
+
+Inst traceInst(const TraceReader *reader, const Inst *prog,
+               const TraceRecord *record) {
+  if (reader->immValid) {
+    return instPrefix(prog[record->pc], reader->state.imm);
+  }
+  return prog[record->pc];
+}
+
+void traceApply(TraceReader *reader, const Inst *ir,
+                const TraceRecord *record) {
+  TraceKey *state = &reader->state;
+  if (ir == NULL) {
+    *state = record->key;
+    reader->immValid = (record->flags & TRACE_IMM) != 0;
+    reader->skip = false;
+    return;
+  }
+
+  int r = traceValueReg(ir);
+  if (r >= 0) {
+    state->reg[r] = record->value;
+  }
+  reader->skip = (record->flags & TRACE_SKIP) != 0;
+  reader->immValid = ir->op == IMM || ir->op == IMM2;
+  if (reader->immValid) {
+    state->imm = ir->imm << 4;
+  }
+
+  // the halt itself doesn't take a cycle
+  state->cycles += ir->len;
+  if (ir->op == HALT || ir->op == ERROR) {
+    state->cycles--;
+  }
+  state->pc = traceNextPc(ir, record->pc, reader->skip, state->reg);
+}
+
+void traceReaderClose(TraceReader *reader) {
+  if (reader->file != NULL) {
+    fclose(reader->file);
+    reader->file = NULL;
+  }
+}
@@ -0,0 +1,285 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "inst.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A binary trace records every instruction a CPU runs compactly enough to
+// trace billions of cycles. It's a stream of records, one per instruction,
+// each a header byte, followed by the pc as a delta from the pc the decoder
+// would expect if it isn't that, followed by the value written to a register
+// if the instruction writes one. Memory addresses and everything else the
+// text trace shows can be worked out from the register values and the
+// program, so the decoder only needs the ROM and the trace.
+//
+// The stream is split into chunks, each starting with a keyframe of the
+// whole CPU state, so a chunk can be decoded without the ones before it. A
+// trace is either kept in memory as a ring of the most recent chunks, to
+// find out what led up to a late failure, or streamed to a file.
+
+// TRACE_MAGIC is at the start of a trace file, followed by the chunks, each
+// a 32 bit length and then that many bytes of records.
+#define TRACE_MAGIC "rj32trc1"
+
+// the size of each chunk, and the largest a record can be, including the
+// keyframe that can come before it
+#define TRACE_CHUNK_SIZE 65536
+#define TRACE_MAX_RECORD 64
+
+// header byte flags of a record
+enum {
+  // the record is a keyframe
+  TRACE_KEY = 1 << 0,
+  // the pc isn't the one expected after the last instruction, and is
+  // followed by the difference as a zigzag encoded varint
+  TRACE_PC = 1 << 1,
+  // the instruction wrote a register, and is followed by the 16 bit value
+  TRACE_VALUE = 1 << 2,
+  // the instruction was an if.* that skipped the next instruction
+  TRACE_SKIP = 1 << 3,
+  // in a keyframe, the next instruction has an imm prefix pending
+  TRACE_IMM = 1 << 4,
+};
+
+// TraceKey is the CPU state in a keyframe.
+typedef struct TraceKey {
+  uint64_t cycles;
+  uint16_t reg[16];
+  uint16_t pc;
+  uint16_t imm;
+} TraceKey;
+
+// Trace records a binary trace of a CPU. When a CPU has a trace attached,
+// cpuRun switches to a variant of the run loop that records every
+// instruction into it.
+typedef struct Trace {
+  // the chunks of the ring, the length of each, the one being written, and
+  // how many are full
+  uint8_t *chunks;
+  int *lengths;
+  int numChunks;
+  int chunk;
+  int full;
+
+  // the write position in the current chunk, and the position past which a
+  // new chunk or keyframe has to be started before the next record
+  int used;
+  int limit;
+
+  // position of the header of the record being written, and the pc of the
+  // instruction it's for
+  int header;
+  uint16_t pc;
+
+  // the pc the next instruction is expected to be at
+  uint16_t nextPc;
+
+  // if not NULL, full chunks are written here instead of kept in the ring
+  FILE *file;
+
+  // set once writing a chunk to the file fails, after which no more are
+  // written, so traceClose can report it
+  bool failed;
+} Trace;
+
+// traceCreate allocates a trace that keeps the most recent numChunks chunks
+// in memory. Returns NULL if out of memory.
+Trace *traceCreate(int numChunks);
+
+// traceOpen creates a trace that's written to a file. Returns NULL if the
+// file can't be created.
+Trace *traceOpen(const char *filename);
+
+// traceSave writes the chunks in the ring to a file, oldest first, in the
+// same format as traceOpen. Returns false on error.
+bool traceSave(Trace *trace, const char *filename);
+
+// traceClose finishes writing the trace's file if it has one, and frees the
+// trace. Returns false if any of the file couldn't be written, during the run
+// or now. trace can be NULL.
+bool traceClose(Trace *trace);
+
+// traceSync makes the next record start with a keyframe. It's called each
+// time a run starts, since the CPU could have been changed in between.
+static inline void traceSync(Trace *trace) { trace->limit = -1; }
+
+// traceKey writes a keyframe, starting a new chunk if there isn't room for
+// it and another record.
+void traceKey(Trace *trace, const TraceKey *key, bool immValid);
+
+// traceNextPc returns the pc the instruction at pc goes to next, given the
+// registers after it ran and whether it skipped. This is known to both the
+// recorder and the decoder, so the pc only has to be recorded when something
+// else changes it.
+static inline uint16_t traceNextPc(const Inst *ir, uint16_t pc, bool skip,
+                                   const uint16_t *reg) {
+  uint16_t next = pc + ir->len;
+  switch (ir->op) {
+  case RCSR:
+    return reg[ir->rd] + 1;
+  case JUMP:
+  case CALL:
+    return ir->fmt == FMT_RR ? reg[ir->rs] + 1 : next + ir->imm;
+  default:
+    return skip ? next + ir->skip : next;
+  }
+}
+
+// traceValueReg returns the register the instruction writes, or -1 if it
+// doesn't write one.
+static inline int traceValueReg(const Inst *ir) {
+  switch (ir->op) {
+  case CALL:
+    return 0;
+  case MOVE:
+  case LOADC:
+  case LOAD:
+  case LOADB:
+  case ADD:
+  case SUB:
+  case ADDC:
+  case SUBC:
+  case XOR:
+  case AND:
+  case OR:
+  case SHL:
+  case SHR:
+  case ASR:
+    return ir->rd;
+  default:
+    return -1;
+  }
+}
+
+// traceBegin starts the record of the instruction at pc. Before calling it,
+// the caller has to check whether used is past limit, and if so write a
+// keyframe with traceKey first.
+static inline void traceBegin(Trace *trace, uint16_t pc) {
+  uint8_t *out = trace->chunks + (size_t)trace->chunk * TRACE_CHUNK_SIZE;
+  trace->header = trace->used;
+  trace->pc = pc;
+  out[trace->used++] = 0;
+  if (pc != trace->nextPc) {
+    // zigzag encode the difference, so small jumps either way are short
+    int16_t delta = (int16_t)(pc - trace->nextPc);
+    uint16_t zigzag = (uint16_t)(delta << 1) ^ (uint16_t)(delta >> 15);
+    out[trace->header] |= TRACE_PC;
+    while (zigzag >= 0x80) {
+      out[trace->used++] = zigzag | 0x80;
+      zigzag >>= 7;
+    }
+    out[trace->used++] = zigzag;
+  }
+}
+
+// traceEnd finishes the record of the instruction started by traceBegin,
+// with the register file after it ran.
+static inline void traceEnd(Trace *trace, const Inst *ir, const uint16_t *reg,
+                            bool skip) {
+  uint8_t *out = trace->chunks + (size_t)trace->chunk * TRACE_CHUNK_SIZE;
+  int r = traceValueReg(ir);
+  if (r >= 0) {
+    out[trace->header] |= TRACE_VALUE;
+    out[trace->used++] = reg[r];
+    out[trace->used++] = reg[r] >> 8;
+  }
+  if (skip) {
+    out[trace->header] |= TRACE_SKIP;
+  }
+  trace->nextPc = traceNextPc(ir, trace->pc, skip, reg);
+}
+
+// TraceTrigger limits tracing, text or binary, to the part of a run that's
+// of interest: from a cycle count on, after the first store to an address,
+// and only while the pc is in a set of ranges, with all the conditions that
+// are set having to be met. When a CPU has a trigger, cpuRun runs the regular
+// loop up to the start cycle, and a loop that only checks for the store and
+// the pc ranges while they aren't met, so only the window is traced.
+typedef struct TraceTrigger {
+  // tracing starts at this cycle count
+  uint64_t startCycle;
+
+  // if storeTrigger is set, tracing starts after the first store to
+  // storeAddress, which sets storeSeen, so it has to be cleared before the
+  // trigger is used for another run
+  bool storeTrigger;
+  bool storeSeen;
+  uint16_t storeAddress;
+
+  // if pcFilter is set, only instructions at the pcs set in the bitmap are
+  // traced
+  bool pcFilter;
+  uint64_t pcs[65536 / 64];
+} TraceTrigger;
+
+// traceTriggerInit sets up a trigger that traces everything.
+void traceTriggerInit(TraceTrigger *trigger);
+
+// traceTriggerAddRange adds the pcs from start to end inclusive to the pcs
+// that are traced, turning on the pc filter.
+void traceTriggerAddRange(TraceTrigger *trigger, uint16_t start,
+                          uint16_t end);
+
+// traceTriggerArmed returns whether the cycle and store conditions have been
+// met at the given cycle count.
+static inline bool traceTriggerArmed(const TraceTrigger *trigger,
+                                     uint64_t cycles) {
+  return cycles >= trigger->startCycle &&
+         (!trigger->storeTrigger || trigger->storeSeen);
+}
+
+// traceTriggerHas returns whether pc passes the pc filter.
+static inline bool traceTriggerHas(const TraceTrigger *trigger, uint16_t pc) {
+  return !trigger->pcFilter || (trigger->pcs[pc / 64] >> (pc % 64) & 1);
+}
+
+// TraceReader reads a trace file back, replaying it to keep track of the
+// CPU state after each record.
+typedef struct TraceReader {
+  FILE *file;
+  uint8_t chunk[TRACE_CHUNK_SIZE];
+  int length;
+  int pos;
+
+  // the CPU state after the last record, with the pc of the next
+  // instruction, and whether it has an imm prefix pending
+  TraceKey state;
+  bool immValid;
+  bool skip;
+} TraceReader;
+
+// TraceRecord is a record read back from a trace. For a keyframe, key is
+// filled in, otherwise pc and value are.
+typedef struct TraceRecord {
+  uint8_t flags;
+  uint16_t pc;
+  uint16_t value;
+  TraceKey key;
+} TraceRecord;
+
+// traceReaderOpen opens a trace file for reading. Returns false if it can't
+// be opened or isn't a trace.
+bool traceReaderOpen(TraceReader *reader, const char *filename);
+
+// traceRead reads the next record, returning false at the end of the trace
+// or if it's malformed. Each record has to be applied with traceApply before
+// reading the next one.
+bool traceRead(TraceReader *reader, TraceRecord *record);
+
+// traceInst returns the instruction an instruction record is for, from the
+// program the trace was recorded with.
+Inst traceInst(const TraceReader *reader, const Inst *prog,
+               const TraceRecord *record);
+
+// traceApply updates the reader's state with the record, where ir is the
+// instruction returned by traceInst, or NULL for a keyframe.
+void traceApply(TraceReader *reader, const Inst *ir,
+                const TraceRecord *record);
+
+// traceReaderClose closes the trace file.
+void traceReaderClose(TraceReader *reader);
+
+#endif
@@ -1,8 +1,12 @@
 #include "../emu/rj32/emurj.h"
+#include "../emu/rj32/image.h"
 #include "../libcustomasm/libcustomasm.h"
 #include "gosie.h"
 
-int compileAndRun(const char *source) {
+// compile compiles and assembles the source into a ROM, which has to be freed
+// with free_binary. Returns non-zero on error.
+static int compile(const char *source, const unsigned char **binary,
+                   size_t *binarySize) {
   Source src = (Source){source, strlen(source)};
   Tokenizer tokenizer;
   AST ast;
@@ -56,21 +60,69 @@ int compileAndRun(const char *source) {
 
   genCode(start, end, &ir);
 
-  const unsigned char *binary = NULL;
+  irFree(&ir);
+  astFree(&ast);
+  errFree(&errs);
 
-  AsmResult result = assemble_str_to_binary(assembly, &binary, &size);
+  AsmResult result = assemble_str_to_binary(assembly, binary, binarySize);
   if (result != Ok) {
     fprintf(stderr, "error: assembly failed\n");
     return 1;
   }
+  return 0;
+}
 
-  int code = runRj32Emu(100000, (uint16_t *)binary, size / 2, NULL, 0, true);
+int compileAndRun(const char *source) {
+  const unsigned char *binary = NULL;
+  size_t size;
+  if (compile(source, &binary, &size) != 0) {
+    return 1;
+  }
+
+  int code = runRj32Emu(100000, (uint16_t *)binary, size / 2, NULL, 0, true,
+                        ENGINE_INTERPRETER);
 
   free_binary(binary, size);
+  return code;
+}
 
-  irFree(&ir);
-  astFree(&ast);
-  errFree(&errs);
+int compileToImage(const char *source, const char *filename) {
+  const unsigned char *binary = NULL;
+  size_t size;
+  if (compile(source, &binary, &size) != 0) {
+    return 1;
+  }
 
+  // the assembler puts the data bank after the program memory in the ROM,
+  // but it's loaded at its own address, unlike a raw ROM, whose data emurj
+  // loads at 0 (see IMAGE_DATA_ADDRESS). customasm doesn't give back its
+  // labels, so there are no symbols yet, and the program starts at 0.
+  const uint16_t *words = (const uint16_t *)binary;
+  size_t length = size / 2;
+  ImageSection sections[2] = {{
+      .kind = IMAGE_CODE,
+      .length = length < IMAGE_RAW_CODE_SIZE ? length : IMAGE_RAW_CODE_SIZE,
+  }};
+  const uint16_t *contents[2] = {words, words + IMAGE_RAW_CODE_SIZE};
+  int numSections = 1;
+  if (length > IMAGE_RAW_CODE_SIZE) {
+    length -= IMAGE_RAW_CODE_SIZE;
+    if (length > 0x10000 - IMAGE_DATA_ADDRESS) {
+      length = 0x10000 - IMAGE_DATA_ADDRESS;
+    }
+    sections[numSections++] = (ImageSection){
+        .kind = IMAGE_DATA,
+        .address = IMAGE_DATA_ADDRESS,
+        .length = length,
+    };
+  }
+
+  int code = 0;
+  if (!imageWrite(filename, 0, sections, contents, numSections, NULL, 0)) {
+    fprintf(stderr, "error: could not write %s\n", filename);
+    code = 1;
+  }
+
+  free_binary(binary, size);
   return code;
-}
\ No newline at end of file
+}
@@ -1,10 +1,15 @@
 #include "gosie.h"
 
 #include <stdio.h>
+#include <string.h>
 
 int main(int argc, const char *argv[]) {
+  // -o writes the compiled program to an image instead of running it
+  if (argc == 4 && strcmp(argv[1], "-o") == 0) {
+    return compileToImage(argv[3], argv[2]);
+  }
   if (argc != 2) {
-    fprintf(stderr, "usage: %s <source>\n", argv[0]);
+    fprintf(stderr, "usage: %s [-o <image>] <source>\n", argv[0]);
     return 1;
   }
 
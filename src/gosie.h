@@ -194,6 +194,10 @@ char *genCode(char *start, char *end, IR *ir);
 
 int compileAndRun(const char *source);
 
+// compileToImage compiles the source and writes it to an image file that
+// emurj can load, instead of running it. Returns non-zero on error.
+int compileToImage(const char *source, const char *filename);
+
 #pragma endregion
 
 #pragma region Err